@@ -4,12 +4,18 @@
 #include <QCommandLineOption>
 
 #include "wmcore.h"
+#include "wmsupervisor.h"
 
 int main(int argc, char *argv[])
 {
+    // The shim never starts Qt's event loop, see WMSupervisor
+    if (WMSupervisor::requested(argc, argv))
+        return WMSupervisor::run(argc, argv);
+
     QCoreApplication a(argc, argv);
     QCommandLineParser parser;
     parser.addOption(QCommandLineOption(QStringList() << "c" << "config", "Configuration file", "config"));
+    parser.addOption(QCommandLineOption("supervise", "Run under a subreaper shim that keeps the stations' exit codes"));
     parser.process(a);
 
     WMCore core(parser.value("config"), &a);
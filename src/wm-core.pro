@@ -16,7 +16,28 @@ SOURCES += main.cpp \
     wmcontrolserver.cpp \
     wmcontrolclient.cpp \
     wmlogger.cpp \
-    wmauthutil.cpp
+    wmauthutil.cpp \
+    wmlagmonitor.cpp \
+    wmtracer.cpp \
+    wmstatestore.cpp \
+    wmhistory.cpp \
+    wmsignalhandler.cpp \
+    wmspawner.cpp \
+    wmtokenbucket.cpp \
+    wmrollingrestart.cpp \
+    wmlocalcontrolclient.cpp \
+    wmcluster.cpp \
+    wmreaper.cpp \
+    wmsupervisor.cpp \
+    wmexitjournal.cpp \
+    wmprocscan.cpp \
+    wmtimerwheel.cpp \
+    wmstatejournal.cpp \
+    wmscriptcheck.cpp \
+    wmspawnscheduler.cpp \
+    wmpressuremonitor.cpp \
+    wmstreamprobe.cpp \
+    wmlatencyhistogram.cpp
 
 # The following define makes your compiler emit warnings if you use
 # any feature of Qt which as been marked deprecated (the exact warnings
@@ -37,4 +58,25 @@ HEADERS += \
     wmcontrolserver.h \
     wmcontrolclient.h \
     wmlogger.h \
-    wmauthutil.h
+    wmauthutil.h \
+    wmlagmonitor.h \
+    wmtracer.h \
+    wmstatestore.h \
+    wmhistory.h \
+    wmsignalhandler.h \
+    wmspawner.h \
+    wmtokenbucket.h \
+    wmrollingrestart.h \
+    wmlocalcontrolclient.h \
+    wmcluster.h \
+    wmreaper.h \
+    wmsupervisor.h \
+    wmexitjournal.h \
+    wmprocscan.h \
+    wmtimerwheel.h \
+    wmstatejournal.h \
+    wmscriptcheck.h \
+    wmspawnscheduler.h \
+    wmpressuremonitor.h \
+    wmstreamprobe.h \
+    wmlatencyhistogram.h
@@ -7,8 +7,8 @@ WMAuthUtil::WMAuthUtil(QObject *parent) : QObject(parent)
 
 int WMAuthUtil::rangedRand(int min, int max)
 {
-    // srand (time(NULL));
-    return min + (rand() % (max - min + 1));
+    // Nonces and tickets depend on it, so it comes from the system CSPRNG
+    return QRandomGenerator::system()->bounded(min, max + 1);
 }
 
 QString WMAuthUtil::sha256(QString text)
@@ -35,3 +35,52 @@ QString WMAuthUtil::authHash(QString secret, QString nonce)
 {
     return sha256(sha256(secret) + nonce);
 }
+
+bool WMAuthUtil::secureEquals(QByteArray a, QByteArray b)
+{
+    if (a.size() != b.size())
+        return false;
+
+    unsigned char diff = 0;
+    for (int i = 0; i < a.size(); i++)
+        diff |= (unsigned char)(a.at(i) ^ b.at(i));
+
+    return diff == 0;
+}
+
+QByteArray WMAuthUtil::ticketKey(QString secret)
+{
+    return QCryptographicHash::hash(QByteArray("wmcore-session-ticket:") + secret.toUtf8(), QCryptographicHash::Sha256);
+}
+
+QString WMAuthUtil::issueTicket(QByteArray key, qint64 expiresAt)
+{
+    QByteArray payload = QString("1|%1|%2").arg(expiresAt).arg(randomString(16)).toUtf8();
+    QByteArray mac = QMessageAuthenticationCode::hash(payload, key, QCryptographicHash::Sha256);
+
+    QByteArray::Base64Options options = QByteArray::Base64UrlEncoding | QByteArray::OmitTrailingEquals;
+
+    return QString("%1.%2").arg(QString(payload.toBase64(options))).arg(QString(mac.toBase64(options)));
+}
+
+bool WMAuthUtil::verifyTicket(QByteArray key, QString ticket, qint64 now)
+{
+    QStringList parts = ticket.split('.');
+
+    if (parts.count() != 2)
+        return false;
+
+    QByteArray::Base64Options options = QByteArray::Base64UrlEncoding | QByteArray::OmitTrailingEquals;
+    QByteArray payload = QByteArray::fromBase64(parts.at(0).toLatin1(), options);
+    QByteArray mac = QByteArray::fromBase64(parts.at(1).toLatin1(), options);
+
+    if (!secureEquals(mac, QMessageAuthenticationCode::hash(payload, key, QCryptographicHash::Sha256)))
+        return false;
+
+    QList<QByteArray> fields = payload.split('|');
+
+    if (fields.count() != 3 || fields.at(0) != "1")
+        return false;
+
+    return fields.at(1).toLongLong() > now;
+}
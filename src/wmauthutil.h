@@ -8,8 +8,9 @@
 #include <QString>
 #include <QByteArray>
 #include <QCryptographicHash>
-#include <cstdlib>
-#include <ctime>
+#include <QMessageAuthenticationCode>
+#include <QRandomGenerator>
+#include <QStringList>
 
 class WMAuthUtil : public QObject
 {
@@ -21,6 +22,13 @@ public:
     static QString sha256 (QString text);
     static QString randomString (int length = 64);
     static QString authHash (QString secret, QString nonce);
+    static bool secureEquals (QByteArray a, QByteArray b);
+
+    // Session tickets: stateless, HMAC-signed with a key derived from the
+    // access secret, so rotating the secret revokes all of them at once
+    static QByteArray ticketKey (QString secret);
+    static QString issueTicket (QByteArray key, qint64 expiresAt);
+    static bool verifyTicket (QByteArray key, QString ticket, qint64 now);
 
 signals:
 
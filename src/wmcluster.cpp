@@ -0,0 +1,314 @@
+#include "wmcluster.h"
+
+WMCluster::WMCluster(QString nodeId, int capacity, quint16 port, QStringList peers, QByteArray key,
+                     int heartbeatInterval, int peerTimeout, QObject *parent) :
+    QObject(parent), localId(nodeId), capacity(qMax(capacity, 1)), port(port), key(key),
+    heartbeatInterval(heartbeatInterval), peerTimeout(peerTimeout), settled(false)
+{
+    for (int i = 0; i < peers.count(); i++)
+    {
+        QString peer = peers.at(i).trimmed();
+        int colon = peer.lastIndexOf(':');
+        QHostAddress address(peer.left(colon));
+        int peerPort = peer.mid(colon + 1).toInt();
+
+        if (colon <= 0 || address.isNull() || peerPort <= 0 || peerPort > 65535)
+        {
+            log (QString("Bad cluster peer %1, expected ip:port").arg(peer), WMLogger::Warning);
+            continue;
+        }
+
+        this->peers.append(qMakePair(address, (quint16)peerPort));
+    }
+
+    socket = new QUdpSocket(this);
+    connect(socket, SIGNAL(readyRead()), this, SLOT(onReadyRead()));
+
+    heartbeatTimer = new QTimer(this);
+    heartbeatTimer->setInterval(heartbeatInterval);
+    connect(heartbeatTimer, SIGNAL(timeout()), this, SLOT(onHeartbeatTimer()));
+
+    settleTimer = new QTimer(this);
+    settleTimer->setSingleShot(true);
+    connect(settleTimer, SIGNAL(timeout()), this, SLOT(onSettleTimer()));
+}
+
+WMCluster::~WMCluster()
+{
+    stop();
+}
+
+bool WMCluster::start()
+{
+    // Unsigned heartbeats would let anyone who reaches the port claim every station
+    if (key.isEmpty())
+    {
+        log ("No cluster key set, refusing to run unauthenticated heartbeats", WMLogger::Error);
+        return false;
+    }
+
+    if (!socket->bind(QHostAddress::Any, port, QUdpSocket::ShareAddress | QUdpSocket::ReuseAddressHint))
+    {
+        log (QString("Could not bind the cluster port %1: %2").arg(port).arg(socket->errorString()), WMLogger::Error);
+        return false;
+    }
+
+    Member self;
+    self.capacity = capacity;
+    self.lastSeen = QDateTime::currentMSecsSinceEpoch();
+    members.insert(localId, self);
+    rebuildRing();
+
+    heartbeatTimer->start();
+    sendHeartbeat(capacity);
+
+    // Place nothing until every live peer has had the chance to be heard,
+    // otherwise a starting node would briefly claim the whole catalog
+    settleTimer->start(peerTimeout);
+
+    log (QString("Cluster node %1 with capacity %2 listening on UDP port %3, %4 peers configured")
+         .arg(localId).arg(capacity).arg(port).arg(peers.count()), WMLogger::Info);
+    return true;
+}
+
+void WMCluster::stop()
+{
+    if (!heartbeatTimer->isActive())
+        return;
+
+    heartbeatTimer->stop();
+    settleTimer->stop();
+
+    // Zero capacity tells the peers we are leaving, so they take over now
+    sendHeartbeat(0);
+    socket->close();
+}
+
+QString WMCluster::nodeId()
+{
+    return localId;
+}
+
+QString WMCluster::ownerOf(QString tag)
+{
+    if (ring.isEmpty())
+        return QString();
+
+    QMap<quint64, QString>::const_iterator it = ring.lowerBound(hash(tag));
+
+    if (it == ring.constEnd())
+        it = ring.constBegin();
+
+    return it.value();
+}
+
+bool WMCluster::owns(QString tag)
+{
+    return settled && ownerOf(tag) == localId;
+}
+
+bool WMCluster::isSettled()
+{
+    return settled;
+}
+
+// Goes out with the next heartbeat
+void WMCluster::setServing(QStringList tags)
+{
+    serving = tags;
+}
+
+bool WMCluster::isServing(QString node, QString tag)
+{
+    if (node == localId)
+        return serving.contains(tag);
+
+    return members.contains(node) && members.value(node).serving.contains(tag);
+}
+
+// "<node> <capacity> <self|alive> <ms since last heartbeat>"
+QStringList WMCluster::nodes()
+{
+    QStringList list;
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+
+    QMap<QString, Member>::const_iterator it;
+    for (it = members.constBegin(); it != members.constEnd(); ++it)
+    {
+        list.append(QString("%1 %2 %3 %4").arg(it.key()).arg(it.value().capacity)
+                    .arg(it.key() == localId ? "self" : "alive")
+                    .arg(it.key() == localId ? 0 : now - it.value().lastSeen));
+    }
+
+    return list;
+}
+
+// Must be the same on every node, so no qHash (it is seeded per process)
+quint64 WMCluster::hash(QString value)
+{
+    QByteArray digest = QCryptographicHash::hash(value.toUtf8(), QCryptographicHash::Sha1);
+    return qFromBigEndian<quint64>((const uchar *)digest.constData());
+}
+
+QByteArray WMCluster::sign(QByteArray payload)
+{
+    return QMessageAuthenticationCode::hash(payload, key, QCryptographicHash::Sha256).toHex();
+}
+
+void WMCluster::sendHeartbeat(int capacity)
+{
+    QJsonObject heartbeat;
+    heartbeat.insert("node", localId);
+    heartbeat.insert("capacity", capacity);
+    heartbeat.insert("ts", (double)QDateTime::currentMSecsSinceEpoch());
+
+    if (capacity > 0)
+        heartbeat.insert("serving", QJsonArray::fromStringList(serving));
+
+    QByteArray payload = QJsonDocument(heartbeat).toJson(QJsonDocument::Compact);
+    QByteArray datagram = payload + " " + sign(payload);
+
+    for (int i = 0; i < peers.count(); i++)
+        socket->writeDatagram(datagram, peers.at(i).first, peers.at(i).second);
+}
+
+void WMCluster::expireMembers()
+{
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    bool changed = false;
+
+    QMap<QString, Member>::iterator it = members.begin();
+    while (it != members.end())
+    {
+        if (it.key() != localId && now - it.value().lastSeen > peerTimeout)
+        {
+            log (QString("Cluster node %1 has not been heard of for %2 ms, dropping it")
+                 .arg(it.key()).arg(now - it.value().lastSeen), WMLogger::Warning);
+            it = members.erase(it);
+            changed = true;
+        }
+        else
+            ++it;
+    }
+
+    if (changed)
+        rebuildRing();
+}
+
+void WMCluster::rebuildRing()
+{
+    ring.clear();
+
+    QMap<QString, Member>::const_iterator it;
+    for (it = members.constBegin(); it != members.constEnd(); ++it)
+    {
+        int points = qMin(it.value().capacity, (int)maxPointsPerNode);
+
+        for (int i = 0; i < points; i++)
+            ring.insert(hash(QString("%1#%2").arg(it.key()).arg(i)), it.key());
+    }
+
+    log (QString("Cluster membership: %1 nodes, %2 ring points").arg(members.count()).arg(ring.count()), WMLogger::Info);
+
+    if (settled)
+        emit membershipChanged();
+}
+
+void WMCluster::log(QString message, WMLogger::LogLevel level)
+{
+    WMLogger::instance->log(message, level, "wclst");
+}
+
+void WMCluster::onHeartbeatTimer()
+{
+    WMLagMonitor::HandlerScope handlerScope("WMCluster::onHeartbeatTimer");
+
+    sendHeartbeat(capacity);
+    expireMembers();
+}
+
+void WMCluster::onSettleTimer()
+{
+    settled = true;
+
+    log (QString("Cluster settled with %1 nodes").arg(members.count()), WMLogger::Info);
+    emit membershipChanged();
+}
+
+void WMCluster::onReadyRead()
+{
+    WMLagMonitor::HandlerScope handlerScope("WMCluster::onReadyRead");
+
+    bool servingUpdated = false;
+
+    while (socket->hasPendingDatagrams())
+    {
+        QByteArray datagram;
+        datagram.resize(socket->pendingDatagramSize());
+        socket->readDatagram(datagram.data(), datagram.size());
+
+        int space = datagram.lastIndexOf(' ');
+        QByteArray payload = datagram.left(space);
+
+        if (space <= 0 || !WMAuthUtil::secureEquals(datagram.mid(space + 1), sign(payload)))
+        {
+            log ("Dropping a cluster heartbeat with a bad signature", WMLogger::Warning);
+            continue;
+        }
+
+        QJsonObject heartbeat = QJsonDocument::fromJson(payload).object();
+        QString node = heartbeat.value("node").toString();
+        int nodeCapacity = heartbeat.value("capacity").toInt();
+        qint64 stamp = (qint64)heartbeat.value("ts").toDouble();
+        qint64 now = QDateTime::currentMSecsSinceEpoch();
+
+        if (node.isEmpty() || node == localId)
+            continue;
+
+        // Replays: older than what we have seen from the node, or too old to be a live heartbeat
+        if (stamp <= lastStamps.value(node, 0) || qAbs(now - stamp) > peerTimeout)
+        {
+            log (QString("Dropping a stale or replayed heartbeat of cluster node %1").arg(node));
+            continue;
+        }
+
+        lastStamps.insert(node, stamp);
+
+        if (nodeCapacity <= 0)
+        {
+            if (members.remove(node) > 0)
+            {
+                log (QString("Cluster node %1 is leaving").arg(node), WMLogger::Info);
+                rebuildRing();
+            }
+
+            continue;
+        }
+
+        bool changed = !members.contains(node) || members.value(node).capacity != nodeCapacity;
+
+        QSet<QString> nodeServing;
+        QJsonArray servingList = heartbeat.value("serving").toArray();
+        for (int i = 0; i < servingList.count(); i++)
+            nodeServing.insert(servingList.at(i).toString());
+
+        Member &member = members[node];
+        member.capacity = nodeCapacity;
+        member.lastSeen = now;
+
+        if (member.serving != nodeServing)
+        {
+            member.serving = nodeServing;
+            servingUpdated = true;
+        }
+
+        if (changed)
+        {
+            log (QString("Cluster node %1 is up with capacity %2").arg(node).arg(nodeCapacity), WMLogger::Info);
+            rebuildRing();
+        }
+    }
+
+    if (servingUpdated)
+        emit servingChanged();
+}
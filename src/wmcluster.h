@@ -0,0 +1,103 @@
+#ifndef WMCLUSTER_H
+#define WMCLUSTER_H
+
+#include <QObject>
+
+#include <QString>
+#include <QStringList>
+#include <QMap>
+#include <QList>
+#include <QPair>
+#include <QSet>
+#include <QTimer>
+#include <QDateTime>
+#include <QUdpSocket>
+#include <QHostAddress>
+#include <QCryptographicHash>
+#include <QMessageAuthenticationCode>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QJsonArray>
+#include <QtEndian>
+
+#include "wmlogger.h"
+#include "wmlagmonitor.h"
+#include "wmauthutil.h"
+
+// Membership and placement for several wmcored nodes sharing one catalog.
+// Nodes exchange signed UDP heartbeats; every live node gets points on a
+// hash ring in proportion to its capacity, and an instance belongs to the
+// first point after its own hash. All nodes compute the same placement
+// from the same membership, so nothing else needs to be agreed on.
+// The key is mandatory, and heartbeats stamped further than peer_timeout
+// from our clock are dropped, so node clocks have to be kept in sync.
+// Heartbeats also list the stations a node is running, so a station that
+// moves is only stopped by its old owner once the new one has it up.
+class WMCluster : public QObject
+{
+    Q_OBJECT
+public:
+    explicit WMCluster(QString nodeId, int capacity, quint16 port, QStringList peers, QByteArray key,
+                       int heartbeatInterval = 1000, int peerTimeout = 5000, QObject *parent = 0);
+    ~WMCluster();
+
+    bool start();
+    void stop();
+
+    QString nodeId();
+    QString ownerOf(QString tag);
+    bool owns(QString tag);
+    bool isSettled();
+    QStringList nodes();
+
+    void setServing(QStringList tags);
+    bool isServing(QString node, QString tag);
+
+private:
+
+    struct Member
+    {
+        int capacity;
+        qint64 lastSeen;      // ms since epoch, local clock
+        QSet<QString> serving;
+    };
+
+    QString localId;
+    int capacity;
+    quint16 port;
+    QByteArray key;
+    int heartbeatInterval;
+    int peerTimeout;
+    bool settled;
+    QStringList serving;
+
+    QList<QPair<QHostAddress, quint16> > peers;
+    QMap<QString, Member> members;
+    QMap<QString, qint64> lastStamps;  // every node ever heard, so departed ones can't be replayed back
+    QMap<quint64, QString> ring;
+
+    QUdpSocket *socket;
+    QTimer *heartbeatTimer;
+    QTimer *settleTimer;
+
+    static const int maxPointsPerNode = 1000;
+
+    static quint64 hash(QString value);
+    QByteArray sign(QByteArray payload);
+    void sendHeartbeat(int capacity);
+    void expireMembers();
+    void rebuildRing();
+
+    void log(QString message, WMLogger::LogLevel level = WMLogger::Debug);
+
+signals:
+    void membershipChanged();
+    void servingChanged();
+
+private slots:
+    void onHeartbeatTimer();
+    void onSettleTimer();
+    void onReadyRead();
+};
+
+#endif // WMCLUSTER_H
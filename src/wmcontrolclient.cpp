@@ -1,22 +1,134 @@
 #include "wmcontrolclient.h"
 
+QElapsedTimer WMControlClient::clock;
+
 WMControlClient::WMControlClient(QWebSocket *sock, QObject *parent) : QObject(parent), sock(sock)
 {
     isAuthorized = false;
+    protoVersion = 1;
+    replying = false;
+
+    if (!clock.isValid())
+        clock.start();
+
+    authTimerId = 0;
+    batchStart = -1;
+
+    // Other transports pass no WebSocket and hook up their own socket
+    if (sock == NULL)
+    {
+        cborEncoding = false;
+        return;
+    }
+
+    // Binary encoding is picked at connect time: ws://host:port/?encoding=cbor
+    cborEncoding = (QUrlQuery(sock->requestUrl()).queryItemValue("encoding") == "cbor");
 
     connect (sock, SIGNAL(textMessageReceived(QString)), this, SLOT(onSocketMessage(QString)));
+    connect (sock, SIGNAL(binaryMessageReceived(QByteArray)), this, SLOT(onSocketBinaryMessage(QByteArray)));
     connect (sock, SIGNAL(disconnected()), this, SLOT(onSocketDisconnect()));
 }
 
+WMControlClient::~WMControlClient()
+{
+    WMTimerWheel::instance->cancel(authTimerId);
+
+    // The server parents every socket to itself, don't let them pile up
+    if (sock != NULL)
+        sock->deleteLater();
+}
+
 void WMControlClient::sendCommand(QString command)
 {
-    if (sock->isValid())
-        sock->sendTextMessage(command);
+    if (replying)
+    {
+        replyLines.append(command);
+        return;
+    }
+
+    WMEncodedMessage message;
+    message.text = command;
+
+    sendEncoded(message);
+}
+
+// Broadcasts and published events go out right away even while a v2 reply
+// is being collected; only the requester's own sendCommand() output belongs
+// to the reply
+void WMControlClient::sendEncoded(WMEncodedMessage &message)
+{
+    // Unsolicited messages (broadcasts) carry no id in v2
+    if (cborEncoding && protoVersion >= 2)
+    {
+        if (message.cborEvent.isEmpty())
+        {
+            QCborMap event;
+            event.insert(QString("event"), tokenize(message.text));
+            message.cborEvent = event.toCborValue().toCbor();
+        }
+
+        sendBinaryMessage(message.cborEvent);
+        return;
+    }
+
+    if (cborEncoding)
+    {
+        if (message.cbor.isEmpty())
+            message.cbor = tokenize(message.text).toCborValue().toCbor();
+
+        sendBinaryMessage(message.cbor);
+        return;
+    }
+
+    if (protoVersion >= 2)
+    {
+        if (message.jsonEvent.isEmpty())
+        {
+            QJsonObject event;
+            event.insert("event", message.text);
+            message.jsonEvent = QString::fromUtf8(QJsonDocument(event).toJson(QJsonDocument::Compact));
+        }
+
+        sendMessage(message.jsonEvent);
+        return;
+    }
+
+    sendMessage(message.text);
+}
+
+void WMControlClient::sendError(int code, QString comment)
+{
+    if (protoVersion < 2 && !replying)
+    {
+        sendCommand(QString("ERROR %1 #%2").arg(code).arg(comment));
+        return;
+    }
+
+    QJsonObject error;
+    error.insert("code", code);
+    error.insert("message", comment);
+
+    if (replying)
+    {
+        replyError = error;
+        return;
+    }
+
+    QJsonObject message;
+    message.insert("error", error);
+
+    sendObject(message);
 }
 
 void WMControlClient::setAuthorized(bool auth)
 {
     isAuthorized = auth;
+
+    if (auth)
+    {
+        WMTimerWheel::instance->cancel(authTimerId);
+        authTimerId = 0;
+    }
 }
 
 void WMControlClient::setChallengeNonce(QString nonce)
@@ -34,11 +146,198 @@ QString WMControlClient::challengeNonce()
     return chNonce;
 }
 
+// A resuming client passes its session ticket in the connection URL: ws://host:port/?ticket=...
+QString WMControlClient::requestTicket()
+{
+    return QUrlQuery(sock->requestUrl()).queryItemValue("ticket");
+}
+
+QString WMControlClient::address()
+{
+    return sock->peerAddress().toString();
+}
+
+void WMControlClient::setCommandRate(double rate, double burst)
+{
+    commandBucket = WMTokenBucket(rate, burst);
+}
+
+bool WMControlClient::takeCommandToken()
+{
+    return commandBucket.take(clock.elapsed());
+}
+
+void WMControlClient::startAuthDeadline(int msec)
+{
+    if (msec > 0 && !isAuthorized)
+        authTimerId = WMTimerWheel::instance->schedule(msec, this, "onAuthTimer");
+}
+
+bool WMControlClient::binary()
+{
+    return cborEncoding;
+}
+
+int WMControlClient::protocolVersion()
+{
+    return protoVersion;
+}
+
+void WMControlClient::setProtocolVersion(int version)
+{
+    protoVersion = version;
+}
+
+void WMControlClient::subscribe(QString topic)
+{
+    topics.insert(topic);
+}
+
+void WMControlClient::unsubscribe(QString topic)
+{
+    topics.remove(topic);
+}
+
+bool WMControlClient::isSubscribed(QString topic)
+{
+    return topics.contains(topic);
+}
+
+qint64 WMControlClient::queuedFor()
+{
+    if (batchStart < 0)
+        return 0;
+
+    return (clock.nsecsElapsed() - batchStart) / 1000;
+}
+
+// Everything read from the socket in one go is one batch; it ends when
+// control gets back to the event loop
+void WMControlClient::markReceived()
+{
+    if (batchStart >= 0)
+        return;
+
+    batchStart = clock.nsecsElapsed();
+    QMetaObject::invokeMethod(this, "onBatchDone", Qt::QueuedConnection);
+}
+
+void WMControlClient::beginReply(QJsonValue id)
+{
+    replying = true;
+    replyId = id.isUndefined() ? QJsonValue() : id;
+    replyLines = QJsonArray();
+    replyResults = QJsonArray();
+    replyError = QJsonObject();
+}
+
+void WMControlClient::addReplyResult(QJsonObject result)
+{
+    replyResults.append(result);
+}
+
+void WMControlClient::endReply()
+{
+    if (!replying)
+        return;
+
+    replying = false;
+
+    QJsonObject reply;
+    reply.insert("id", replyId);
+    reply.insert("ok", replyError.isEmpty());
+
+    if (!replyError.isEmpty())
+        reply.insert("error", replyError);
+
+    if (!replyLines.isEmpty())
+        reply.insert("lines", replyLines);
+
+    if (!replyResults.isEmpty())
+        reply.insert("results", replyResults);
+
+    sendObject(reply);
+
+    replyLines = QJsonArray();
+    replyResults = QJsonArray();
+}
+
 void WMControlClient::close()
 {
     sock->close();
 }
 
+void WMControlClient::flush()
+{
+    if (sock->isValid())
+        sock->flush();
+}
+
+void WMControlClient::sendMessage(QString message)
+{
+    if (sock->isValid())
+        sock->sendTextMessage(message);
+}
+
+void WMControlClient::sendBinaryMessage(QByteArray message)
+{
+    if (sock->isValid())
+        sock->sendBinaryMessage(message);
+}
+
+void WMControlClient::sendObject(QJsonObject object)
+{
+    if (!cborEncoding)
+    {
+        sendMessage(QString::fromUtf8(QJsonDocument(object).toJson(QJsonDocument::Compact)));
+        return;
+    }
+
+    QCborMap map = QCborMap::fromJsonObject(object);
+
+    if (object.contains("lines"))
+    {
+        QJsonArray lines = object.value("lines").toArray();
+        QCborArray tokenized;
+
+        for (int i = 0; i < lines.count(); i++)
+            tokenized.append(tokenize(lines.at(i).toString()));
+
+        map.insert(QString("lines"), tokenized);
+    }
+
+    sendBinaryMessage(map.toCborValue().toCbor());
+}
+
+// "SERVICE INSTANCE liquidsoap rock up" -> ["SERVICE", "INSTANCE", "liquidsoap", "rock", "up"];
+// integers become CBOR integers and a trailing "#comment" stays one string
+QCborArray WMControlClient::tokenize(QString line)
+{
+    QCborArray tokens;
+    QStringList words = line.split(" ", QString::SkipEmptyParts);
+
+    for (int i = 0; i < words.count(); i++)
+    {
+        QString word = words.at(i);
+
+        if (word.startsWith('#'))
+        {
+            tokens.append(words.mid(i).join(" "));
+            break;
+        }
+
+        bool isNumber = false;
+        qlonglong number = word.toLongLong(&isNumber);
+
+        if (isNumber && QString::number(number) == word)
+            tokens.append(number);
+        else
+            tokens.append(word);
+    }
+
+    return tokens;
+}
+
 void WMControlClient::log(QString message, WMLogger::LogLevel level)
 {
     WMLogger::instance->log(message, level, "wclnt");
@@ -46,12 +345,64 @@ void WMControlClient::log(QString message, WMLogger::LogLevel level)
 
 void WMControlClient::onSocketMessage(QString message)
 {
+    markReceived();
     emit newCommandReceived(message);
 }
 
+// Binary clients send a CBOR text string or array of words for a text
+// command, or a CBOR map for a v2 request
+void WMControlClient::onSocketBinaryMessage(QByteArray message)
+{
+    markReceived();
+
+    QCborParserError error;
+    QCborValue value = QCborValue::fromCbor(message, &error);
+
+    if (error.error != QCborError::NoError)
+    {
+        log (QString("Could not decode a binary message: %1").arg(error.errorString()), WMLogger::Warning);
+        return;
+    }
+
+    if (value.isString())
+        emit newCommandReceived(value.toString());
+    else if (value.isArray())
+    {
+        QCborArray tokens = value.toArray();
+        QStringList words;
+
+        for (int i = 0; i < tokens.size(); i++)
+        {
+            QCborValue token = tokens.at(i);
+            words.append(token.isInteger() ? QString::number(token.toInteger()) : token.toString());
+        }
+
+        emit newCommandReceived(words.join(" "));
+    }
+    else if (value.isMap())
+        emit newCommandReceived(QString::fromUtf8(QJsonDocument(value.toMap().toJsonObject()).toJson(QJsonDocument::Compact)));
+    else
+        log ("Unexpected binary message type", WMLogger::Warning);
+}
+
+void WMControlClient::onBatchDone()
+{
+    batchStart = -1;
+}
+
 void WMControlClient::onSocketDisconnect()
 {
     log ("Socket disconnected.");
+    WMTimerWheel::instance->cancel(authTimerId);
+    authTimerId = 0;
     emit disconnected();
 }
 
+void WMControlClient::onAuthTimer()
+{
+    authTimerId = 0;
+
+    if (!isAuthorized)
+        emit authTimedOut();
+}
+
@@ -3,25 +3,78 @@
 
 #include <QObject>
 #include <QString>
+#include <QSet>
 #include <QWebSocket>
+#include <QUrl>
+#include <QUrlQuery>
+#include <QTimer>
+#include <QElapsedTimer>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QJsonArray>
+#include <QJsonValue>
+#include <QCborValue>
+#include <QCborArray>
+#include <QCborMap>
+
+#include "wmtokenbucket.h"
+#include "wmtimerwheel.h"
 
 #include "wmlogger.h"
 
+// One outgoing line in every wire form, each encoded on first use, so a
+// broadcast costs one encoding per form rather than one per client
+struct WMEncodedMessage
+{
+    QString text;
+    QString jsonEvent;
+    QByteArray cbor;
+    QByteArray cborEvent;
+};
+
 class WMControlClient : public QObject
 {
     Q_OBJECT
 public:
 
     explicit WMControlClient(QWebSocket *sock, QObject *parent = 0);
+    virtual ~WMControlClient();
 
-    void sendCommand (QString command);
+    void sendError (int code, QString comment);
+    void sendEncoded (WMEncodedMessage &message);
     void setAuthorized (bool auth);
     void setChallengeNonce (QString nonce);
 
     bool authorized();
     QString challengeNonce();
+    virtual QString requestTicket();
+    virtual QString address();
+
+    void setCommandRate(double rate, double burst);
+    bool takeCommandToken();
+    void startAuthDeadline(int msec);
+
+    int protocolVersion();
+    bool binary();
+    void setProtocolVersion(int version);
+
+    // Opt-in event streams on top of the state events everyone gets
+    void subscribe(QString topic);
+    void unsubscribe(QString topic);
+    bool isSubscribed(QString topic);
+
+    // How long the current command waited behind the others that arrived
+    // with it, us; 0 outside of a batch
+    qint64 queuedFor();
 
-    void close();
+    // v2 replies: everything sent between begin and end is collected
+    // into one JSON object carrying the request id
+    void beginReply(QJsonValue id);
+    void addReplyResult(QJsonObject result);
+    void endReply();
+
+    virtual void close();
+    virtual void flush();
 
 private:
 
@@ -31,19 +84,46 @@ protected:
 
     bool isAuthorized;
     QString chNonce;
+
+    int protoVersion;
+    bool cborEncoding;
+    bool replying;
+    QJsonValue replyId;
+    QJsonArray replyLines;
+    QJsonArray replyResults;
+    QJsonObject replyError;
+
+    QSet<QString> topics;
+
+    WMTokenBucket commandBucket;
+    WMTimerWheel::TimerId authTimerId;
+    static QElapsedTimer clock;
+    qint64 batchStart;     // ns on clock, -1 when idle
+
+    virtual void sendMessage (QString message);
+    virtual void sendBinaryMessage (QByteArray message);
+    void sendObject (QJsonObject object);
+
+    static QCborArray tokenize (QString line);
+    void markReceived();
     void log (QString message, WMLogger::LogLevel level = WMLogger::Debug);
 
 signals:
 
 private slots:
     void onSocketMessage (QString message);
+    void onSocketBinaryMessage (QByteArray message);
     void onSocketDisconnect();
+    void onAuthTimer();
+    void onBatchDone();
 
 public slots:
+    void sendCommand (QString command);
 
 signals:
     void newCommandReceived(QString);
     void disconnected();
+    void authTimedOut();
 };
 
 #endif // WMCONTROLCLIENT_H
@@ -1,7 +1,8 @@
 #include "wmcontrolserver.h"
 #include "wmcore.h"
 
-WMControlServer::WMControlServer(int serverPort, WMCore *core) : core(core), serverPort(serverPort)
+WMControlServer::WMControlServer(int serverPort, WMCore *core, int socketDescriptor) :
+    core(core), serverPort(serverPort), localServer(0), localAllowGroup(false), commandResult(0)
 {
     // 9xx - system errors
     errorCodes.insert(999, "Syntax error");
@@ -9,17 +10,58 @@ WMControlServer::WMControlServer(int serverPort, WMCore *core) : core(core), ser
     // 1xx - user & auth codes
     errorCodes.insert(100, "Not authorized");
     errorCodes.insert(101, "Bad auth data");
+    errorCodes.insert(102, "Too many connections");
+    errorCodes.insert(103, "Rate limit exceeded");
+    errorCodes.insert(104, "Authentication timeout");
 
     // 2xx - user-initiated errors
     errorCodes.insert(200, "No such service");
+    errorCodes.insert(201, "Feature %1 is disabled");
+    errorCodes.insert(202, "Could not start tracing");
+    errorCodes.insert(203, "Upgrade failed");
+    errorCodes.insert(204, "Unsupported protocol version %1");
+    errorCodes.insert(205, "A rolling restart is already running");
+    errorCodes.insert(206, "No such topic %1");
 
     // 3xx - eventual errors
     errorCodes.insert(300, "Service %1 has crashed");
 
+    topics << "PRESSURE" << "STREAM";
+
+    // Everything else is counted as UNKNOWN by handleCommand()
+    verbs << "PROTOCOL" << "AUTH" << "SERVICE" << "SUBSCRIBE" << "UNSUBSCRIBE" << "RESUME" << "LAG"
+          << "HISTORY" << "STATS" << "LIMITS" << "SCHEDULER" << "PROBE" << "STANDBY" << "CLUSTER"
+          << "ROLLING" << "UPGRADE" << "TRACE";
+
+    limits.maxClients = 0;
+    limits.maxClientsPerAddress = 0;
+    limits.connectRate = 0;
+    limits.connectBurst = 0;
+    limits.commandRate = 0;
+    limits.commandBurst = 0;
+    limits.authTimeout = 0;
+
+    clock.start();
+    statsSince = QDateTime::currentDateTime();
+
     server = new QWebSocketServer(QString("WMCore/%1").arg(WMCORE_VERSION),
                                   QWebSocketServer::NonSecureMode,
                                   this);
 
+    if (socketDescriptor >= 0)
+    {
+        log (QString("Taking over the listening socket %1 from the previous image").arg(socketDescriptor), WMLogger::Info);
+
+        if (server->setSocketDescriptor(socketDescriptor))
+        {
+            connect (server, SIGNAL(newConnection()), this, SLOT(onNewClientConnection()));
+            log (QString("Server is listening on port %1").arg(serverPort), WMLogger::Info);
+            return;
+        }
+
+        log ("Could not take over the listening socket, opening a new one", WMLogger::Warning);
+    }
+
     log ("Starting the server");
     if (!server->listen(QHostAddress::Any, serverPort))
     {
@@ -51,16 +93,37 @@ void WMControlServer::sendClientCommand(WMControlClient *client, QString command
 
 void WMControlServer::broadcastCommand(QString command)
 {
+    WMLagMonitor::HandlerScope handlerScope("WMControlServer::broadcastCommand");
+    WMTracer::Span span("broadcast", "control");
+    span.setDetail(command);
+
+    WMEncodedMessage message;
+    message.text = command;
+
     for (int i = 0; i < clients.count(); i++)
     {
         WMControlClient *client = clients.at(i);
         if (client->authorized())
         {
-            client->sendCommand(command);
+            client->sendEncoded(message);
         }
     }
 }
 
+// Like broadcastCommand(), to the clients that asked for `topic` only
+void WMControlServer::publish(QString topic, QString event)
+{
+    WMEncodedMessage message;
+    message.text = event;
+
+    for (int i = 0; i < clients.count(); i++)
+    {
+        WMControlClient *client = clients.at(i);
+        if (client->authorized() && client->isSubscribed(topic))
+            client->sendEncoded(message);
+    }
+}
+
 void WMControlServer::sendErrorMessage(WMControlClient *client, int code, QStringList args)
 {
     QString comment = errorCodes.value(code);
@@ -77,33 +140,249 @@ void WMControlServer::sendErrorMessage(WMControlClient *client, int code, QStrin
             comment = comment.arg(args.at(i));
     }
 
-    client->sendCommand(QString("ERROR %1 #%2").arg(code).arg(comment));
+    commandResult = code;
+
+    client->sendError(code, comment);
 }
 
 void WMControlServer::stop()
 {
     log ("Stopping the control server", WMLogger::Info);
     server->close();
+
+    if (localServer != NULL)
+        localServer->close();
+}
+
+bool WMControlServer::listenLocal(QString path, bool allowGroup)
+{
+    if (localServer == NULL)
+    {
+        localServer = new QLocalServer(this);
+        connect (localServer, SIGNAL(newConnection()), this, SLOT(onNewLocalConnection()));
+    }
+
+    localAllowGroup = allowGroup;
+    localServer->setSocketOptions(allowGroup ? (QLocalServer::UserAccessOption | QLocalServer::GroupAccessOption)
+                                             : QLocalServer::UserAccessOption);
+
+    QDir().mkpath(QFileInfo(path).absolutePath());
+
+    // A socket file left by a crash or by the image we were upgraded from
+    QLocalServer::removeServer(path);
+
+    if (!localServer->listen(path))
+    {
+        log (QString("Could not listen on the local socket %1: %2").arg(path).arg(localServer->errorString()),
+             WMLogger::Warning);
+        return false;
+    }
+
+    log (QString("Server is listening on the local socket %1").arg(path), WMLogger::Info);
+    return true;
+}
+
+void WMControlServer::setJournalSize(int size)
+{
+    // Only called before anything was journaled
+    journal = WMStateJournal(size);
+}
+
+QJsonObject WMControlServer::saveJournal()
+{
+    return journal.save();
+}
+
+void WMControlServer::restoreJournal(const QJsonObject &state)
+{
+    journal.restore(state);
+
+    if (journal.lastSeq() > 0)
+        log (QString("State journal %1 inherited at #%2").arg(journal.epoch()).arg(journal.lastSeq()), WMLogger::Info);
+}
+
+// Tells clients we are about to re-execute and makes sure the notice
+// leaves our buffers; returns the listening socket to hand over
+int WMControlServer::prepareUpgrade()
+{
+    broadcastCommand("UPGRADE RESTARTING #Please reconnect");
+
+    for (int i = 0; i < clients.count(); i++)
+        clients.at(i)->flush();
+
+    return server->socketDescriptor();
 }
 
 void WMControlServer::onNewClientConnection()
 {
+    WMLagMonitor::HandlerScope handlerScope("WMControlServer::onNewClientConnection");
+
     while (server->hasPendingConnections())
     {
         log ("A new client connected", WMLogger::Info);
 
         QWebSocket *sock = server->nextPendingConnection();
 
+        if (!admitConnection(sock))
+            continue;
+
         WMControlClient *client = new WMControlClient(sock);
 
         client->setChallengeNonce(WMAuthUtil::randomString());
+        client->setCommandRate(limits.commandRate, limits.commandBurst);
 
         connect(client, SIGNAL(newCommandReceived(QString)), this, SLOT(onClientCommand(QString)));
         connect(client, SIGNAL(disconnected()), this, SLOT(onClientDisconnect()));
+        connect(client, SIGNAL(authTimedOut()), this, SLOT(onClientAuthTimeout()));
 
         clients.append(client);
+        clientsPerAddress[client->address()]++;
+        client->startAuthDeadline(limits.authTimeout);
 
         client->sendCommand(QString("INIT %1 #WMCore/%2").arg(client->challengeNonce()).arg(WMCORE_VERSION));
+
+        QString ticket = client->requestTicket();
+        if (!ticket.isEmpty() && resumeSession(client, ticket))
+            client->sendCommand("AUTH OK #Session resumed");
+    }
+}
+
+void WMControlServer::onNewLocalConnection()
+{
+    WMLagMonitor::HandlerScope handlerScope("WMControlServer::onNewLocalConnection");
+
+    while (localServer->hasPendingConnections())
+    {
+        WMLocalControlClient *client = new WMLocalControlClient(localServer->nextPendingConnection());
+
+        if (!client->peerAllowed(localAllowGroup) ||
+            (limits.maxClients > 0 && clients.count() >= limits.maxClients))
+        {
+            log (QString("Rejecting a local connection from %1").arg(client->address()), WMLogger::Warning);
+            rejections["local_peer"]++;
+
+            client->close();
+            client->deleteLater();
+            continue;
+        }
+
+        client->setAuthorized(true);
+        client->setCommandRate(limits.commandRate, limits.commandBurst);
+
+        connect(client, SIGNAL(newCommandReceived(QString)), this, SLOT(onClientCommand(QString)));
+        connect(client, SIGNAL(disconnected()), this, SLOT(onClientDisconnect()));
+
+        clients.append(client);
+        clientsPerAddress[client->address()]++;
+
+        log (QString("A local client connected as %1").arg(client->address()), WMLogger::Info);
+    }
+}
+
+void WMControlServer::sendTicket(WMControlClient *client)
+{
+    int lifetime = core->getTicketLifetime();
+    QByteArray key = core->getTicketKey();
+
+    if (lifetime <= 0 || key.isEmpty())
+        return;
+
+    qint64 expiresAt = QDateTime::currentSecsSinceEpoch() + lifetime;
+    client->sendCommand(QString("AUTH TICKET %1 %2").arg(WMAuthUtil::issueTicket(key, expiresAt)).arg(expiresAt));
+}
+
+bool WMControlServer::resumeSession(WMControlClient *client, QString ticket)
+{
+    QByteArray key = core->getTicketKey();
+
+    if (core->getTicketLifetime() <= 0 || key.isEmpty() ||
+        !WMAuthUtil::verifyTicket(key, ticket, QDateTime::currentSecsSinceEpoch()))
+    {
+        log ("Client presented an invalid or expired session ticket", WMLogger::Warning);
+        return false;
+    }
+
+    client->setAuthorized(true);
+    log ("Client session resumed by ticket");
+    return true;
+}
+
+// RESUME [<epoch>:<seq> | <seq> <epoch>]: the events after <seq> if the
+// journal still has them and is the one of <epoch>, otherwise the current
+// state of every instance. Either way the client ends up at the sequence
+// number given in RESUME END. Live events are stamped "#<epoch>:<seq>", so
+// the stamp of the last one seen can be passed back as it is.
+void WMControlServer::resumeState(WMControlClient *client, QStringList commands)
+{
+    bool ok = true;
+    quint64 seq = 0;
+    QString epoch;
+
+    if (commands.count() >= 2 && commands[1].contains(':'))
+    {
+        epoch = commands[1].section(':', 0, 0);
+        seq = commands[1].section(':', 1).toULongLong(&ok);
+    }
+        else if (commands.count() >= 2)
+    {
+        seq = commands[1].toULongLong(&ok);
+        epoch = commands.value(2);
+    }
+
+    if (!ok)
+    {
+        sendErrorMessage(client, 999);
+        return;
+    }
+
+    // A sequence number means nothing without its numbering: no epoch, no delta
+    QStringList events;
+    bool delta = !epoch.isEmpty() && epoch == journal.epoch() && journal.since(seq, events);
+
+    if (delta)
+    {
+        for (int i = 0; i < events.count(); i++)
+            client->sendCommand(QString("RESUME EVENT %1 %2").arg(journal.lastSeq() - events.count() + i + 1).arg(events.at(i)));
+
+        client->sendCommand(QString("RESUME END %1 %2 delta %3").arg(journal.epoch()).arg(journal.lastSeq()).arg(events.count()));
+        return;
+    }
+
+    QStringList instances = core->getInstancesList();
+
+    for (int i = 0; i < instances.count(); i++)
+        client->sendCommand("RESUME SNAPSHOT " + instances.at(i));
+
+    client->sendCommand(QString("RESUME END %1 %2 snapshot %3").arg(journal.epoch()).arg(journal.lastSeq()).arg(instances.count()));
+}
+
+// STATS [RESET]: latency percentiles per verb and result since the last reset,
+// handling time inside wmcored and time queued behind earlier commands
+void WMControlServer::sendStats(WMControlClient *client, bool reset)
+{
+    client->sendCommand(QString("STATS SINCE %1").arg(statsSince.toSecsSinceEpoch()));
+
+    QMap<QString, WMCommandStats>::const_iterator it;
+    for (it = commandStats.constBegin(); it != commandStats.constEnd(); ++it)
+    {
+        const WMLatencyHistogram &handling = it.value().handling;
+        const WMLatencyHistogram &queue = it.value().queue;
+
+                              // verb result, count, p50 p90 p99 p99.9 max us, queue p50 p99 max us
+        client->sendCommand(QString("STATS COMMAND %1 %2 %3 %4 %5 %6 %7 %8 %9 %10")
+                            .arg(it.key()).arg(handling.count())
+                            .arg(handling.percentile(50)).arg(handling.percentile(90))
+                            .arg(handling.percentile(99)).arg(handling.percentile(99.9)).arg(handling.max())
+                            .arg(queue.percentile(50)).arg(queue.percentile(99)).arg(queue.max()));
+    }
+
+    client->sendCommand(QString("STATS END %1").arg(commandStats.count()));
+
+    // This STATS call itself is recorded after the reset and opens the next window
+    if (reset)
+    {
+        commandStats.clear();
+        statsSince = QDateTime::currentDateTime();
     }
 }
 
@@ -111,31 +390,245 @@ void WMControlServer::onClientDisconnect()
 {
     WMControlClient *client = (WMControlClient *)QObject::sender();;
 
-    log (QString("Control client #%1 disconnected"), WMLogger::Info);
+    log (QString("Control client %1 disconnected").arg(client->address()), WMLogger::Info);
     clients.removeAt(clients.indexOf(client));
 
+    QString address = client->address();
+    if (--clientsPerAddress[address] <= 0)
+        clientsPerAddress.remove(address);
+
     client->deleteLater();
 }
 
+void WMControlServer::onClientAuthTimeout()
+{
+    WMControlClient *client = (WMControlClient *)QObject::sender();
+
+    log (QString("Control client %1 did not authenticate in time, closing").arg(client->address()), WMLogger::Warning);
+    rejections["auth_timeout"]++;
+
+    sendErrorMessage(client, 104);
+    client->close();
+}
+
+void WMControlServer::setLimits(const WMControlLimits &limits)
+{
+    this->limits = limits;
+
+    log (QString("Connection limits: %1 clients, %2 per address, %3 connects/s, %4 commands/s, auth in %5 ms")
+         .arg(limits.maxClients).arg(limits.maxClientsPerAddress).arg(limits.connectRate)
+         .arg(limits.commandRate).arg(limits.authTimeout));
+}
+
+bool WMControlServer::admitConnection(QWebSocket *sock)
+{
+    QString address = sock->peerAddress().toString();
+    qint64 now = clock.elapsed();
+
+    // Buckets that have refilled completely carry no state worth keeping
+    if (connectBuckets.count() > 4096)
+    {
+        QHash<QString, WMTokenBucket>::iterator it = connectBuckets.begin();
+        while (it != connectBuckets.end())
+        {
+            if (it.value().isFull(now))
+                it = connectBuckets.erase(it);
+            else
+                ++it;
+        }
+    }
+
+    if (!connectBuckets.contains(address))
+        connectBuckets.insert(address, WMTokenBucket(limits.connectRate, limits.connectBurst));
+
+    if (!connectBuckets[address].take(now))
+    {
+        rejectConnection(sock, "connect_rate", 103);
+        return false;
+    }
+
+    if (limits.maxClients > 0 && clients.count() >= limits.maxClients)
+    {
+        rejectConnection(sock, "max_clients", 102);
+        return false;
+    }
+
+    if (limits.maxClientsPerAddress > 0 && clientsPerAddress.value(address) >= limits.maxClientsPerAddress)
+    {
+        rejectConnection(sock, "max_per_address", 102);
+        return false;
+    }
+
+    return true;
+}
+
+void WMControlServer::rejectConnection(QWebSocket *sock, QString reason, int code)
+{
+    log (QString("Rejecting a connection from %1: %2").arg(sock->peerAddress().toString()).arg(reason),
+         WMLogger::Warning);
+
+    rejections[reason]++;
+
+    sock->sendTextMessage(QString("ERROR %1 #%2").arg(code).arg(errorCodes.value(code)));
+    sock->close(QWebSocketProtocol::CloseCodePolicyViolated, errorCodes.value(code));
+    sock->deleteLater();
+}
+
 void WMControlServer::onClientCommand(QString message)
 {
+    WMLagMonitor::HandlerScope handlerScope("WMControlServer::onClientCommand");
     WMControlClient *client = (WMControlClient *)QObject::sender();
 
     log ("Control command: "+message);
 
+    if (client->protocolVersion() >= 2)
+    {
+        handleRequest(client, message);
+        return;
+    }
+
     QStringList commands = message.split(" ", QString::SkipEmptyParts);
 
     if (commands.count() == 0)
         return;
 
+    handleCommand(client, commands);
+}
+
+// Protocol v2 request: {"id": <any>, "command": "SERVICE LIQUIDSOAP RESTART", "tags": ["a", "b*"]}.
+// "tags" are appended to the command words, the reply is a single JSON object echoing the id.
+void WMControlServer::handleRequest(WMControlClient *client, QString message)
+{
+    QJsonParseError parseError;
+    QJsonDocument document = QJsonDocument::fromJson(message.toUtf8(), &parseError);
+    QJsonObject request = document.object();
+
+    client->beginReply(request.value("id"));
+
+    QStringList commands = request.value("command").toString().split(" ", QString::SkipEmptyParts);
+
+    QJsonArray tags = request.value("tags").toArray();
+    for (int i = 0; i < tags.count(); i++)
+    {
+        if (tags.at(i).isString())
+            commands.append(tags.at(i).toString());
+    }
+
+    if (parseError.error != QJsonParseError::NoError || !document.isObject() || commands.count() == 0)
+        sendErrorMessage(client, 999);
+    else
+        handleCommand(client, commands);
+
+    client->endReply();
+}
+
+// Expands glob patterns against the configured tags, keeping plain tags as they are
+QStringList WMControlServer::resolveTargets(WMProcess::ProcessType type, QStringList patterns)
+{
+    QStringList known = core->getTags(type);
+    QStringList targets;
+
+    for (int i = 0; i < patterns.count(); i++)
+    {
+        QString pattern = patterns.at(i);
+
+        if (!pattern.contains(QRegExp("[*?\\[]")))
+        {
+            if (!targets.contains(pattern))
+                targets.append(pattern);
+            continue;
+        }
+
+        QRegExp glob(pattern, Qt::CaseSensitive, QRegExp::Wildcard);
+
+        for (int j = 0; j < known.count(); j++)
+        {
+            if (glob.exactMatch(known.at(j)) && !targets.contains(known.at(j)))
+                targets.append(known.at(j));
+        }
+    }
+
+    return targets;
+}
+
+// Times every command by verb and outcome, see sendStats()
+void WMControlServer::handleCommand(WMControlClient *client, QStringList commands)
+{
+    QElapsedTimer timer;
+    timer.start();
+
+    qint64 queued = client->queuedFor();
+    commandResult = 0;
+
+    executeCommand(client, commands);
+
+    // Keys only ever come from our own vocabulary, whatever clients send
+    QString verb = verbs.contains(commands[0]) ? commands[0] : QString("UNKNOWN");
+
+    if (verb == "SERVICE" && commands.count() >= 2)
+    {
+        QString action = (commands[1] == "LIST" || commands.count() < 3) ? commands[1] : commands[2];
+
+        if (action == "LIST" || action == "RESTART" || action == "STOP" || action == "START")
+            verb += ":" + action;
+    }
+
+    QString key = QString("%1 %2").arg(verb).arg(commandResult == 0 ? QString("ok") : QString::number(commandResult));
+
+    WMCommandStats &stats = commandStats[key];
+    stats.handling.record(timer.nsecsElapsed() / 1000);
+    stats.queue.record(queued);
+}
+
+void WMControlServer::executeCommand(WMControlClient *client, QStringList commands)
+{
+    WMTracer::Span span("onClientCommand", "control");
+    span.setDetail(commands[0]);
+
+    if (!client->takeCommandToken())
+    {
+        rejections["command_rate"]++;
+        sendErrorMessage(client, 103);
+        return;
+    }
+
+    if (commands[0] == "PROTOCOL")
+    {
+        int version = commands.count() >= 2 ? commands[1].toInt() : 0;
+
+        if (version < 1 || version > 2)
+        {
+            sendErrorMessage(client, 204, QStringList() << (commands.count() >= 2 ? commands[1] : "?"));
+            return;
+        }
+
+        client->sendCommand(QString("PROTOCOL OK %1").arg(version));
+        client->setProtocolVersion(version);
+        return;
+    }
+
     if (commands[0] == "AUTH")
     {
+        WMTracer::Span authSpan("AUTH", "control");
+
         if (commands.count() < 2)
         {
             sendErrorMessage(client, 999);
             return;
         }
 
+        if (commands[1] == "TICKET")
+        {
+            if (commands.count() < 3 || !resumeSession(client, commands[2]))
+            {
+                sendErrorMessage(client, 101);
+                return;
+            }
+
+            client->sendCommand("AUTH OK #Session resumed");
+            return;
+        }
+
         QString secret = core->getCurrentSecret();
 
         if (secret.isEmpty())
@@ -145,10 +638,12 @@ void WMControlServer::onClientCommand(QString message)
             return;
         }
 
-        if (commands[1] == WMAuthUtil::authHash(secret, client->challengeNonce()))
+        if (WMAuthUtil::secureEquals(commands[1].toLatin1(),
+                                     WMAuthUtil::authHash(secret, client->challengeNonce()).toLatin1()))
         {
             client->setAuthorized(true);
             client->sendCommand("AUTH OK #Welcome here :3");
+            sendTicket(client);
             log ("Client auth OK");
             return;
         }
@@ -189,6 +684,7 @@ void WMControlServer::onClientCommand(QString message)
 
         if (commands.count() < 4)
         {
+            commandResult = 199;
             client->sendCommand("ERROR 199 #Bad command syntax");
             return;
         }
@@ -218,9 +714,344 @@ void WMControlServer::onClientCommand(QString message)
             return;
         }
 
-        if (!core->performProcessAction(commands[3], procType, action))
+        if (client->protocolVersion() < 2)
+        {
+            span.setTarget(commands[3], WMProcess::typeToString(procType));
+
+            if (!core->performProcessAction(commands[3], procType, action))
+                sendErrorMessage(client, 200);
+
+            return;
+        }
+
+        // v2 takes any number of tags and globs, one result per instance
+        QStringList targets = resolveTargets(procType, commands.mid(3));
+
+        if (targets.count() == 0)
+        {
             sendErrorMessage(client, 200);
+            return;
+        }
+
+        span.setDetail(QString("%1 x%2").arg(commands[2]).arg(targets.count()));
+
+        for (int i = 0; i < targets.count(); i++)
+        {
+            QJsonObject result;
+            result.insert("tag", targets.at(i));
+
+            if (core->performProcessAction(targets.at(i), procType, action))
+                result.insert("ok", true);
+            else
+            {
+                result.insert("ok", false);
+                result.insert("error", 200);
+                result.insert("message", errorCodes.value(200));
+            }
+
+            client->addReplyResult(result);
+        }
+
+        return;
+    }
+
+    if (commands[0] == "SUBSCRIBE" || commands[0] == "UNSUBSCRIBE")
+    {
+        if (commands.count() < 2)
+        {
+            sendErrorMessage(client, 999);
+            return;
+        }
+
+        if (!topics.contains(commands[1]))
+        {
+            sendErrorMessage(client, 206, QStringList() << commands[1]);
+            return;
+        }
+
+        if (commands[0] == "SUBSCRIBE")
+            client->subscribe(commands[1]);
+        else
+            client->unsubscribe(commands[1]);
+
+        client->sendCommand(QString("%1 OK %2").arg(commands[0]).arg(commands[1]));
+        return;
+    }
+
+    if (commands[0] == "RESUME")
+    {
+        resumeState(client, commands);
+        return;
+    }
+
+    if (commands[0] == "LAG")
+    {
+        bool reset = (commands.count() >= 2 && commands[1] == "RESET");
+        QStringList report = core->getLagReport(reset);
+
+        if (report.count() == 0)
+        {
+            sendErrorMessage(client, 201, QStringList() << "lag_monitor");
+            return;
+        }
+
+        for (int i = 0; i < report.count(); i++)
+            client->sendCommand("LAG " + report.at(i));
+
+        return;
+    }
+
+    if (commands[0] == "HISTORY")
+    {
+        if (commands.count() < 2)
+        {
+            sendErrorMessage(client, 999);
+            return;
+        }
+
+        bool ok = true;
+        qint64 since = 0;
+        int limit = 100;
+
+        if (commands.count() >= 3)
+            since = commands[2].toLongLong(&ok) * 1000;
+
+        if (ok && commands.count() >= 4)
+            limit = commands[3].toInt(&ok);
+
+        if (!ok || limit <= 0)
+        {
+            sendErrorMessage(client, 999);
+            return;
+        }
+
+        QStringList events;
+        if (!core->getHistory(commands[1], since, qMin(limit, 10000), events))
+        {
+            sendErrorMessage(client, 201, QStringList() << "history");
+            return;
+        }
+
+        for (int i = 0; i < events.count(); i++)
+            client->sendCommand("HISTORY EVENT " + events.at(i));
 
+        client->sendCommand(QString("HISTORY END %1").arg(events.count()));
+        return;
+    }
+
+    if (commands[0] == "STATS")
+    {
+        sendStats(client, commands.count() >= 2 && commands[1] == "RESET");
+        return;
+    }
+
+    if (commands[0] == "LIMITS")
+    {
+        client->sendCommand(QString("LIMITS CLIENTS %1 %2").arg(clients.count()).arg(limits.maxClients));
+
+        QMap<QString, quint64>::const_iterator it;
+        for (it = rejections.constBegin(); it != rejections.constEnd(); ++it)
+            client->sendCommand(QString("LIMITS REJECTED %1 %2").arg(it.key()).arg(it.value()));
+
+        return;
+    }
+
+    if (commands[0] == "SCHEDULER")
+    {
+        WMSpawnScheduler *scheduler = core->getScheduler();
+
+        if (scheduler == NULL)
+        {
+            sendErrorMessage(client, 201, QStringList() << "scheduler");
+            return;
+        }
+
+        QStringList status = scheduler->status();
+        QStringList queued = scheduler->queued();
+
+        client->sendCommand("SCHEDULER STATE " + status.at(0));
+        client->sendCommand("SCHEDULER " + status.at(1));
+
+        for (int i = 0; i < queued.count(); i++)
+            client->sendCommand("SCHEDULER QUEUED " + queued.at(i));
+
+        client->sendCommand(QString("SCHEDULER END %1").arg(queued.count()));
+        return;
+    }
+
+    if (commands[0] == "PROBE")
+    {
+        WMStreamProbe *probe = core->getStreamProbe();
+
+        if (probe == NULL)
+        {
+            sendErrorMessage(client, 201, QStringList() << "probe");
+            return;
+        }
+
+        QStringList mounts = probe->status();
+
+        for (int i = 0; i < mounts.count(); i++)
+            client->sendCommand("PROBE MOUNT " + mounts.at(i));
+
+        client->sendCommand(QString("PROBE END %1").arg(mounts.count()));
+        return;
+    }
+
+    if (commands[0] == "STANDBY")
+    {
+        QStringList standbys = core->getStandbyList();
+
+        if (standbys.count() == 0)
+        {
+            client->sendCommand("STANDBY NOINSTANCES");
+            return;
+        }
+
+        for (int i = 0; i < standbys.count(); i++)
+            client->sendCommand("STANDBY INSTANCE " + standbys.at(i));
+
+        return;
+    }
+
+    if (commands[0] == "CLUSTER")
+    {
+        WMCluster *cluster = core->getCluster();
+
+        if (cluster == NULL)
+        {
+            sendErrorMessage(client, 201, QStringList() << "cluster");
+            return;
+        }
+
+        if (commands.count() >= 3 && commands[1] == "OWNER")
+        {
+            client->sendCommand(QString("CLUSTER OWNER %1 %2").arg(commands[2]).arg(cluster->ownerOf(commands[2])));
+            return;
+        }
+
+        QStringList nodes = cluster->nodes();
+
+        for (int i = 0; i < nodes.count(); i++)
+            client->sendCommand("CLUSTER NODE " + nodes.at(i));
+
+        client->sendCommand(QString("CLUSTER END %1 %2").arg(cluster->nodeId()).arg(cluster->isSettled() ? "settled" : "joining"));
+        return;
+    }
+
+    if (commands[0] == "ROLLING")
+    {
+        WMRollingRestart *rolling = core->getRollingRestart();
+
+        if (commands.count() >= 2 && commands[1] == "ABORT")
+        {
+            if (rolling != NULL)
+                rolling->abort();
+
+            client->sendCommand(QString("ROLLING STATUS %1").arg(rolling != NULL ? rolling->status() : "idle"));
+            return;
+        }
+
+        if (commands.count() < 2 || commands[1] == "STATUS")
+        {
+            client->sendCommand(QString("ROLLING STATUS %1").arg(rolling != NULL ? rolling->status() : "idle"));
+            return;
+        }
+
+        // ROLLING RESTART <TYPE> <max_in_flight> <max_failure_ratio> <tag|glob> [...]
+        bool inFlightOk = false;
+        bool ratioOk = false;
+
+        if (commands[1] != "RESTART" || commands.count() < 6 ||
+            (commands[2] != "LIQUIDSOAP" && commands[2] != "ICECAST"))
+        {
+            sendErrorMessage(client, 999);
+            return;
+        }
+
+        int maxInFlight = commands[3].toInt(&inFlightOk);
+        double maxFailureRatio = commands[4].toDouble(&ratioOk);
+
+        if (!inFlightOk || !ratioOk || maxInFlight <= 0 || maxFailureRatio < 0)
+        {
+            sendErrorMessage(client, 999);
+            return;
+        }
+
+        WMProcess::ProcessType procType = (commands[2] == "LIQUIDSOAP") ? WMProcess::Liquidsoap : WMProcess::Icecast;
+        QStringList targets = resolveTargets(procType, commands.mid(5));
+        QStringList known = core->getTags(procType);
+
+        for (int i = targets.count() - 1; i >= 0; i--)
+        {
+            if (!known.contains(targets.at(i)))
+                targets.removeAt(i);
+        }
+
+        if (targets.count() == 0)
+        {
+            sendErrorMessage(client, 200);
+            return;
+        }
+
+        if (rolling != NULL)
+        {
+            sendErrorMessage(client, 205);
+            return;
+        }
+
+        rolling = core->startRollingRestart(procType, targets, maxInFlight, maxFailureRatio);
+
+        if (rolling == NULL)
+        {
+            sendErrorMessage(client, 205);
+            return;
+        }
+
+        // Progress goes to the requester only, the usual SERVICE events still reach everyone
+        connect(rolling, SIGNAL(progress(QString)), client, SLOT(sendCommand(QString)));
+        rolling->start();
+        return;
+    }
+
+    if (commands[0] == "UPGRADE")
+    {
+        log ("Upgrade requested by a control client", WMLogger::Info);
+        client->sendCommand("UPGRADE STARTED");
+
+        if (!core->upgrade())
+            sendErrorMessage(client, 203);
+
+        return;
+    }
+
+    if (commands[0] == "TRACE")
+    {
+        WMTracer *tracer = WMTracer::instance;
+
+        if (commands.count() >= 2 && commands[1] == "START")
+        {
+            if (!tracer->start(commands.count() >= 3 ? commands[2] : QString()))
+            {
+                sendErrorMessage(client, 202);
+                return;
+            }
+
+            client->sendCommand(QString("TRACE STARTED %1").arg(tracer->fileName()));
+            return;
+        }
+
+        if (commands.count() >= 2 && commands[1] == "STOP")
+        {
+            tracer->stop();
+            client->sendCommand(QString("TRACE STOPPED %1 %2").arg(tracer->fileName()).arg(tracer->eventCount()));
+            return;
+        }
+
+        client->sendCommand(QString("TRACE STATUS %1 %2 %3")
+                            .arg(tracer->isEnabled() ? "on" : "off")
+                            .arg(tracer->fileName().isEmpty() ? "-" : tracer->fileName())
+                            .arg(tracer->eventCount()));
         return;
     }
 }
@@ -270,12 +1101,24 @@ void WMControlServer::onProcessChangeState(QString tag, WMProcess::ProcessType t
             stringAction = "CRASH";
             break;
 
+        case Promote:
+            stringAction = "PROMOTE";
+            break;
+
         default:
             log ("Bad ProcessControlAction, won't broadcast this event", WMLogger::Warning);
             return;
     }
 
-    broadcastCommand(QString("SERVICE %1 %2 %3").arg(stringType).arg(stringAction).arg(tag));
+    QString event = QString("SERVICE %1 %2 %3").arg(stringType).arg(stringAction).arg(tag);
+    quint64 seq = journal.append(event);
+
+    broadcastCommand(QString("%1 #%2:%3").arg(event).arg(journal.epoch()).arg(seq));
+}
+
+void WMControlServer::onPressureStall(QString scope, QString resource, QString pressure)
+{
+    publish("PRESSURE", QString("PRESSURE %1 %2 %3").arg(scope).arg(resource).arg(pressure));
 }
 
 void WMControlServer::log(QString message, WMLogger::LogLevel logLevel, QString component)
@@ -7,17 +7,52 @@
 #include <QStringList>
 #include <QWebSocket>
 #include <QWebSocketServer>
+#include <QLocalServer>
+#include <QLocalSocket>
 #include <QFile>
+#include <QFileInfo>
+#include <QDir>
 #include <QList>
 #include <QMap>
+#include <QHash>
+#include <QElapsedTimer>
+#include <QDateTime>
+#include <QRegExp>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QJsonArray>
+#include <QJsonParseError>
 
 #include "wmlogger.h"
 #include "wmcontrolclient.h"
+#include "wmlocalcontrolclient.h"
 #include "wmprocess.h"
 #include "wmauthutil.h"
+#include "wmlagmonitor.h"
+#include "wmtracer.h"
+#include "wmtokenbucket.h"
+#include "wmstatejournal.h"
+#include "wmlatencyhistogram.h"
 
 class WMCore;
 
+struct WMCommandStats
+{
+    WMLatencyHistogram handling;    // us
+    WMLatencyHistogram queue;
+};
+
+struct WMControlLimits
+{
+    int maxClients;          // 0 means unlimited
+    int maxClientsPerAddress;
+    double connectRate;      // per source address, connects per second
+    double connectBurst;
+    double commandRate;      // per client, commands per second
+    double commandBurst;
+    int authTimeout;         // ms
+};
+
 class WMControlServer : public QObject
 {
     Q_OBJECT
@@ -27,17 +62,27 @@ public:
         Start,
         Stop,
         Restart,
-        Crash
+        Crash,
+        Promote
     };
 
-    explicit WMControlServer(int serverPort, WMCore *core = 0);
+    explicit WMControlServer(int serverPort, WMCore *core = 0, int socketDescriptor = -1);
     ~WMControlServer();
 
     void sendClientCommand(WMControlClient *client, QString command);
     void broadcastCommand(QString command);
+    void publish(QString topic, QString event);
     void sendErrorMessage(WMControlClient *client, int code, QStringList args = QStringList());
 
     void stop();
+    int prepareUpgrade();
+
+    void setLimits(const WMControlLimits &limits);
+    bool listenLocal(QString path, bool allowGroup);
+
+    void setJournalSize(int size);
+    QJsonObject saveJournal();
+    void restoreJournal(const QJsonObject &state);
 
 private:
 
@@ -45,9 +90,40 @@ private:
     QWebSocketServer *server;
     int serverPort;
 
+    QLocalServer *localServer;
+    bool localAllowGroup;
+
     QMap<int, QString> errorCodes;
+    QStringList topics;
+    QStringList verbs;
     QList<WMControlClient *> clients;
 
+    WMControlLimits limits;
+    QHash<QString, int> clientsPerAddress;
+    QHash<QString, WMTokenBucket> connectBuckets;
+    QMap<QString, quint64> rejections;
+    QElapsedTimer clock;
+
+    WMStateJournal journal;
+
+    // Keyed by "VERB result", result being "ok" or the error code sent
+    QMap<QString, WMCommandStats> commandStats;
+    QDateTime statsSince;
+    int commandResult;
+
+    bool admitConnection(QWebSocket *sock);
+    void rejectConnection(QWebSocket *sock, QString reason, int code);
+
+    void handleRequest(WMControlClient *client, QString message);
+    void handleCommand(WMControlClient *client, QStringList commands);
+    void executeCommand(WMControlClient *client, QStringList commands);
+    void sendStats(WMControlClient *client, bool reset);
+    QStringList resolveTargets(WMProcess::ProcessType type, QStringList patterns);
+
+    void sendTicket(WMControlClient *client);
+    bool resumeSession(WMControlClient *client, QString ticket);
+    void resumeState(WMControlClient *client, QStringList commands);
+
     void log(QString message, WMLogger::LogLevel logLevel = WMLogger::Debug, QString component = "wserv");
 
 signals:
@@ -55,14 +131,17 @@ signals:
 
 private slots:
     void onNewClientConnection();
+    void onNewLocalConnection();
 
     void onClientCommand(QString message);
     void onClientDisconnect();
+    void onClientAuthTimeout();
 
 public slots:
     void onServerExit();
 
     void onProcessChangeState(QString tag, WMProcess::ProcessType type, ProcessControlAction action);
+    void onPressureStall(QString scope, QString resource, QString pressure);
 };
 
 #endif // WMCONTROLSERVER_H
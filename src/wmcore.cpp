@@ -1,10 +1,13 @@
 #include "wmcore.h"
 
 WMCore::WMCore(QString configFile, QCoreApplication *app, QObject *parent) :
-    QObject(parent), app(app), configFile(configFile)
+    QObject(parent), app(app), lagMonitor(0), cluster(0), scriptCheck(0), scheduler(0), pressureMonitor(0), streamProbe(0), rollingRestart(0), handoverTimer(0), servingTimer(0), standbyCheckTimerId(0), configFile(configFile), isExiting(false)
 {
     connect(app, SIGNAL(aboutToQuit()), this, SLOT(onCoreExit()));
 
+    execPath = QCoreApplication::applicationFilePath();
+    execArgs = QCoreApplication::arguments();
+
     if (!QFile::exists(configFile))
     {
         if (configFile.isEmpty())
@@ -21,8 +24,130 @@ WMCore::WMCore(QString configFile, QCoreApplication *app, QObject *parent) :
     log ("This is WaveManager Core Service", WMLogger::Info);
     log (QString("You're using WMCore/%1").arg(WMCORE_VERSION));
 
+    WMTimerWheel::instance = new WMTimerWheel(timerResolution, this);
+
+    // Before any thread is started, see WMReaper
+    if (reaperMode == "signalfd")
+    {
+        if (spawnBackend != "posix_spawn")
+            log ("The signalfd reaper needs spawn_backend=posix_spawn, falling back to timers", WMLogger::Warning);
+        else
+        {
+            WMReaper::instance = new WMReaper(this);
+
+            if (!WMReaper::instance->start())
+            {
+                delete WMReaper::instance;
+                WMReaper::instance = NULL;
+            }
+#ifdef __linux__
+            // Grandchildren orphaned by the stations come to us and get reaped
+            // instead of piling up as zombies under init
+            else if (prctl(PR_SET_CHILD_SUBREAPER, 1) == 0)
+                log ("wmcored is a child subreaper", WMLogger::Info);
+#endif
+        }
+    }
+
+    if (!qgetenv("WMCORE_SUPERVISOR_PID").isEmpty())
+    {
+        log (QString("Running under the supervisor shim, PID %1").arg(QString::fromLocal8Bit(qgetenv("WMCORE_SUPERVISOR_PID"))),
+             WMLogger::Info);
+
+        WMExitJournal::instance = new WMExitJournal(QString("%1/core/exits.journal").arg(runtimeDir), this);
+
+        if (!WMExitJournal::instance->open())
+        {
+            delete WMExitJournal::instance;
+            WMExitJournal::instance = NULL;
+        }
+    }
+
+    if (lagMonitorEnabled)
+    {
+        lagMonitor = new WMLagMonitor(lagSampleInterval, lagStallThreshold, this);
+        WMLagMonitor::instance = lagMonitor;
+        lagMonitor->start();
+    }
+
+    WMTracer::instance = new WMTracer(traceDir, this);
+    if (traceOnStart)
+        WMTracer::instance->start();
+
+    if (spawnBackend == "posix_spawn")
+    {
+        log ("Children will be started with posix_spawn()", WMLogger::Info);
+        WMProcess::setSpawnBackend(WMProcess::PosixSpawnBackend);
+    }
+
+    log ("Loading runtime state...");
+    WMStateStore::instance = new WMStateStore(runtimeDir, stateFlushInterval, this);
+
+    if (WMStateStore::instance->open())
+    {
+        WMStateStore::instance->load();
+        WMProcess::setPidFilesEnabled(pidFilesEnabled);
+    }
+        else
+    {
+        log ("State database is not available, falling back to pidfiles", WMLogger::Warning);
+        delete WMStateStore::instance;
+        WMStateStore::instance = NULL;
+        WMProcess::setPidFilesEnabled(true);
+    }
+
+    if (historyEnabled)
+    {
+        WMHistory::instance = new WMHistory(runtimeDir, historyRetentionDays, historyFlushInterval, this);
+
+        if (!WMHistory::instance->open())
+        {
+            log ("History database is not available, lifecycle events won't be stored", WMLogger::Warning);
+            delete WMHistory::instance;
+            WMHistory::instance = NULL;
+        }
+    }
+
+    if (preflightEnabled)
+    {
+        scriptCheck = new WMScriptCheck(liquidsoapAppPath, runtimeDir, preflightConcurrency, preflightTimeout, this);
+        connect(scriptCheck, SIGNAL(checked(QString,bool)), this, SLOT(onScriptChecked(QString,bool)));
+    }
+
+    if (schedulerEnabled)
+    {
+        scheduler = new WMSpawnScheduler(schedulerLimits, this);
+        connect(scheduler, SIGNAL(admitted(QString,WMProcess::ProcessType)),
+                this, SLOT(onSpawnAdmitted(QString,WMProcess::ProcessType)));
+    }
+
+    QJsonObject upgradeState = loadUpgradeState();
+
     log ("Creating server...");
-    server = new WMControlServer(serverPort, this);
+    server = new WMControlServer(serverPort, this, upgradeState.value("listen_fd").toInt(-1));
+    server->setLimits(serverLimits);
+    server->setJournalSize(stateJournalSize);
+    server->restoreJournal(upgradeState.value("journal").toObject());
+
+    if (localSocketEnabled)
+        server->listenLocal(localSocketPath, localSocketAllowGroup);
+
+    if (pressureEnabled)
+    {
+        pressureMonitor = new WMPressureMonitor(pressureStall, pressureWindow, pressureResources, pressureCgroup, this);
+        connect(pressureMonitor, SIGNAL(stalled(QString,QString,QString)),
+                server, SLOT(onPressureStall(QString,QString,QString)));
+
+        if (pressureMonitor->start() == 0)
+        {
+            delete pressureMonitor;
+            pressureMonitor = NULL;
+        }
+    }
+
+    // One /proc pass for every instance we may reattach to
+    WMProcScan::instance = new WMProcScan();
+    WMProcScan::instance->scan();
 
     // Icecast first, Liquidsoap will probably connect to it
     log ("Loading Icecast instances...");
@@ -31,7 +156,82 @@ WMCore::WMCore(QString configFile, QCoreApplication *app, QObject *parent) :
 
     log ("Loading Liquidsoap instances...");
     if (loadInstances(WMProcess::Liquidsoap))
+    {
+        if (clusterEnabled)
+        {
+            // Stations are started once the cluster has decided which ones are ours
+            liquidsoapCatalog = liquidsoapTags;
+            liquidsoapTags.clear();
+
+            cluster = new WMCluster(clusterNodeId, clusterCapacity, clusterPort, clusterPeers,
+                                    clusterKey.toUtf8(), clusterHeartbeatInterval, clusterPeerTimeout, this);
+            connect(cluster, SIGNAL(membershipChanged()), this, SLOT(onClusterChanged()));
+            connect(cluster, SIGNAL(servingChanged()), this, SLOT(onHandoverCheck()));
+
+            handoverTimer = new QTimer(this);
+            handoverTimer->setInterval(1000);
+            connect(handoverTimer, SIGNAL(timeout()), this, SLOT(onHandoverCheck()));
+
+            // Stations become advertisable by uptime alone, so look again every heartbeat
+            servingTimer = new QTimer(this);
+            servingTimer->setInterval(clusterHeartbeatInterval);
+            connect(servingTimer, SIGNAL(timeout()), this, SLOT(updateServing()));
+            servingTimer->start();
+
+            if (!cluster->start())
+            {
+                log ("Cluster mode could not start, running every station locally", WMLogger::Error);
+                delete cluster;
+                cluster = NULL;
+
+                liquidsoapTags = liquidsoapCatalog;
+                createProcesses(WMProcess::Liquidsoap);
+            }
+        }
+            else
         createProcesses(WMProcess::Liquidsoap);
+    }
+
+    // Anything created later looks its PID up on its own
+    delete WMProcScan::instance;
+    WMProcScan::instance = NULL;
+
+    if (!upgradeState.isEmpty())
+        applyUpgradeState(upgradeState);
+
+    if (probeEnabled && probeMounts.count() > 0)
+    {
+        streamProbe = new WMStreamProbe(probeInterval, probeMinRatio, probeFailures, probeContinuous,
+                                        probeBurst, probeWindow, this);
+        connect(streamProbe, SIGNAL(stalled(QString,double,int)), this, SLOT(onStreamStalled(QString,double,int)));
+        connect(streamProbe, SIGNAL(recovered(QString,double)), this, SLOT(onStreamRecovered(QString,double)));
+
+        QMap<QString, QString>::const_iterator it;
+        for (it = probeMounts.constBegin(); it != probeMounts.constEnd(); ++it)
+        {
+            QUrl url(it.value().section(' ', 0, 0));
+            int bitrate = it.value().section(' ', 1, 1).toInt();
+
+            if (!url.isValid() || url.scheme() != "http" || bitrate <= 0)
+            {
+                log (QString("Bad probe mount for %1: \"%2\", expected \"http://host:port/mount kbps [icy-name]\"")
+                     .arg(it.key()).arg(it.value()), WMLogger::Warning);
+                continue;
+            }
+
+            streamProbe->addMount(it.key(), url, bitrate, it.value().section(' ', 2).trimmed());
+        }
+
+        streamProbe->start();
+    }
+
+    signalHandler = new WMSignalHandler(this);
+    connect(signalHandler, SIGNAL(signalReceived(int)), this, SLOT(onSignal(int)));
+#ifdef __linux__
+    signalHandler->watch(SIGUSR2);
+    signalHandler->watch(SIGTERM);
+    signalHandler->watch(SIGINT);
+#endif
 }
 
 bool WMCore::performProcessAction(QString tag, WMProcess::ProcessType type,
@@ -74,7 +274,7 @@ bool WMCore::performProcessAction(QString tag, WMProcess::ProcessType type,
             break;
 
         case WMControlServer::Stop:
-            return stopProcessFor(tag, type, true);
+            return stopProcessFor(tag, type);
             break;
 
         case WMControlServer::Start:
@@ -114,6 +314,41 @@ QString WMCore::getCurrentSecret()
     return secret;
 }
 
+QByteArray WMCore::getTicketKey()
+{
+    QFileInfo secretInfo(QString("%1/core/access_secret").arg(runtimeDir));
+
+    if (!secretInfo.exists())
+        return QByteArray();
+
+    if (ticketKey.isEmpty() || secretInfo.lastModified() != ticketKeySource)
+    {
+        QString secret = getCurrentSecret();
+
+        ticketKey = secret.isEmpty() ? QByteArray() : WMAuthUtil::ticketKey(secret);
+        ticketKeySource = secretInfo.lastModified();
+        log ("Session ticket key derived from the current secret");
+    }
+
+    return ticketKey;
+}
+
+int WMCore::getTicketLifetime()
+{
+    return ticketLifetime;
+}
+
+QStringList WMCore::getTags(WMProcess::ProcessType type)
+{
+    if (type == WMProcess::Liquidsoap)
+        return liquidsoapTags;
+
+    if (type == WMProcess::Icecast)
+        return icecastTags;
+
+    return QStringList();
+}
+
 QStringList WMCore::getInstancesList()
 {
                              // tag, type, state
@@ -147,6 +382,200 @@ QStringList WMCore::getInstancesList()
     return list;
 }
 
+QStringList WMCore::getLagReport(bool reset)
+{
+    if (lagMonitor == NULL)
+        return QStringList();
+
+    QStringList report = lagMonitor->report();
+
+    if (reset)
+        lagMonitor->reset();
+
+    return report;
+}
+
+bool WMCore::getHistory(QString tag, qint64 since, int limit, QStringList &events)
+{
+    if (WMHistory::instance == NULL)
+        return false;
+
+                             // timestamp, type, tag, event, exit code, pid, uptime
+    QString eventTemplate = "%1 %2 %3 %4 %5 %6 %7";
+    QVector<WMHistoryEvent> items = WMHistory::instance->query(tag, since, limit);
+
+    for (int i = 0; i < items.count(); i++)
+    {
+        const WMHistoryEvent &item = items.at(i);
+        events.append(eventTemplate.arg(item.timestamp).arg(item.type).arg(item.tag).arg(item.event)
+                      .arg(item.exitCode).arg(item.pid).arg(item.uptime));
+    }
+
+    return true;
+}
+
+// Re-executes wmcored in place. The PID stays the same, so all children
+// remain ours; the listening socket is inherited, the rest of the registry
+// goes through the state store and a small handoff file.
+bool WMCore::upgrade()
+{
+#ifdef __linux__
+    log (QString("Upgrading: re-executing %1").arg(execPath), WMLogger::Info);
+
+    QJsonArray processes;
+    for (int i = 0; i < processPool.count(); i++)
+    {
+        WMProcess *proc = processPool.at(i);
+
+        QJsonObject item;
+        item.insert("type", proc->typeAsString());
+        item.insert("tag", proc->tag());
+        item.insert("pid", proc->pid());
+        item.insert("respawn", proc->isNeedToRespawn());
+        processes.append(item);
+    }
+
+    int listenFd = server->prepareUpgrade();
+
+    QJsonObject state;
+    state.insert("version", QString(WMCORE_VERSION));
+    state.insert("listen_fd", listenFd);
+    state.insert("processes", processes);
+    state.insert("journal", server->saveJournal());
+
+    QFile stateFile(QString("%1/core/upgrade.json").arg(runtimeDir));
+    if (!stateFile.open(QIODevice::WriteOnly | QIODevice::Truncate))
+    {
+        log (QString("Could not write upgrade state: %1").arg(stateFile.errorString()), WMLogger::Error);
+        return false;
+    }
+
+    stateFile.write(QJsonDocument(state).toJson(QJsonDocument::Compact));
+    stateFile.close();
+
+    // Nothing below exec() runs destructors, so persist everything now
+    if (WMStateStore::instance != NULL)
+        WMStateStore::instance->flush();
+
+    if (WMHistory::instance != NULL)
+        WMHistory::instance->close();
+
+    WMTracer::instance->stop();
+
+    if (lagMonitor != NULL)
+        lagMonitor->stop();
+
+    int flags = fcntl(listenFd, F_GETFD);
+    fcntl(listenFd, F_SETFD, flags & ~FD_CLOEXEC);
+    qputenv("WMCORE_UPGRADE_STATE", stateFile.fileName().toUtf8());
+
+    QList<QByteArray> argData;
+    argData.append(execPath.toLocal8Bit());
+    for (int i = 1; i < execArgs.count(); i++)
+        argData.append(execArgs.at(i).toLocal8Bit());
+
+    QVector<char *> argv;
+    for (int i = 0; i < argData.count(); i++)
+        argv.append(argData[i].data());
+    argv.append(NULL);
+
+    // The mask survives exec; the new image blocks it again if it still wants the reaper
+    sigset_t childMask;
+    sigemptyset(&childMask);
+    sigaddset(&childMask, SIGCHLD);
+    sigprocmask(SIG_UNBLOCK, &childMask, 0);
+
+    execv(argv.at(0), argv.data());
+
+    // Still here: exec failed, carry on with the old image
+    log (QString("Could not execute %1: %2").arg(execPath).arg(strerror(errno)), WMLogger::Error);
+
+    if (WMReaper::instance != NULL)
+        sigprocmask(SIG_BLOCK, &childMask, 0);
+
+    fcntl(listenFd, F_SETFD, flags);
+    qunsetenv("WMCORE_UPGRADE_STATE");
+    QFile::remove(stateFile.fileName());
+
+    if (WMHistory::instance != NULL)
+        WMHistory::instance->open();
+
+    if (lagMonitor != NULL)
+        lagMonitor->start();
+
+    return false;
+#else
+    log ("Upgrading by re-execution is not supported on this OS", WMLogger::Warning);
+    return false;
+#endif
+}
+
+// Only one rolling restart runs at a time; NULL if another one is in progress
+WMRollingRestart *WMCore::startRollingRestart(WMProcess::ProcessType type, QStringList tags,
+                                              int maxInFlight, double maxFailureRatio)
+{
+    if (rollingRestart != NULL || isExiting || tags.isEmpty())
+        return NULL;
+
+    rollingRestart = new WMRollingRestart(this, type, tags, maxInFlight, maxFailureRatio,
+                                          rollingHealthTimeout, rollingSettleTime, this);
+
+    connect(this, SIGNAL(instanceStarted(QString,WMProcess::ProcessType)),
+            rollingRestart, SLOT(onInstanceStarted(QString,WMProcess::ProcessType)));
+    connect(this, SIGNAL(instanceDied(QString,WMProcess::ProcessType,int)),
+            rollingRestart, SLOT(onInstanceDied(QString,WMProcess::ProcessType,int)));
+    connect(rollingRestart, SIGNAL(finished()), this, SLOT(onRollingRestartFinished()));
+
+    return rollingRestart;
+}
+
+WMRollingRestart *WMCore::getRollingRestart()
+{
+    return rollingRestart;
+}
+
+WMCluster *WMCore::getCluster()
+{
+    return cluster;
+}
+
+WMSpawnScheduler *WMCore::getScheduler()
+{
+    return scheduler;
+}
+
+WMStreamProbe *WMCore::getStreamProbe()
+{
+    return streamProbe;
+}
+
+QStringList WMCore::getStandbyList()
+{
+                             // tag, pid, mode, state, rss kB, cpu ms
+    QString listItemTemplate = "%1 %2 %3 %4 %5 %6";
+    QStringList list;
+
+    QMap<QString, WMProcess *>::const_iterator it;
+    for (it = standbyPool.constBegin(); it != standbyPool.constEnd(); ++it)
+    {
+        WMProcess *standby = it.value();
+        QString stateString;
+
+        if (standby->pid() <= 0)
+            stateString = "starting";
+        else if (standby->paused())
+            stateString = "paused";
+        else
+            stateString = "up";
+
+        list.append(listItemTemplate.arg(it.key()).arg(standby->pid()).arg(standbyMode).arg(stateString)
+                    .arg(WMProcess::residentMemory(standby->pid()))
+                    .arg(WMProcess::cpuTime(standby->pid())));
+    }
+
+    return list;
+}
+
 void WMCore::log(QString message, WMLogger::LogLevel logLevel, QString component)
 {
     WMLogger::instance->log(message, logLevel, component);
@@ -165,12 +594,120 @@ void WMCore::loadConfig(QString configFile)
 
     respawnProcessesOnDeath = settings.value("respawn", false).toBool();
     respawnOnlyOnBadDeath = settings.value("respawn_on_crash", false).toBool();
+    spawnBackend = settings.value("spawn_backend", "qprocess").toString();
+    reaperMode = settings.value("reaper", "timer").toString();
+    timerResolution = settings.value("timer_resolution", 10).toInt();
+    settings.endGroup();
+
+    settings.beginGroup("standby");
+    criticalTags = settings.value("critical").toStringList();
+    standbyMode = settings.value("mode", "alternate").toString();
+    if (standbyMode != "alternate" && standbyMode != "paused")
+        standbyMode = "alternate";
+    standbyReadyTimeout = settings.value("ready_timeout", 60000).toInt();
+    settings.endGroup();
+
+    settings.beginGroup("cluster");
+    clusterEnabled = settings.value("enabled", false).toBool();
+    clusterPort = settings.value("port", 8904).toInt();
+    clusterNodeId = settings.value("node_id", QString("%1:%2").arg(QSysInfo::machineHostName()).arg(clusterPort)).toString();
+    clusterCapacity = settings.value("capacity", 100).toInt();
+    clusterPeers = settings.value("peers").toStringList();
+    clusterKey = settings.value("key").toString();
+    clusterHeartbeatInterval = settings.value("heartbeat_interval", 1000).toInt();
+    clusterPeerTimeout = settings.value("peer_timeout", 5000).toInt();
+    clusterHandoverTimeout = settings.value("handover_timeout", 60000).toInt();
+    clusterServingUptime = settings.value("serving_uptime", 10000).toInt();
+    settings.endGroup();
+
+    settings.beginGroup("preflight");
+    preflightEnabled = settings.value("enabled", true).toBool();
+    preflightConcurrency = settings.value("concurrency", 2).toInt();
+    preflightTimeout = settings.value("timeout", 30000).toInt();
+    settings.endGroup();
+
+    settings.beginGroup("scheduler");
+    schedulerEnabled = settings.value("enabled", true).toBool();
+    schedulerLimits.spawnRate = settings.value("spawn_rate", 20).toDouble();
+    schedulerLimits.spawnBurst = settings.value("spawn_burst", 20).toDouble();
+    schedulerLimits.loadThreshold = settings.value("load_threshold", 1.5).toDouble();
+    schedulerLimits.cpuPressure = settings.value("cpu_pressure", 40).toDouble();
+    schedulerLimits.memoryPressure = settings.value("memory_pressure", 20).toDouble();
+    schedulerLimits.maxDefer = settings.value("max_defer", 60000).toInt();
+    settings.endGroup();
+
+    settings.beginGroup("pressure");
+    pressureEnabled = settings.value("enabled", true).toBool();
+    pressureStall = settings.value("stall", 100).toInt();
+    pressureWindow = settings.value("window", 2000).toInt();
+    pressureResources = settings.value("resources", QStringList() << "cpu" << "io" << "memory").toStringList();
+    pressureCgroup = settings.value("cgroup", true).toBool();
+    settings.endGroup();
+
+    settings.beginGroup("probe");
+    probeEnabled = settings.value("enabled", false).toBool();
+    probeInterval = settings.value("interval", 10000).toInt();
+    probeMinRatio = settings.value("min_ratio", 0.5).toDouble();
+    probeFailures = settings.value("failures", 3).toInt();
+    probeRestart = settings.value("restart", false).toBool();
+    probeContinuous = settings.value("continuous", false).toBool();
+    probeBurst = settings.value("burst", 2000).toInt();
+    probeWindow = settings.value("window", 3000).toInt();
+    settings.endGroup();
+
+    // tag = http://127.0.0.1:8000/mount 128 [icy-name], the name catches a move to the fallback mount
+    settings.beginGroup("probe_mounts");
+    QStringList probeTags = settings.childKeys();
+    for (int i = 0; i < probeTags.count(); i++)
+        probeMounts.insert(probeTags.at(i), settings.value(probeTags.at(i)).toString());
+    settings.endGroup();
+
+    settings.beginGroup("rolling");
+    rollingHealthTimeout = settings.value("health_timeout", 30000).toInt();
+    rollingSettleTime = settings.value("settle_time", 3000).toInt();
+    settings.endGroup();
+
+    settings.beginGroup("shutdown");
+    liquidsoapGracePeriod = settings.value("liquidsoap_grace", 5000).toInt();
+    icecastGracePeriod = settings.value("icecast_grace", 3000).toInt();
+    settings.endGroup();
+
+    settings.beginGroup("state");
+    pidFilesEnabled = settings.value("pidfiles", false).toBool();
+    stateFlushInterval = settings.value("flush_interval", 100).toInt();
+    stateJournalSize = settings.value("journal_size", 4096).toInt();
+    settings.endGroup();
+
+    settings.beginGroup("history");
+    historyEnabled = settings.value("enabled", true).toBool();
+    historyRetentionDays = settings.value("retention_days", 30).toInt();
+    historyFlushInterval = settings.value("flush_interval", 500).toInt();
     settings.endGroup();
 
     settings.beginGroup("network");
     serverPort = settings.value("server_port", 8903).toInt();
     settings.endGroup();
 
+    settings.beginGroup("limits");
+    serverLimits.maxClients = settings.value("max_clients", 256).toInt();
+    serverLimits.maxClientsPerAddress = settings.value("max_clients_per_ip", 16).toInt();
+    serverLimits.connectRate = settings.value("connect_rate", 5).toDouble();
+    serverLimits.connectBurst = settings.value("connect_burst", 10).toDouble();
+    serverLimits.commandRate = settings.value("command_rate", 50).toDouble();
+    serverLimits.commandBurst = settings.value("command_burst", 100).toDouble();
+    serverLimits.authTimeout = settings.value("auth_timeout", 10000).toInt();
+    settings.endGroup();
+
+    settings.beginGroup("auth");
+    ticketLifetime = settings.value("ticket_lifetime", 3600).toInt();
+    settings.endGroup();
+
+    settings.beginGroup("monitor");
+    lagMonitorEnabled = settings.value("lag_monitor", true).toBool();
+    lagSampleInterval = settings.value("lag_sample_interval", 100).toInt();
+    lagStallThreshold = settings.value("lag_stall_threshold", 500).toInt();
+    settings.endGroup();
+
     settings.beginGroup("paths");
     liquidsoapAppPath = settings.value("liquidsoap_path", "/usr/bin/liquidsoap").toString();
     icecastAppPath = settings.value("server_port", "/usr/bin/icecast2").toString();
@@ -182,6 +719,74 @@ void WMCore::loadConfig(QString configFile)
     liquidsoapWorkingDir = settings.value("liquidsoap_workdir", dataDir + "/scripts").toString();
 
     settings.endGroup();
+
+    settings.beginGroup("local");
+    localSocketEnabled = settings.value("enabled", true).toBool();
+    localSocketPath = settings.value("socket", runtimeDir + "/core/control.sock").toString();
+    localSocketAllowGroup = settings.value("allow_group", false).toBool();
+    settings.endGroup();
+
+    settings.beginGroup("trace");
+    traceDir = settings.value("trace_dir", runtimeDir + "/trace").toString();
+    traceOnStart = settings.value("trace_on_start", false).toBool();
+    settings.endGroup();
+}
+
+QJsonObject WMCore::loadUpgradeState()
+{
+    QString fileName = QString::fromUtf8(qgetenv("WMCORE_UPGRADE_STATE"));
+
+    if (fileName.isEmpty())
+        return QJsonObject();
+
+    qunsetenv("WMCORE_UPGRADE_STATE");
+
+    QFile file(fileName);
+    if (!file.open(QIODevice::ReadOnly))
+    {
+        log (QString("Could not open upgrade state %1; error %2").arg(fileName).arg(file.errorString()), WMLogger::Warning);
+        return QJsonObject();
+    }
+
+    QJsonObject state = QJsonDocument::fromJson(file.readAll()).object();
+    file.close();
+    file.remove();
+
+    log (QString("Resuming after an upgrade from WMCore/%1").arg(state.value("version").toString()), WMLogger::Info);
+
+#ifdef __linux__
+    // Don't leak the inherited socket into the children we spawn from now on
+    int listenFd = state.value("listen_fd").toInt(-1);
+    if (listenFd >= 0)
+        fcntl(listenFd, F_SETFD, fcntl(listenFd, F_GETFD) | FD_CLOEXEC);
+#endif
+
+    return state;
+}
+
+void WMCore::applyUpgradeState(const QJsonObject &state)
+{
+    QJsonArray processes = state.value("processes").toArray();
+
+    for (int i = 0; i < processes.count(); i++)
+    {
+        QJsonObject item = processes.at(i).toObject();
+
+        for (int j = 0; j < processPool.count(); j++)
+        {
+            WMProcess *proc = processPool.at(j);
+
+            if (proc->tag() == item.value("tag").toString() && proc->typeAsString() == item.value("type").toString())
+            {
+                if (proc->pid() != item.value("pid").toInt())
+                    log (QString("Instance %1 has PID %2 after the upgrade, expected %3")
+                         .arg(proc->tag()).arg(proc->pid()).arg(item.value("pid").toInt()), WMLogger::Warning);
+
+                proc->setNeedsRespawn(item.value("respawn").toBool());
+                break;
+            }
+        }
+    }
 }
 
 bool WMCore::loadInstances(WMProcess::ProcessType type)
@@ -287,7 +892,14 @@ void WMCore::createProcesses(WMProcess::ProcessType type)
 
     for (int i = 0; i < tags.count(); i++)
     {
-        createProcessFor(tags.at(i), type);
+        if (WMStateStore::instance != NULL &&
+            WMStateStore::instance->state(tags.at(i), WMProcess::typeToString(type)).desiredState == WMStateStore::Stopped)
+        {
+            log (QString("Instance %1 has been stopped by the operator, not starting it").arg(tags.at(i)), WMLogger::Info);
+            continue;
+        }
+
+        createProcessFor(tags.at(i), type, false);
     }
 }
 
@@ -324,7 +936,7 @@ void WMCore::correctProcesses(WMProcess::ProcessType type)
     for (int i = 0; i < tags.count(); i++)
     {
         if (getProcessFor(tags.at(i), type) == NULL)
-           createProcessFor(tags.at(i), type);
+           createProcessFor(tags.at(i), type, false);
     }
 
     for (int i = 0; i < processPool.count(); i++)
@@ -352,14 +964,30 @@ WMProcess *WMCore::getProcessFor(QString tag, WMProcess::ProcessType type)
     return NULL;
 }
 
-bool WMCore::createProcessFor(QString tag, WMProcess::ProcessType type)
+// Operator requests are `immediate`; mass starts and respawns queue up in
+// the spawn scheduler unless they just reattach to a running instance
+bool WMCore::createProcessFor(QString tag, WMProcess::ProcessType type, bool immediate)
 {
+    if (isExiting)
+    {
+        log (QString("Not creating a process for %1, the Core is exiting").arg(tag));
+        return false;
+    }
+
     if (getProcessFor(tag, type) != NULL)
     {
         log (QString("A process for %1 is already running").arg(tag));
         return false;
     }
 
+    if (cluster != NULL && type == WMProcess::Liquidsoap && !cluster->owns(tag))
+    {
+        log (QString("Station %1 belongs to cluster node %2, not starting it here").arg(tag).arg(cluster->ownerOf(tag)));
+        return false;
+    }
+
+    WMTracer::Span span("createProcessFor", "process", tag, WMProcess::typeToString(type));
+
     log (QString("Creating a new process instance for %1").arg(tag));
 
     QString procPath;
@@ -392,6 +1020,30 @@ bool WMCore::createProcessFor(QString tag, WMProcess::ProcessType type)
 
     WMProcess *process = new WMProcess(procPath, runtimeDir, tag, type, procArgs, procWd);
 
+    if (!immediate && scheduler != NULL && !process->attached())
+    {
+        delete process;
+
+        bool critical = (type == WMProcess::Icecast || criticalTags.contains(tag));
+        scheduler->enqueue(tag, type, critical ? WMSpawnScheduler::Critical : WMSpawnScheduler::Normal);
+        return true;
+    }
+
+    // A running instance is reattached whatever its script looks like now
+    if (type == WMProcess::Liquidsoap && !process->attached() && !preflight(tag, procArgs.at(0)))
+    {
+        delete process;
+        return scriptCheck->isPending(tag);
+    }
+
+    WMTracer::instance->begin("spawn", "spawn", WMTracer::spanId(tag, WMProcess::typeToString(type)),
+                              tag, WMProcess::typeToString(type));
+
+    if (WMStateStore::instance != NULL)
+        WMStateStore::instance->setDesiredState(tag, WMProcess::typeToString(type), WMStateStore::Running);
+
+    process->setStopGracePeriod(gracePeriodFor(type));
+
     processPool.append(process);
 
     connect(process, SIGNAL(processDead(int, bool)), this, SLOT(onProcessDeath(int,bool)));
@@ -401,16 +1053,53 @@ bool WMCore::createProcessFor(QString tag, WMProcess::ProcessType type)
     return true;
 }
 
+// False when the script has to be checked first (the spawn is retried from
+// onScriptChecked()) or is known to be broken
+bool WMCore::preflight(QString tag, QString script)
+{
+    if (scriptCheck == NULL || preflightCleared.contains(tag))
+        return true;
+
+    switch (scriptCheck->verdict(script))
+    {
+        case WMScriptCheck::Passed:
+            return true;
+
+        case WMScriptCheck::Failed:
+            log (QString("Script %1 did not pass the check, not starting %2").arg(script).arg(tag), WMLogger::Error);
+            return false;
+
+        default:
+            scriptCheck->check(tag, script);
+            return false;
+    }
+}
+
 bool WMCore::stopProcessFor(QString tag, WMProcess::ProcessType type, bool forced)
 {
     WMProcess *proc = getProcessFor(tag, type);
 
     if (proc != NULL)
     {
+        if (WMStateStore::instance != NULL)
+            WMStateStore::instance->setDesiredState(tag, WMProcess::typeToString(type), WMStateStore::Stopped);
+
+        if (standbyPool.contains(tag) && type == WMProcess::Liquidsoap)
+            standbyPool.value(tag)->stop(true);
+
         proc->setNeedsRespawn(false);
         proc->stop(forced);
         return true;
     }
+    else if (scheduler != NULL && scheduler->dequeue(tag, type))
+    {
+        log (QString("Dropped the queued spawn of %1").arg(tag));
+
+        if (WMStateStore::instance != NULL)
+            WMStateStore::instance->setDesiredState(tag, WMProcess::typeToString(type), WMStateStore::Stopped);
+
+        return true;
+    }
     else
     {
         log (QString("Trying to stop an already dead process for %1").arg(tag), WMLogger::Warning);
@@ -422,15 +1111,121 @@ void WMCore::restartProcessFor(QString tag, WMProcess::ProcessType type)
 {
     WMProcess *proc = getProcessFor(tag, type);
 
+    if (proc == NULL)
+    {
+        createProcessFor(tag, type);
+        return;
+    }
+
     proc->setNeedsRespawn(true);
     proc->stop();
 }
 
+// Crash respawns queue up in the spawn scheduler, requested restarts
+// (operator, rolling, stream probe) are `immediate`
+void WMCore::respawnProcessFor(WMProcess *proc, bool immediate)
+{
+    if (WMStateStore::instance != NULL)
+        WMStateStore::instance->countRestart(proc->tag(), proc->typeAsString());
+
+    if (WMHistory::instance != NULL)
+        WMHistory::instance->record(proc->typeAsString(), proc->tag(), "respawn", 0, 0, 0);
+
+    createProcessFor(proc->tag(), proc->type(), immediate);
+}
+
+// A standby runs the same station from an alternate script (feeding an
+// alternate mount, normally the primary's fallback-mount, or a dummy
+// output) and takes over the moment the primary instance dies. In paused
+// mode it is held stopped once ready, which it reports by creating the
+// file passed to it as its first script argument (argv(1) in Liquidsoap).
+// Never the primary's own script there: a standby frozen while holding
+// the production mount would take the station off air.
+bool WMCore::spawnStandbyFor(QString tag, QString script)
+{
+    if (standbyPool.contains(tag))
+        return false;
+
+    if (script.isEmpty())
+        script = QString("%1/scripts/%2.standby.liq").arg(dataDir).arg(tag);
+
+    if (!QFile::exists(script))
+    {
+        log (QString("No standby script %1 for critical station %2").arg(script).arg(tag), WMLogger::Warning);
+        return false;
+    }
+
+    log (QString("Creating a standby instance for %1").arg(tag), WMLogger::Info);
+
+    QStringList arguments;
+    arguments << script;
+
+    if (standbyMode == "paused")
+    {
+        QDir().mkpath(runtimeDir + "/standby");
+        QFile::remove(standbyReadyFile(tag));
+        arguments << "--" << standbyReadyFile(tag);
+    }
+
+    WMProcess *standby = new WMProcess(liquidsoapAppPath, runtimeDir, tag + "~standby", WMProcess::Liquidsoap,
+                                       arguments, liquidsoapWorkingDir);
+    standby->setStopGracePeriod(liquidsoapGracePeriod);
+
+    standbyPool.insert(tag, standby);
+
+    connect(standby, SIGNAL(processDead(int, bool)), this, SLOT(onStandbyDeath(int,bool)));
+    connect(standby, SIGNAL(processStarted()), this, SLOT(onStandbyStart()));
+    standby->start();
+
+    return true;
+}
+
+bool WMCore::promoteStandbyFor(WMProcess *deadProc)
+{
+    WMProcess *standby = standbyPool.value(deadProc->tag(), NULL);
+
+    if (standby == NULL || standby->pid() <= 0)
+        return false;
+
+    log (QString("Promoting the standby instance of %1 (PID %2)").arg(deadProc->tag()).arg(standby->pid()),
+         WMLogger::Info);
+
+    standbyPool.remove(deadProc->tag());
+    standbyPending.remove(deadProc->tag());
+
+    disconnect(standby, 0, this, 0);
+    connect(standby, SIGNAL(processDead(int, bool)), this, SLOT(onProcessDeath(int,bool)));
+    connect(standby, SIGNAL(processStarted()), this, SLOT(onProcessStart()));
+
+    standby->resume();
+
+    standby->rename(deadProc->tag());
+    processPool.append(standby);
+
+    if (WMHistory::instance != NULL)
+        WMHistory::instance->record(standby->typeAsString(), standby->tag(), "promote", 0, standby->pid(), 0);
+
+    server->onProcessChangeState(standby->tag(), standby->type(), WMControlServer::Promote);
+    emit instanceStarted(standby->tag(), standby->type());
+
+    // The roles swap: the dead primary's script becomes the new standby,
+    // unless that one is going to be paused, see spawnStandbyFor()
+    spawnStandbyFor(deadProc->tag(), standbyMode == "paused" ? QString() : deadProc->arguments().value(0));
+
+    return true;
+}
+
 void WMCore::killAllProcesses(WMProcess::ProcessType type, bool forRestart)
 {
-    log (QString("Killing all the running processes of type %1").arg(WMProcess::typeToString(type)),
+    log (QString("Stopping all the running processes of type %1").arg(WMProcess::typeToString(type)),
          WMLogger::Info);
 
+    if (scheduler != NULL && type == WMProcess::Abstract && !forRestart)
+        scheduler->clear();
+
+    // Everyone gets SIGTERM at once; each process escalates to SIGKILL
+    // on its own after its grace period, so the total time is bounded
+    // by the longest grace period rather than by the instance count
     for (int i = 0; i < processPool.count(); i++)
     {
         WMProcess *proc = processPool.at(i);
@@ -438,35 +1233,188 @@ void WMCore::killAllProcesses(WMProcess::ProcessType type, bool forRestart)
         if (proc->type() == type || type == WMProcess::Abstract)
         {
             proc->setNeedsRespawn(forRestart);
-            proc->stop(true);
+            proc->stop();
         }
     }
+
+    if (type == WMProcess::Liquidsoap || type == WMProcess::Abstract)
+    {
+        QList<WMProcess *> standbys = standbyPool.values();
+
+        for (int i = 0; i < standbys.count(); i++)
+            standbys.at(i)->stop();
+    }
+}
+
+// Runs the event loop until every process has reported its death
+// or the timeout expires, whichever comes first
+void WMCore::waitForProcesses(int timeout)
+{
+    if (processPool.isEmpty() && standbyPool.isEmpty())
+        return;
+
+    log (QString("Waiting up to %1 ms for %2 processes to exit")
+         .arg(timeout).arg(processPool.count() + standbyPool.count()), WMLogger::Info);
+
+    QEventLoop loop;
+    QTimer deadline;
+    deadline.setSingleShot(true);
+
+    connect(&deadline, SIGNAL(timeout()), &loop, SLOT(quit()));
+    connect(this, SIGNAL(allProcessesDead()), &loop, SLOT(quit()));
+
+    deadline.start(timeout);
+    loop.exec();
+
+    if (!processPool.isEmpty() || !standbyPool.isEmpty())
+        log (QString("%1 processes did not report their exit in time")
+             .arg(processPool.count() + standbyPool.count()), WMLogger::Warning);
+}
+
+int WMCore::gracePeriodFor(WMProcess::ProcessType type)
+{
+    switch (type)
+    {
+        case WMProcess::Liquidsoap:
+            return liquidsoapGracePeriod;
+
+        case WMProcess::Icecast:
+            return icecastGracePeriod;
+
+        default:
+            return qMax(liquidsoapGracePeriod, icecastGracePeriod);
+    }
+}
+
+void WMCore::onSignal(int signal)
+{
+#ifdef __linux__
+    if (signal == SIGUSR2)
+        upgrade();
+    else if (signal == SIGTERM || signal == SIGINT)
+        app->quit();
+#else
+    Q_UNUSED(signal);
+#endif
+}
+
+void WMCore::onScriptChecked(QString tag, bool passed)
+{
+    WMLagMonitor::HandlerScope handlerScope("WMCore::onScriptChecked");
+
+    if (!passed)
+    {
+        if (WMHistory::instance != NULL)
+            WMHistory::instance->record("liquidsoap", tag, "check_failed", 0, 0, 0);
+
+        return;
+    }
+
+    if (!liquidsoapTags.contains(tag) || getProcessFor(tag, WMProcess::Liquidsoap) != NULL)
+        return;
+
+    // Also covers a check that could not give a verdict
+    preflightCleared.insert(tag);
+    createProcessFor(tag, WMProcess::Liquidsoap);
+    preflightCleared.remove(tag);
+}
+
+void WMCore::onSpawnAdmitted(QString tag, WMProcess::ProcessType type)
+{
+    WMLagMonitor::HandlerScope handlerScope("WMCore::onSpawnAdmitted");
+
+    // The tag may have left the configuration or the cluster while queued
+    if (!getTags(type).contains(tag))
+        return;
+
+    createProcessFor(tag, type);
+}
+
+void WMCore::onStreamStalled(QString tag, double rate, int bitrate)
+{
+    WMLagMonitor::HandlerScope handlerScope("WMCore::onStreamStalled");
+
+    // Not running here, the PID supervision knows better
+    if (getProcessFor(tag, WMProcess::Liquidsoap) == NULL)
+        return;
+
+    server->publish("STREAM", QString("STREAM STALL %1 %2 %3").arg(tag).arg(rate, 0, 'f', 1).arg(bitrate));
+
+    if (WMHistory::instance != NULL)
+        WMHistory::instance->record("liquidsoap", tag, "stream_stall", 0, 0, 0);
+
+    if (probeRestart)
+    {
+        log (QString("Restarting %1, its mount has stalled").arg(tag), WMLogger::Warning);
+        restartProcessFor(tag, WMProcess::Liquidsoap);
+        streamProbe->reset(tag);
+    }
+}
+
+void WMCore::onStreamRecovered(QString tag, double rate)
+{
+    server->publish("STREAM", QString("STREAM OK %1 %2").arg(tag).arg(rate, 0, 'f', 1));
 }
 
 void WMCore::onProcessStart()
 {
+    WMLagMonitor::HandlerScope handlerScope("WMCore::onProcessStart");
     WMProcess *proc = (WMProcess *)QObject::sender();
+    WMTracer::Span span("onProcessStart", "process", proc->tag(), proc->typeAsString());
 
     log (QString("A process of type %1 for tag %2 has successfully started with pid %3")
          .arg(proc->type()).arg(proc->tag()).arg(proc->pid()));
 
+    if (WMHistory::instance != NULL)
+        WMHistory::instance->record(proc->typeAsString(), proc->tag(), proc->attached() ? "attach" : "start",
+                                    0, proc->pid(), 0);
+
     server->onProcessChangeState(proc->tag(), proc->type(), WMControlServer::Start);
+    emit instanceStarted(proc->tag(), proc->type());
+
+    if (proc->type() == WMProcess::Liquidsoap && criticalTags.contains(proc->tag()))
+        spawnStandbyFor(proc->tag());
+
+    updateServing();
 }
 
 void WMCore::onProcessDeath(int exitCode, bool needsToRespawn)
 {
+    WMLagMonitor::HandlerScope handlerScope("WMCore::onProcessDeath");
     WMProcess *proc = (WMProcess *)QObject::sender();
+    WMTracer::Span span("onProcessDeath", "process", proc->tag(), proc->typeAsString());
+    span.setDetail(QString::number(exitCode));
 
     log (QString("A process of type %1 for tag %2 has just dead with exit code %3")
          .arg(proc->typeAsString()).arg(proc->tag()).arg(exitCode), WMLogger::Info);
 
 
     processPool.removeOne(proc);
+    updateServing();
 
     server->onProcessChangeState(proc->tag(), proc->type(),
         (exitCode == 0 || exitCode == WMProcess::RC_KILLEDBYCONTROL)
                                  ? WMControlServer::Stop
                                  : WMControlServer::Crash);
+    emit instanceDied(proc->tag(), proc->type(), exitCode);
+
+    if (WMStateStore::instance != NULL && exitCode != 0 && exitCode != WMProcess::RC_KILLEDBYCONTROL)
+        WMStateStore::instance->countCrash(proc->tag(), proc->typeAsString());
+
+    if (WMHistory::instance != NULL)
+    {
+        QString event;
+
+        if (exitCode == WMProcess::RC_CANNOTSTART)
+            event = "cannotstart";
+        else if (exitCode == 0 || exitCode == WMProcess::RC_KILLEDBYCONTROL)
+            event = "stop";
+        else
+            event = "crash";
+
+        WMHistory::instance->record(proc->typeAsString(), proc->tag(), event, exitCode, proc->pid(),
+                                    proc->startTime() > 0 ? QDateTime::currentMSecsSinceEpoch() - proc->startTime() : 0);
+    }
 
     if (exitCode == WMProcess::RC_CANNOTSTART)
     {
@@ -474,10 +1422,25 @@ void WMCore::onProcessDeath(int exitCode, bool needsToRespawn)
         return;
     }
 
+    // Crashes of critical stations fail over to the standby
+    if (exitCode != WMProcess::RC_KILLEDBYCONTROL && promoteStandbyFor(proc))
+    {
+        proc->deleteLater();
+        return;
+    }
+
+    // A requested restart is usually about new scripts or binaries, the
+    // standby gets replaced as well once the primary runs the new code
+    if (needsToRespawn && standbyPool.contains(proc->tag()))
+    {
+        standbyRefresh.insert(proc->tag());
+        standbyPool.value(proc->tag())->stop();
+    }
+
     if (needsToRespawn)
     {
         log ("This process requires to restart itself");
-        createProcessFor(proc->tag(), proc->type());
+        respawnProcessFor(proc, true);
     }
         else
     if (respawnProcessesOnDeath && exitCode != WMProcess::RC_KILLEDBYCONTROL)
@@ -487,21 +1450,275 @@ void WMCore::onProcessDeath(int exitCode, bool needsToRespawn)
             if (exitCode == 0)
                 log ("We need to respawn only really crashed processes.");
             else
-                createProcessFor(proc->tag(), proc->type());
+                respawnProcessFor(proc);
         }
         else
-            createProcessFor(proc->tag(), proc->type());
+            respawnProcessFor(proc);
     }
     else
         log ("Good night, sweet process.");
 
     proc->deleteLater();
+
+    if (isExiting && processPool.isEmpty() && standbyPool.isEmpty())
+        emit allProcessesDead();
+}
+
+void WMCore::onStandbyStart()
+{
+    WMProcess *standby = (WMProcess *)QObject::sender();
+
+    log (QString("Standby instance %1 has started with pid %2").arg(standby->tag()).arg(standby->pid()));
+
+    // Liquidsoap has to compile its script and open its inputs first, a
+    // standby held before that would be promoted cold
+    if (standbyMode != "paused")
+        return;
+
+    standbyPending.insert(standbyPool.key(standby), QDateTime::currentMSecsSinceEpoch() + standbyReadyTimeout);
+
+    if (standbyCheckTimerId == 0)
+        standbyCheckTimerId = WMTimerWheel::instance->schedule(500, this, "onStandbyReadyCheck");
+}
+
+// Pauses the standbys that have reported ready, or have had their time
+void WMCore::onStandbyReadyCheck()
+{
+    WMLagMonitor::HandlerScope handlerScope("WMCore::onStandbyReadyCheck");
+
+    standbyCheckTimerId = 0;
+
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    QMap<QString, qint64>::iterator it = standbyPending.begin();
+
+    while (it != standbyPending.end())
+    {
+        WMProcess *standby = standbyPool.value(it.key(), NULL);
+
+        if (standby == NULL || standby->pid() <= 0)
+        {
+            it = standbyPending.erase(it);
+            continue;
+        }
+
+        bool ready = QFile::exists(standbyReadyFile(it.key()));
+
+        if (!ready && now < it.value())
+        {
+            ++it;
+            continue;
+        }
+
+        if (ready)
+            log (QString("Standby instance of %1 is ready, pausing it").arg(it.key()));
+        else
+            log (QString("Standby instance of %1 did not report ready within %2 ms, pausing it anyway")
+                 .arg(it.key()).arg(standbyReadyTimeout), WMLogger::Warning);
+
+        standby->pause();
+        it = standbyPending.erase(it);
+    }
+
+    if (!standbyPending.isEmpty())
+        standbyCheckTimerId = WMTimerWheel::instance->schedule(500, this, "onStandbyReadyCheck");
+}
+
+QString WMCore::standbyReadyFile(QString tag)
+{
+    return QString("%1/standby/%2.ready").arg(runtimeDir).arg(tag);
+}
+
+void WMCore::onStandbyDeath(int exitCode, bool needsToRestart)
+{
+    Q_UNUSED(needsToRestart);
+
+    WMProcess *standby = (WMProcess *)QObject::sender();
+    QString tag = standbyPool.key(standby);
+
+    log (QString("Standby instance %1 has just dead with exit code %2").arg(standby->tag()).arg(exitCode), WMLogger::Info);
+
+    standbyPool.remove(tag);
+    standby->deleteLater();
+
+    if (isExiting && processPool.isEmpty() && standbyPool.isEmpty())
+        emit allProcessesDead();
+
+    // If the primary has already restarted it could not spawn its new standby
+    if (standbyRefresh.remove(tag))
+    {
+        if (!isExiting && getProcessFor(tag, WMProcess::Liquidsoap) != NULL)
+            spawnStandbyFor(tag);
+
+        return;
+    }
+
+    if (exitCode == WMProcess::RC_KILLEDBYCONTROL || exitCode == WMProcess::RC_CANNOTSTART)
+        return;
+
+    if (respawnProcessesOnDeath && getProcessFor(tag, WMProcess::Liquidsoap) != NULL)
+        spawnStandbyFor(tag, standby->arguments().value(0));
+}
+
+void WMCore::onRollingRestartFinished()
+{
+    WMRollingRestart *finished = (WMRollingRestart *)QObject::sender();
+
+    if (finished == rollingRestart)
+        rollingRestart = NULL;
+
+    finished->deleteLater();
+}
+
+// Starts the stations that moved to us and hands over the ones that moved away
+void WMCore::onClusterChanged()
+{
+    WMLagMonitor::HandlerScope handlerScope("WMCore::onClusterChanged");
+    QStringList owned;
+
+    for (int i = 0; i < liquidsoapCatalog.count(); i++)
+    {
+        if (cluster->owns(liquidsoapCatalog.at(i)))
+            owned.append(liquidsoapCatalog.at(i));
+    }
+
+    log (QString("Cluster placement: %1 of %2 stations are ours").arg(owned.count()).arg(liquidsoapCatalog.count()),
+         WMLogger::Info);
+
+    liquidsoapTags = owned;
+
+    // Moved stations stay on air here until their new owner runs them
+    qint64 deadline = QDateTime::currentMSecsSinceEpoch() + clusterHandoverTimeout;
+
+    for (int i = 0; i < processPool.count(); i++)
+    {
+        WMProcess *proc = processPool.at(i);
+
+        if (proc->type() != WMProcess::Liquidsoap || owned.contains(proc->tag()) || handovers.contains(proc->tag()))
+            continue;
+
+        log (QString("Station %1 moved to cluster node %2, handing it over").arg(proc->tag())
+             .arg(cluster->ownerOf(proc->tag())), WMLogger::Info);
+
+        handovers.insert(proc->tag(), deadline);
+    }
+
+    updateServing();
+    createProcesses(WMProcess::Liquidsoap);
+    onHandoverCheck();
+}
+
+// Stops moved stations once the new owner advertises them, or when it
+// hasn't done so within handover_timeout
+void WMCore::onHandoverCheck()
+{
+    WMLagMonitor::HandlerScope handlerScope("WMCore::onHandoverCheck");
+
+    if (cluster == NULL)
+        return;
+
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    QMap<QString, qint64>::iterator it = handovers.begin();
+
+    while (it != handovers.end())
+    {
+        QString tag = it.key();
+        WMProcess *proc = getProcessFor(tag, WMProcess::Liquidsoap);
+
+        // Gone on its own, or the station came back to us meanwhile
+        if (proc == NULL || liquidsoapTags.contains(tag))
+        {
+            it = handovers.erase(it);
+            continue;
+        }
+
+        QString owner = cluster->ownerOf(tag);
+        bool taken = cluster->isServing(owner, tag);
+
+        if (!taken && now < it.value())
+        {
+            ++it;
+            continue;
+        }
+
+        if (taken)
+            log (QString("Station %1 is up on cluster node %2, stopping it here").arg(tag).arg(owner), WMLogger::Info);
+        else
+            log (QString("Cluster node %1 did not take station %2 over in time, stopping it here anyway")
+                 .arg(owner).arg(tag), WMLogger::Warning);
+
+        if (standbyPool.contains(tag))
+            standbyPool.value(tag)->stop();
+
+        // Unlike an operator STOP this leaves the desired state alone
+        proc->setNeedsRespawn(false);
+        proc->stop();
+
+        it = handovers.erase(it);
+    }
+
+    if (handovers.isEmpty())
+        handoverTimer->stop();
+    else if (!handoverTimer->isActive())
+        handoverTimer->start();
+}
+
+// What our heartbeats advertise, see onHandoverCheck() on the other nodes.
+// The mount itself can't tell: the old owner holds it until it stops, and
+// Icecast takes one source per mount. So a station counts once liquidsoap
+// has survived compiling its script and starting up for serving_uptime;
+// its output then takes the mount on its next reconnect attempt.
+void WMCore::updateServing()
+{
+    if (cluster == NULL)
+        return;
+
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    QStringList serving;
+
+    for (int i = 0; i < processPool.count(); i++)
+    {
+        WMProcess *proc = processPool.at(i);
+
+        if (proc->type() != WMProcess::Liquidsoap || proc->pid() <= 0 || handovers.contains(proc->tag()))
+            continue;
+
+        // Attached ones without a recorded start have been up since before us
+        if (proc->startTime() > 0 && now - proc->startTime() < clusterServingUptime)
+            continue;
+
+        serving.append(proc->tag());
+    }
+
+    cluster->setServing(serving);
 }
 
 void WMCore::onCoreExit()
 {
+    if (isExiting)
+        return;
+
+    isExiting = true;
+
+    if (rollingRestart != NULL)
+        rollingRestart->abort();
+
     log ("Stopping the Core", WMLogger::Info);
     server->stop();
 
     killAllProcesses(WMProcess::Abstract);
+
+    // Leave a little room for the kills issued at the end of the grace period
+    waitForProcesses(gracePeriodFor(WMProcess::Abstract) + 1000);
+
+    // Only now that our stations are off the mounts may the peers take them
+    if (cluster != NULL)
+        cluster->stop();
+
+    if (lagMonitor != NULL)
+        lagMonitor->stop();
+
+    WMTracer::instance->stop();
+
+    if (WMStateStore::instance != NULL)
+        WMStateStore::instance->flush();
 }
@@ -6,6 +6,9 @@
 #include <QString>
 #include <QStringList>
 #include <QSettings>
+#include <QVector>
+#include <QMap>
+#include <QSet>
 #include <QFile>
 #include <QJsonDocument>
 #include <QJsonArray>
@@ -14,10 +17,34 @@
 #include <QJsonParseError>
 
 #include <QFileInfo>
+#include <QDateTime>
+#include <QEventLoop>
+#include <QTimer>
+#include <QSysInfo>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/prctl.h>
+#endif
 
 #include "wmlogger.h"
 #include "wmprocess.h"
 #include "wmcontrolserver.h"
+#include "wmlagmonitor.h"
+#include "wmtracer.h"
+#include "wmstatestore.h"
+#include "wmhistory.h"
+#include "wmsignalhandler.h"
+#include "wmrollingrestart.h"
+#include "wmcluster.h"
+#include "wmscriptcheck.h"
+#include "wmspawnscheduler.h"
+#include "wmpressuremonitor.h"
+#include "wmstreamprobe.h"
 
 class WMControlServer;
 
@@ -31,7 +58,20 @@ public:
     // Broadcasting processes
     bool performProcessAction(QString tag, WMProcess::ProcessType type, WMControlServer::ProcessControlAction action);
     QString getCurrentSecret();
+    QByteArray getTicketKey();
+    int getTicketLifetime();
     QStringList getInstancesList();
+    QStringList getTags(WMProcess::ProcessType type);
+    QStringList getLagReport(bool reset = false);
+    bool getHistory(QString tag, qint64 since, int limit, QStringList &events);
+    bool upgrade();
+    QStringList getStandbyList();
+    WMRollingRestart *startRollingRestart(WMProcess::ProcessType type, QStringList tags,
+                                          int maxInFlight, double maxFailureRatio);
+    WMRollingRestart *getRollingRestart();
+    WMCluster *getCluster();
+    WMSpawnScheduler *getScheduler();
+    WMStreamProbe *getStreamProbe();
 
 private:
 
@@ -39,7 +79,21 @@ private:
     /// Objects & Pointers
     QCoreApplication *app;
     WMControlServer *server;
+    WMLagMonitor *lagMonitor;
+    WMSignalHandler *signalHandler;
+    WMCluster *cluster;
+    WMScriptCheck *scriptCheck;
+    WMSpawnScheduler *scheduler;
+    WMPressureMonitor *pressureMonitor;
+    WMStreamProbe *streamProbe;
+
+    // What to execute on upgrade, captured before the binary gets replaced
+    QString execPath;
+    QStringList execArgs;
     QList<WMProcess *> processPool;
+    QMap<QString, WMProcess *> standbyPool;
+    WMRollingRestart *rollingRestart;
+    QSet<QString> preflightCleared;
 
     /// Config variables
     // System
@@ -56,16 +110,103 @@ private:
     QString dataDir;
     QStringList liquidsoapTags;
     QStringList icecastTags;
+    QStringList liquidsoapCatalog;     // every station of the cluster, liquidsoapTags holds ours
     bool respawnProcessesOnDeath;
     bool respawnOnlyOnBadDeath;
+    QStringList criticalTags;
+    QString standbyMode;
+    int standbyReadyTimeout;
+    QMap<QString, qint64> standbyPending;      // paused mode: tag -> ms since epoch to stop waiting for readiness
+    WMTimerWheel::TimerId standbyCheckTimerId;
+    QSet<QString> standbyRefresh;      // standbys stopped to pick up new code
+
+    // Cluster
+    bool clusterEnabled;
+    QString clusterNodeId;
+    int clusterCapacity;
+    int clusterPort;
+    QStringList clusterPeers;
+    QString clusterKey;
+    int clusterHeartbeatInterval;
+    int clusterPeerTimeout;
+    int clusterHandoverTimeout;
+    int clusterServingUptime;
+    QTimer *servingTimer;
+    QMap<QString, qint64> handovers;    // moved station -> ms since epoch to give up waiting
+    QTimer *handoverTimer;
+
+    // Script pre-flight
+    bool preflightEnabled;
+    int preflightConcurrency;
+    int preflightTimeout;
+
+    // Spawn admission
+    bool schedulerEnabled;
+    WMSchedulerLimits schedulerLimits;
+
+    // Pressure alerts
+    bool pressureEnabled;
+    int pressureStall;
+    int pressureWindow;
+    QStringList pressureResources;
+    bool pressureCgroup;
+
+    // Stream probe
+    bool probeEnabled;
+    int probeInterval;
+    double probeMinRatio;
+    int probeFailures;
+    bool probeRestart;
+    bool probeContinuous;
+    int probeBurst;
+    int probeWindow;
+    QMap<QString, QString> probeMounts;    // tag -> "url bitrate [icy-name]"
+
+    // Rolling restarts
+    int rollingHealthTimeout;
+    int rollingSettleTime;
+
+    // Shutdown
+    int liquidsoapGracePeriod;
+    int icecastGracePeriod;
+    bool isExiting;
+
+    // Runtime state
+    bool pidFilesEnabled;
+    QString spawnBackend;
+    QString reaperMode;
+    int timerResolution;
+    int stateFlushInterval;
+    int stateJournalSize;
+    bool historyEnabled;
+    int historyRetentionDays;
+    int historyFlushInterval;
 
     // Control server
     uint serverPort;
+    int ticketLifetime;
+    WMControlLimits serverLimits;
+    bool localSocketEnabled;
+    QString localSocketPath;
+    bool localSocketAllowGroup;
+
+    // Session ticket key, rederived whenever the secret file changes
+    QByteArray ticketKey;
+    QDateTime ticketKeySource;
+
+    // Monitoring
+    bool lagMonitorEnabled;
+    int lagSampleInterval;
+    int lagStallThreshold;
+    QString traceDir;
+    bool traceOnStart;
 
     /// Methods
     // System
     void log(QString message, WMLogger::LogLevel logLevel = WMLogger::Debug, QString component = "wcore");
     void loadConfig (QString configFile);
+    QJsonObject loadUpgradeState();
+    void applyUpgradeState(const QJsonObject &state);
     bool loadInstances(WMProcess::ProcessType type);
 
     // Broadcasting processes    
@@ -73,16 +214,39 @@ private:
     void correctProcesses(WMProcess::ProcessType type);
 
     WMProcess *getProcessFor(QString tag, WMProcess::ProcessType type);
-    bool createProcessFor(QString tag, WMProcess::ProcessType type);
+    bool createProcessFor(QString tag, WMProcess::ProcessType type, bool immediate = true);
+    bool preflight(QString tag, QString script);
+    QString standbyReadyFile(QString tag);
     bool stopProcessFor(QString tag, WMProcess::ProcessType type, bool forced = false);
     void restartProcessFor(QString tag, WMProcess::ProcessType type);
+    void respawnProcessFor(WMProcess *proc, bool immediate = false);
+
+    bool spawnStandbyFor(QString tag, QString script = QString());
+    bool promoteStandbyFor(WMProcess *deadProc);
     void killAllProcesses(WMProcess::ProcessType type = WMProcess::Abstract, bool forRestart = false);
+    void waitForProcesses(int timeout);
+    int gracePeriodFor(WMProcess::ProcessType type);
 
 signals:
+    void allProcessesDead();
+    void instanceStarted(QString tag, WMProcess::ProcessType type);
+    void instanceDied(QString tag, WMProcess::ProcessType type, int exitCode);
 
 private slots:
+    void onSignal(int signal);
     void onProcessStart();
     void onProcessDeath(int exitCode, bool needsToRestart);
+    void onStandbyStart();
+    void onStandbyDeath(int exitCode, bool needsToRestart);
+    void onStandbyReadyCheck();
+    void updateServing();
+    void onRollingRestartFinished();
+    void onClusterChanged();
+    void onHandoverCheck();
+    void onScriptChecked(QString tag, bool passed);
+    void onSpawnAdmitted(QString tag, WMProcess::ProcessType type);
+    void onStreamStalled(QString tag, double rate, int bitrate);
+    void onStreamRecovered(QString tag, double rate);
 
 public slots:
     void onCoreExit();
@@ -0,0 +1,108 @@
+#include "wmexitjournal.h"
+#include "wmprocess.h"
+
+WMExitJournal *WMExitJournal::instance = 0;
+
+WMExitJournal::WMExitJournal(QString fileName, QObject *parent) :
+    QObject(parent), fileName(fileName), offset(0)
+{
+    watcher = new QFileSystemWatcher(this);
+    connect(watcher, SIGNAL(fileChanged(QString)), this, SLOT(onFileChanged()));
+}
+
+bool WMExitJournal::open()
+{
+    QFile file(fileName);
+
+    // The watcher needs the file to exist before the shim writes to it
+    if (!file.open(QIODevice::ReadOnly | QIODevice::Append))
+    {
+        log (QString("Could not open the exit journal %1: %2").arg(fileName).arg(file.errorString()), WMLogger::Warning);
+        return false;
+    }
+
+    // Earlier lines are about earlier holders of the PIDs
+    offset = file.size();
+    file.close();
+
+    watcher->addPath(fileName);
+
+    log (QString("Reading orphan exit codes from %1").arg(fileName), WMLogger::Info);
+    return true;
+}
+
+void WMExitJournal::watch(int pid, WMProcess *proc)
+{
+    processes.insert(pid, proc);
+}
+
+void WMExitJournal::unwatch(int pid, WMProcess *proc)
+{
+    if (processes.value(pid) == proc)
+        processes.remove(pid);
+}
+
+int WMExitJournal::take(int pid)
+{
+    readNew();
+    return unclaimed.contains(pid) ? unclaimed.take(pid) : -1;
+}
+
+void WMExitJournal::readNew()
+{
+    QFile file(fileName);
+
+    if (!file.open(QIODevice::ReadOnly))
+        return;
+
+    if (file.size() < offset)
+        offset = 0;
+
+    file.seek(offset);
+    QByteArray data = partial + file.readAll();
+    offset = file.pos();
+    file.close();
+
+    QList<QByteArray> lines = data.split('\n');
+    partial = lines.takeLast();
+
+    for (int i = 0; i < lines.count(); i++)
+    {
+        QList<QByteArray> fields = lines.at(i).split(' ');
+
+        if (fields.count() < 2)
+            continue;
+
+        int pid = fields.at(0).toInt();
+        int exitCode = fields.at(1).toInt();
+        WMProcess *proc = processes.take(pid);
+
+        if (proc != NULL)
+        {
+            log (QString("Orphan %1 exited with code %2").arg(pid).arg(exitCode));
+            proc->onChildExited(exitCode);
+            continue;
+        }
+
+        if (unclaimed.count() >= maxUnclaimed)
+            unclaimed.clear();
+
+        unclaimed.insert(pid, exitCode);
+    }
+}
+
+void WMExitJournal::log(QString message, WMLogger::LogLevel level)
+{
+    WMLogger::instance->log(message, level, "wjrnl");
+}
+
+void WMExitJournal::onFileChanged()
+{
+    WMLagMonitor::HandlerScope handlerScope("WMExitJournal::onFileChanged");
+
+    // Editors and rotations replace the file, which drops it from the watcher
+    if (!watcher->files().contains(fileName) && QFile::exists(fileName))
+        watcher->addPath(fileName);
+
+    readNew();
+}
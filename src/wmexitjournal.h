@@ -0,0 +1,53 @@
+#ifndef WMEXITJOURNAL_H
+#define WMEXITJOURNAL_H
+
+#include <QObject>
+
+#include <QString>
+#include <QHash>
+#include <QFile>
+#include <QFileSystemWatcher>
+
+#include "wmlogger.h"
+#include "wmlagmonitor.h"
+
+class WMProcess;
+
+// Reads the exit journal written by the --supervise shim, so attached
+// instances that die under the shim get their real exit codes, and
+// get them as soon as the line is written instead of on the next poll.
+class WMExitJournal : public QObject
+{
+    Q_OBJECT
+public:
+    explicit WMExitJournal(QString fileName, QObject *parent = 0);
+
+    bool open();
+
+    void watch(int pid, WMProcess *proc);
+    void unwatch(int pid, WMProcess *proc);
+
+    // Exit code journaled for the pid, -1 if there is none yet
+    int take(int pid);
+
+    static WMExitJournal *instance;
+
+private:
+    QString fileName;
+    qint64 offset;
+    QByteArray partial;
+
+    QFileSystemWatcher *watcher;
+    QHash<int, WMProcess *> processes;
+    QHash<int, int> unclaimed;
+
+    static const int maxUnclaimed = 1024;
+
+    void readNew();
+    void log(QString message, WMLogger::LogLevel level = WMLogger::Debug);
+
+private slots:
+    void onFileChanged();
+};
+
+#endif // WMEXITJOURNAL_H
@@ -0,0 +1,315 @@
+#include "wmhistory.h"
+
+WMHistory *WMHistory::instance = 0;
+
+WMHistory::WMHistory(QString runtimeDir, int retentionDays, int flushInterval, QObject *parent) :
+    QObject(parent), runtimeDir(runtimeDir), retentionDays(retentionDays),
+    flushInterval(flushInterval), writer(0)
+{
+    fileName = QString("%1/core/history.db").arg(runtimeDir);
+
+    compactTimer = new QTimer(this);
+    compactTimer->setInterval(compactInterval);
+    connect(compactTimer, SIGNAL(timeout()), this, SLOT(onCompactTimer()));
+}
+
+WMHistory::~WMHistory()
+{
+    close();
+}
+
+bool WMHistory::open()
+{
+    if (!QDir().mkpath(QString("%1/core").arg(runtimeDir)))
+    {
+        log (QString("Could not create history directory in %1").arg(runtimeDir), WMLogger::Error);
+        return false;
+    }
+
+    db = QSqlDatabase::addDatabase("QSQLITE", "wmhistory-reader");
+    db.setDatabaseName(fileName);
+
+    if (!db.open())
+    {
+        log (QString("Could not open history database: %1").arg(db.lastError().text()), WMLogger::Error);
+        return false;
+    }
+
+    QSqlQuery query(db);
+
+    // auto_vacuum only takes effect on a fresh database, before the first table
+    query.exec("PRAGMA auto_vacuum=INCREMENTAL");
+    query.exec("PRAGMA journal_mode=WAL");
+    query.exec("PRAGMA busy_timeout=5000");
+
+    if (!query.exec("CREATE TABLE IF NOT EXISTS events ("
+                    "id INTEGER PRIMARY KEY, "
+                    "ts INTEGER NOT NULL, "
+                    "type TEXT NOT NULL, "
+                    "tag TEXT NOT NULL, "
+                    "event TEXT NOT NULL, "
+                    "exit_code INTEGER, "
+                    "pid INTEGER, "
+                    "uptime INTEGER)") ||
+        !query.exec("CREATE INDEX IF NOT EXISTS events_tag_ts ON events (tag, ts)"))
+    {
+        log (QString("Could not create history table: %1").arg(query.lastError().text()), WMLogger::Error);
+        return false;
+    }
+
+    writer = new WMHistoryWriter(fileName, flushInterval);
+    connect(writer, SIGNAL(failure(QString)), this, SLOT(onWriterFailure(QString)));
+    connect(writer, SIGNAL(compacted(int)), this, SLOT(onWriterCompacted(int)));
+    writer->start(QThread::LowPriority);
+
+    compactTimer->start();
+    onCompactTimer();
+
+    log (QString("History database opened at %1, keeping %2 days").arg(fileName).arg(retentionDays), WMLogger::Info);
+    return true;
+}
+
+void WMHistory::close()
+{
+    compactTimer->stop();
+
+    if (writer != 0)
+    {
+        writer->finish();
+        writer->wait();
+        delete writer;
+        writer = 0;
+    }
+
+    if (db.isOpen())
+    {
+        db.close();
+        db = QSqlDatabase();
+        QSqlDatabase::removeDatabase("wmhistory-reader");
+    }
+}
+
+void WMHistory::record(QString type, QString tag, QString event, int exitCode, int pid, qint64 uptime)
+{
+    if (writer == 0)
+        return;
+
+    WMHistoryEvent item;
+    item.timestamp = QDateTime::currentMSecsSinceEpoch();
+    item.type = type;
+    item.tag = tag;
+    item.event = event;
+    item.exitCode = exitCode;
+    item.pid = pid;
+    item.uptime = uptime;
+
+    writer->enqueue(item);
+}
+
+QVector<WMHistoryEvent> WMHistory::query(QString tag, qint64 since, int limit)
+{
+    QVector<WMHistoryEvent> events;
+
+    QSqlQuery query(db);
+    query.setForwardOnly(true);
+    query.prepare("SELECT ts, type, tag, event, exit_code, pid, uptime FROM events "
+                  "WHERE tag = ? AND ts >= ? ORDER BY ts DESC LIMIT ?");
+    query.addBindValue(tag);
+    query.addBindValue(since);
+    query.addBindValue(limit);
+
+    if (!query.exec())
+    {
+        log (QString("History query failed: %1").arg(query.lastError().text()), WMLogger::Warning);
+        return events;
+    }
+
+    while (query.next())
+    {
+        WMHistoryEvent item;
+        item.timestamp = query.value(0).toLongLong();
+        item.type = query.value(1).toString();
+        item.tag = query.value(2).toString();
+        item.event = query.value(3).toString();
+        item.exitCode = query.value(4).toInt();
+        item.pid = query.value(5).toInt();
+        item.uptime = query.value(6).toLongLong();
+
+        events.append(item);
+    }
+
+    return events;
+}
+
+void WMHistory::log(QString message, WMLogger::LogLevel level)
+{
+    WMLogger::instance->log(message, level, "whist");
+}
+
+void WMHistory::onCompactTimer()
+{
+    if (writer == 0 || retentionDays <= 0)
+        return;
+
+    writer->compact(QDateTime::currentMSecsSinceEpoch() - (qint64)retentionDays * 24 * 3600 * 1000);
+}
+
+void WMHistory::onWriterFailure(QString message)
+{
+    log (message, WMLogger::Warning);
+}
+
+void WMHistory::onWriterCompacted(int removed)
+{
+    log (QString("History compaction removed %1 events older than %2 days").arg(removed).arg(retentionDays),
+         removed > 0 ? WMLogger::Info : WMLogger::Debug);
+}
+
+WMHistoryWriter::WMHistoryWriter(QString fileName, int flushInterval, QObject *parent) :
+    QThread(parent), fileName(fileName), flushInterval(flushInterval),
+    compactBefore(0), finishing(false), failed(false)
+{
+
+}
+
+void WMHistoryWriter::enqueue(const WMHistoryEvent &event)
+{
+    // No wake-up here: the writer picks events up once per flush interval,
+    // so bursts like a mass restart end up in a single transaction
+    mutex.lock();
+    if (!failed)
+        pending.append(event);
+    mutex.unlock();
+}
+
+void WMHistoryWriter::compact(qint64 before)
+{
+    mutex.lock();
+    compactBefore = before;
+    condition.wakeOne();
+    mutex.unlock();
+}
+
+void WMHistoryWriter::finish()
+{
+    mutex.lock();
+    finishing = true;
+    condition.wakeOne();
+    mutex.unlock();
+}
+
+void WMHistoryWriter::run()
+{
+    QString connectionName = "wmhistory-writer";
+
+    {
+        QSqlDatabase db = QSqlDatabase::addDatabase("QSQLITE", connectionName);
+        db.setDatabaseName(fileName);
+
+        if (!db.open())
+        {
+            emit failure(QString("History writer could not open the database: %1").arg(db.lastError().text()));
+
+            mutex.lock();
+            failed = true;
+            pending.clear();
+            mutex.unlock();
+        }
+            else
+        {
+            QSqlQuery query(db);
+            query.exec("PRAGMA busy_timeout=5000");
+            query.exec("PRAGMA synchronous=NORMAL");
+
+            bool done = false;
+
+            while (!done)
+            {
+                QVector<WMHistoryEvent> batch;
+                qint64 before;
+
+                mutex.lock();
+                if (!finishing && compactBefore == 0)
+                    condition.wait(&mutex, flushInterval);
+
+                batch.swap(pending);
+                before = compactBefore;
+                compactBefore = 0;
+                done = finishing;
+                mutex.unlock();
+
+                if (!batch.isEmpty())
+                    write(db, batch);
+
+                if (before > 0)
+                    emit compacted(purge(db, before));
+            }
+
+            db.close();
+        }
+    }
+
+    QSqlDatabase::removeDatabase(connectionName);
+}
+
+void WMHistoryWriter::write(QSqlDatabase &db, const QVector<WMHistoryEvent> &events)
+{
+    db.transaction();
+
+    QSqlQuery query(db);
+    query.prepare("INSERT INTO events (ts, type, tag, event, exit_code, pid, uptime) "
+                  "VALUES (?, ?, ?, ?, ?, ?, ?)");
+
+    for (int i = 0; i < events.count(); i++)
+    {
+        const WMHistoryEvent &event = events.at(i);
+
+        query.addBindValue(event.timestamp);
+        query.addBindValue(event.type);
+        query.addBindValue(event.tag);
+        query.addBindValue(event.event);
+        query.addBindValue(event.exitCode);
+        query.addBindValue(event.pid);
+        query.addBindValue(event.uptime);
+
+        if (!query.exec())
+            emit failure(QString("Could not store a history event: %1").arg(query.lastError().text()));
+    }
+
+    if (!db.commit())
+        emit failure(QString("Could not commit history events: %1").arg(db.lastError().text()));
+}
+
+int WMHistoryWriter::purge(QSqlDatabase &db, qint64 before)
+{
+    QSqlQuery query(db);
+    int total = 0;
+    int removed = 0;
+
+    // Delete in chunks so the write lock is never held for long;
+    // ids grow with time, so the oldest rows are found first
+    do
+    {
+        query.prepare("DELETE FROM events WHERE id IN "
+                      "(SELECT id FROM events WHERE ts < ? ORDER BY id LIMIT 10000)");
+        query.addBindValue(before);
+
+        if (!query.exec())
+        {
+            emit failure(QString("History compaction failed: %1").arg(query.lastError().text()));
+            break;
+        }
+
+        removed = query.numRowsAffected();
+        total += removed;
+    }
+    while (removed > 0);
+
+    if (total > 0)
+    {
+        query.exec("PRAGMA incremental_vacuum");
+        query.exec("PRAGMA wal_checkpoint(TRUNCATE)");
+    }
+
+    return total;
+}
@@ -0,0 +1,106 @@
+#ifndef WMHISTORY_H
+#define WMHISTORY_H
+
+#include <QObject>
+
+#include <QString>
+#include <QStringList>
+#include <QVector>
+#include <QDir>
+#include <QTimer>
+#include <QThread>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QDateTime>
+#include <QVariant>
+#include <QSqlDatabase>
+#include <QSqlQuery>
+#include <QSqlError>
+
+#include "wmlogger.h"
+
+class WMHistoryWriter;
+
+struct WMHistoryEvent
+{
+    qint64 timestamp;  // ms since epoch
+    QString type;
+    QString tag;
+    QString event;
+    int exitCode;
+    int pid;
+    qint64 uptime;     // ms
+};
+
+// Append-only log of instance lifecycle events in runtime_dir/core/history.db.
+// Inserts are batched by a writer thread, queries run on a separate
+// read connection and use the (tag, ts) index.
+class WMHistory : public QObject
+{
+    Q_OBJECT
+public:
+    explicit WMHistory(QString runtimeDir, int retentionDays, int flushInterval = 500, QObject *parent = 0);
+    ~WMHistory();
+
+    bool open();
+    void close();
+
+    void record(QString type, QString tag, QString event, int exitCode, int pid, qint64 uptime);
+    QVector<WMHistoryEvent> query(QString tag, qint64 since, int limit);
+
+    static WMHistory *instance;
+
+private:
+
+    QString runtimeDir;
+    QString fileName;
+    int retentionDays;
+    int flushInterval;
+
+    QSqlDatabase db;
+    WMHistoryWriter *writer;
+    QTimer *compactTimer;
+
+    static const int compactInterval = 3600 * 1000; // ms
+
+    void log(QString message, WMLogger::LogLevel level = WMLogger::Debug);
+
+private slots:
+    void onCompactTimer();
+    void onWriterFailure(QString message);
+    void onWriterCompacted(int removed);
+};
+
+class WMHistoryWriter : public QThread
+{
+    Q_OBJECT
+public:
+    explicit WMHistoryWriter(QString fileName, int flushInterval, QObject *parent = 0);
+
+    void enqueue(const WMHistoryEvent &event);
+    void compact(qint64 before);
+    void finish();
+
+protected:
+    void run();
+
+private:
+    QString fileName;
+    int flushInterval;
+
+    QMutex mutex;
+    QWaitCondition condition;
+    QVector<WMHistoryEvent> pending;
+    qint64 compactBefore;
+    bool finishing;
+    bool failed;
+
+    void write(QSqlDatabase &db, const QVector<WMHistoryEvent> &events);
+    int purge(QSqlDatabase &db, qint64 before);
+
+signals:
+    void failure(QString);
+    void compacted(int);
+};
+
+#endif // WMHISTORY_H
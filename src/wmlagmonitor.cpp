@@ -0,0 +1,190 @@
+#include "wmlagmonitor.h"
+
+WMLagMonitor *WMLagMonitor::instance = 0;
+QAtomicPointer<const char> WMLagMonitor::currentHandler(0);
+
+const int WMLagMonitor::bucketBounds[] = { 1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000 };
+const int WMLagMonitor::bucketCount = sizeof(bucketBounds) / sizeof(bucketBounds[0]) + 1;
+
+WMLagMonitor::HandlerScope::HandlerScope(const char *name)
+{
+    previous = currentHandler.fetchAndStoreRelaxed(name);
+}
+
+WMLagMonitor::HandlerScope::~HandlerScope()
+{
+    currentHandler.store(previous);
+}
+
+WMLagMonitor::WMLagMonitor(int sampleInterval, int stallThreshold, QObject *parent) :
+    QObject(parent), sampleInterval(sampleInterval), stallThreshold(stallThreshold)
+{
+    if (this->stallThreshold <= this->sampleInterval)
+    {
+        log (QString("Stall threshold %1 ms is not above the sample interval, using %2 ms")
+             .arg(stallThreshold).arg(sampleInterval * 2), WMLogger::Warning);
+        this->stallThreshold = sampleInterval * 2;
+    }
+
+    expectedAt = 0;
+    heartbeat.store(0);
+    lastStallDuration = 0;
+
+    sampleTimer = new QTimer(this);
+    sampleTimer->setTimerType(Qt::PreciseTimer);
+    sampleTimer->setInterval(sampleInterval);
+    connect(sampleTimer, SIGNAL(timeout()), this, SLOT(onSampleTimer()));
+
+    watchdog = new WMLagWatchdog(this);
+
+    reset();
+}
+
+WMLagMonitor::~WMLagMonitor()
+{
+    stop();
+}
+
+void WMLagMonitor::start()
+{
+    log (QString("Sampling event loop lag every %1 ms, stalls above %2 ms will be reported")
+         .arg(sampleInterval).arg(stallThreshold), WMLogger::Info);
+
+    clock.start();
+    expectedAt = sampleInterval * 1000;
+    heartbeat.store(0);
+
+    sampleTimer->start();
+    watchdog->start(QThread::LowPriority);
+}
+
+void WMLagMonitor::stop()
+{
+    sampleTimer->stop();
+
+    if (watchdog->isRunning())
+    {
+        watchdog->requestInterruption();
+        watchdog->wait();
+    }
+}
+
+QStringList WMLagMonitor::report()
+{
+    QStringList lines;
+
+                              // samples, avg us, max us, stalls
+    lines.append(QString("SUMMARY %1 %2 %3 %4")
+                 .arg(samples)
+                 .arg(samples > 0 ? lagSum / (qint64)samples : 0)
+                 .arg(lagMax)
+                 .arg(stalls));
+
+    for (int i = 0; i < bucketCount; i++)
+    {
+        QString bound = (i < bucketCount - 1) ? QString::number(bucketBounds[i]) : QString("inf");
+        lines.append(QString("BUCKET %1 %2").arg(bound).arg(buckets.at(i)));
+    }
+
+    if (!lastStallHandler.isEmpty())
+        lines.append(QString("STALL %1 %2").arg(lastStallHandler).arg(lastStallDuration));
+
+    return lines;
+}
+
+void WMLagMonitor::reset()
+{
+    buckets.fill(0, bucketCount);
+    samples = 0;
+    lagSum = 0;
+    lagMax = 0;
+    stalls = 0;
+}
+
+void WMLagMonitor::record(qint64 lag)
+{
+    int i = 0;
+    while (i < bucketCount - 1 && lag >= (qint64)bucketBounds[i] * 1000)
+        i++;
+
+    buckets[i]++;
+    samples++;
+    lagSum += lag;
+
+    if (lag > lagMax)
+        lagMax = lag;
+}
+
+void WMLagMonitor::log(QString message, WMLogger::LogLevel level)
+{
+    WMLogger::instance->log(message, level, "wlagm");
+}
+
+void WMLagMonitor::onSampleTimer()
+{
+    qint64 now = clock.nsecsElapsed() / 1000;
+    qint64 lag = now - expectedAt;
+
+    if (lag < 0)
+        lag = 0;
+
+    record(lag);
+
+    expectedAt = now + sampleInterval * 1000;
+    heartbeat.store(now / 1000);
+
+    if (lag < (qint64)stallThreshold * 1000)
+        return;
+
+    QString handler;
+
+    stallMutex.lock();
+    handler = stallHandler;
+    stallHandler.clear();
+    stallMutex.unlock();
+
+    if (handler.isEmpty())
+        handler = "unknown";
+
+    stalls++;
+    lastStallHandler = handler;
+    lastStallDuration = lag / 1000;
+
+    log (QString("Event loop stalled for %1 ms, running handler: %2").arg(lastStallDuration).arg(handler),
+         WMLogger::Warning);
+}
+
+WMLagWatchdog::WMLagWatchdog(WMLagMonitor *monitor) : QThread(monitor), monitor(monitor)
+{
+
+}
+
+void WMLagWatchdog::run()
+{
+    int checkInterval = qMax(10, monitor->stallThreshold / 4);
+    bool stalled = false;
+
+    while (!isInterruptionRequested())
+    {
+        msleep(checkInterval);
+
+        qint64 overdue = monitor->clock.elapsed() - monitor->heartbeat.load() - monitor->sampleInterval;
+
+        if (overdue <= monitor->stallThreshold)
+        {
+            stalled = false;
+            continue;
+        }
+
+        if (stalled)
+            continue;
+
+        // The loop is stuck right now, so whatever handler is marked is the culprit
+        stalled = true;
+        const char *handler = WMLagMonitor::currentHandler.load();
+
+        monitor->stallMutex.lock();
+        monitor->stallHandler = (handler != 0) ? QString(handler) : QString("event loop");
+        monitor->stallMutex.unlock();
+    }
+}
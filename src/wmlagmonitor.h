@@ -0,0 +1,104 @@
+#ifndef WMLAGMONITOR_H
+#define WMLAGMONITOR_H
+
+#include <QObject>
+
+#include <QString>
+#include <QStringList>
+#include <QVector>
+#include <QTimer>
+#include <QThread>
+#include <QMutex>
+#include <QElapsedTimer>
+#include <QAtomicInteger>
+#include <QAtomicPointer>
+
+#include "wmlogger.h"
+
+class WMLagWatchdog;
+
+// Measures how late the event loop dispatches a periodic timer.
+// Everything in wmcored shares one loop, so this delay is the delay
+// every crash notification and control command suffers too.
+class WMLagMonitor : public QObject
+{
+    Q_OBJECT
+public:
+
+    // Marks the handler currently running on the event loop, so a stall
+    // can be attributed to it. Scopes nest, the innermost one wins.
+    class HandlerScope
+    {
+    public:
+        explicit HandlerScope(const char *name);
+        ~HandlerScope();
+
+    private:
+        const char *previous;
+    };
+
+    explicit WMLagMonitor(int sampleInterval, int stallThreshold, QObject *parent = 0);
+    ~WMLagMonitor();
+
+    void start();
+    void stop();
+
+    QStringList report();
+    void reset();
+
+    static WMLagMonitor *instance;
+    static QAtomicPointer<const char> currentHandler;
+
+private:
+
+    friend class WMLagWatchdog;
+
+    int sampleInterval;  // ms
+    int stallThreshold;  // ms
+
+    QTimer *sampleTimer;
+    WMLagWatchdog *watchdog;
+
+    QElapsedTimer clock;
+    qint64 expectedAt;   // us, clock-relative
+    QAtomicInteger<qint64> heartbeat; // ms, clock-relative
+
+    // Upper bounds of histogram buckets in ms, the last bucket is open-ended
+    static const int bucketBounds[];
+    static const int bucketCount;
+
+    QVector<quint64> buckets;
+    quint64 samples;
+    qint64 lagSum;       // us
+    qint64 lagMax;       // us
+    quint64 stalls;
+
+    // Written by the watchdog thread while the loop is stuck
+    QMutex stallMutex;
+    QString stallHandler;
+    QString lastStallHandler;
+    qint64 lastStallDuration; // ms
+
+    void record(qint64 lag);
+    void log(QString message, WMLogger::LogLevel level = WMLogger::Debug);
+
+private slots:
+    void onSampleTimer();
+};
+
+// Runs off the event loop and notices when the heartbeat stops moving,
+// so the handler that is blocking the loop can be captured while it still runs.
+class WMLagWatchdog : public QThread
+{
+    Q_OBJECT
+public:
+    explicit WMLagWatchdog(WMLagMonitor *monitor);
+
+protected:
+    void run();
+
+private:
+    WMLagMonitor *monitor;
+};
+
+#endif // WMLAGMONITOR_H
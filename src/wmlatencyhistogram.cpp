@@ -0,0 +1,78 @@
+#include "wmlatencyhistogram.h"
+
+WMLatencyHistogram::WMLatencyHistogram() :
+    counts(bucketCount, 0), total(0), maxValue(0)
+{
+
+}
+
+void WMLatencyHistogram::record(qint64 value)
+{
+    if (value < 0)
+        value = 0;
+
+    counts[indexOf(value)]++;
+    total++;
+
+    if (value > maxValue)
+        maxValue = value;
+}
+
+void WMLatencyHistogram::reset()
+{
+    counts.fill(0);
+    total = 0;
+    maxValue = 0;
+}
+
+quint64 WMLatencyHistogram::count() const
+{
+    return total;
+}
+
+qint64 WMLatencyHistogram::max() const
+{
+    return maxValue;
+}
+
+qint64 WMLatencyHistogram::percentile(double p) const
+{
+    if (total == 0)
+        return 0;
+
+    quint64 rank = qMax((quint64)1, (quint64)(p / 100.0 * total + 0.999999));
+    quint64 seen = 0;
+
+    for (int i = 0; i < bucketCount; i++)
+    {
+        seen += counts.at(i);
+
+        if (seen >= rank)
+            return qMin(highestIn(i), maxValue);
+    }
+
+    return maxValue;
+}
+
+// value = m << shift with m in 8..15 lands in bucket shift * 8 + m
+int WMLatencyHistogram::indexOf(quint64 value)
+{
+    if (value < 16)
+        return (int)value;
+
+    int shift = (63 - qCountLeadingZeroBits(value)) - 3;
+    int index = shift * 8 + (int)(value >> shift);
+
+    return qMin(index, bucketCount - 1);
+}
+
+qint64 WMLatencyHistogram::highestIn(int index)
+{
+    if (index < 16)
+        return index;
+
+    int shift = index / 8 - 1;
+    qint64 m = index % 8 + 8;
+
+    return ((m + 1) << shift) - 1;
+}
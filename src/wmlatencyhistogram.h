@@ -0,0 +1,33 @@
+#ifndef WMLATENCYHISTOGRAM_H
+#define WMLATENCYHISTOGRAM_H
+
+#include <QtGlobal>
+#include <QVector>
+
+// HDR-style histogram of microsecond values: exact below 16, then 8 linear
+// sub-buckets per power of two, i.e. within 12.5% up to several weeks.
+// Recording is a bit scan and an increment.
+class WMLatencyHistogram
+{
+public:
+    WMLatencyHistogram();
+
+    void record(qint64 value);
+    void reset();
+
+    quint64 count() const;
+    qint64 max() const;
+    qint64 percentile(double p) const;   // p in 0..100, the bucket's highest value
+
+private:
+    QVector<quint64> counts;
+    quint64 total;
+    qint64 maxValue;
+
+    static int indexOf(quint64 value);
+    static qint64 highestIn(int index);
+
+    static const int bucketCount = 320;
+};
+
+#endif // WMLATENCYHISTOGRAM_H
@@ -0,0 +1,104 @@
+#include "wmlocalcontrolclient.h"
+
+WMLocalControlClient::WMLocalControlClient(QLocalSocket *localSock, QObject *parent) :
+    WMControlClient(0, parent), localSock(localSock), peerUid(-1), peerGid(-1), peerPid(0)
+{
+    connect (localSock, SIGNAL(readyRead()), this, SLOT(onReadyRead()));
+    connect (localSock, SIGNAL(disconnected()), this, SLOT(onSocketDisconnect()));
+}
+
+WMLocalControlClient::~WMLocalControlClient()
+{
+    localSock->deleteLater();
+}
+
+bool WMLocalControlClient::peerAllowed(bool allowGroup)
+{
+#ifdef __linux__
+    struct ucred cred;
+    socklen_t length = sizeof(cred);
+
+    if (getsockopt(localSock->socketDescriptor(), SOL_SOCKET, SO_PEERCRED, &cred, &length) != 0)
+    {
+        log ("Could not read the peer credentials of a local client", WMLogger::Warning);
+        return false;
+    }
+
+    peerUid = cred.uid;
+    peerGid = cred.gid;
+    peerPid = cred.pid;
+
+    log (QString("Local peer: pid %1, uid %2, gid %3").arg(peerPid).arg(peerUid).arg(peerGid));
+
+    return cred.uid == 0 || cred.uid == geteuid() || (allowGroup && cred.gid == getegid());
+#else
+    Q_UNUSED(allowGroup);
+    log ("Peer credentials are not supported on this platform, refusing the local client", WMLogger::Warning);
+    return false;
+#endif
+}
+
+QString WMLocalControlClient::requestTicket()
+{
+    return QString();
+}
+
+QString WMLocalControlClient::address()
+{
+    return QString("local:%1").arg(peerUid);
+}
+
+void WMLocalControlClient::close()
+{
+    localSock->disconnectFromServer();
+}
+
+void WMLocalControlClient::flush()
+{
+    if (localSock->state() == QLocalSocket::ConnectedState)
+        localSock->flush();
+}
+
+void WMLocalControlClient::sendMessage(QString message)
+{
+    sendBinaryMessage(message.toUtf8());
+}
+
+void WMLocalControlClient::sendBinaryMessage(QByteArray payload)
+{
+    if (localSock->state() != QLocalSocket::ConnectedState)
+        return;
+
+    uchar header[4];
+    qToBigEndian<quint32>(payload.size(), header);
+
+    localSock->write((const char *)header, 4);
+    localSock->write(payload);
+}
+
+void WMLocalControlClient::onReadyRead()
+{
+    markReceived();
+    buffer.append(localSock->readAll());
+
+    while (buffer.size() >= 4)
+    {
+        quint32 length = qFromBigEndian<quint32>((const uchar *)buffer.constData());
+
+        if (length > (quint32)maxFrameSize)
+        {
+            log (QString("Local client sent a %1 byte frame, dropping it").arg(length), WMLogger::Warning);
+            buffer.clear();
+            close();
+            return;
+        }
+
+        if ((quint32)buffer.size() < 4 + length)
+            break;
+
+        QString message = QString::fromUtf8(buffer.constData() + 4, length);
+        buffer.remove(0, 4 + length);
+
+        emit newCommandReceived(message);
+    }
+}
@@ -0,0 +1,56 @@
+#ifndef WMLOCALCONTROLCLIENT_H
+#define WMLOCALCONTROLCLIENT_H
+
+#include <QObject>
+#include <QString>
+#include <QByteArray>
+#include <QLocalSocket>
+#include <QtEndian>
+
+#ifdef __linux__
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#include "wmcontrolclient.h"
+
+// Control client on the local Unix socket. Every message in either
+// direction is a 4-byte big-endian length followed by that many bytes
+// of UTF-8 text; the command set is the same as over WebSocket. Peers
+// are authorized by their SO_PEERCRED credentials, so there is no
+// INIT greeting and no AUTH exchange.
+class WMLocalControlClient : public WMControlClient
+{
+    Q_OBJECT
+public:
+    explicit WMLocalControlClient(QLocalSocket *localSock, QObject *parent = 0);
+    ~WMLocalControlClient();
+
+    bool peerAllowed(bool allowGroup);
+
+    QString requestTicket();
+    QString address();
+
+    void close();
+    void flush();
+
+protected:
+    void sendMessage(QString message);
+    void sendBinaryMessage(QByteArray message);
+
+private:
+    QLocalSocket *localSock;
+    QByteArray buffer;
+
+    int peerUid;
+    int peerGid;
+    int peerPid;
+
+    static const int maxFrameSize = 1024 * 1024;
+
+private slots:
+    void onReadyRead();
+};
+
+#endif // WMLOCALCONTROLCLIENT_H
@@ -1,4 +1,5 @@
 #include "wmlogger.h"
+#include "wmlagmonitor.h"
 
 WMLogger *WMLogger::instance = 0;
 
@@ -7,6 +8,8 @@ void WMLogger::log(QString message, WMLogger::LogLevel logLevel, QString compone
     if (logLevel > verbosity)
         return;
 
+    WMLagMonitor::HandlerScope handlerScope("WMLogger::log");
+
     QString logLevelCode;
 
     switch (logLevel)
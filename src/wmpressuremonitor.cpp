@@ -0,0 +1,146 @@
+#include "wmpressuremonitor.h"
+
+WMPressureMonitor::WMPressureMonitor(int stall, int window, QStringList resources, bool cgroup, QObject *parent) :
+    QObject(parent), stall(stall), window(window), resources(resources), cgroup(cgroup)
+{
+
+}
+
+WMPressureMonitor::~WMPressureMonitor()
+{
+    stop();
+}
+
+// Returns the number of triggers registered
+int WMPressureMonitor::start()
+{
+    QString cgroupPath = cgroup ? ownCgroup() : QString();
+
+    for (int i = 0; i < resources.count(); i++)
+    {
+        QString resource = resources.at(i);
+
+        addTrigger("host", resource, QString("/proc/pressure/%1").arg(resource));
+
+        if (!cgroupPath.isEmpty())
+            addTrigger(cgroupPath, resource, QString("/sys/fs/cgroup%1/%2.pressure").arg(cgroupPath).arg(resource));
+    }
+
+    if (triggers.count() > 0)
+        log (QString("Watching %1 PSI triggers, %2 ms of stall in %3 ms").arg(triggers.count()).arg(stall).arg(window),
+             WMLogger::Info);
+    else
+        log ("No PSI triggers could be registered, pressure alerts are off", WMLogger::Warning);
+
+    return triggers.count();
+}
+
+void WMPressureMonitor::stop()
+{
+#ifdef __linux__
+    for (int i = 0; i < triggers.count(); i++)
+    {
+        delete triggers.at(i).notifier;
+        ::close(triggers.at(i).fd);
+    }
+#endif
+
+    triggers.clear();
+}
+
+bool WMPressureMonitor::addTrigger(QString scope, QString resource, QString fileName)
+{
+#ifdef __linux__
+    int fd = ::open(fileName.toLocal8Bit().constData(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+
+    if (fd < 0)
+    {
+        log (QString("Could not open %1: %2").arg(fileName).arg(strerror(errno)));
+        return false;
+    }
+
+    // The trigger lives as long as the fd; unprivileged ones need a window of whole 2 s
+    QByteArray trigger = QString("some %1 %2").arg(stall * 1000).arg(window * 1000).toLatin1();
+
+    if (::write(fd, trigger.constData(), trigger.size() + 1) < 0)
+    {
+        log (QString("Could not set a trigger on %1: %2").arg(fileName).arg(strerror(errno)), WMLogger::Warning);
+        ::close(fd);
+        return false;
+    }
+
+    Trigger item;
+    item.scope = scope;
+    item.resource = resource;
+    item.fd = fd;
+    item.notifier = new QSocketNotifier(fd, QSocketNotifier::Exception, this);
+    connect(item.notifier, SIGNAL(activated(int)), this, SLOT(onTriggerActivated(int)));
+
+    triggers.append(item);
+    return true;
+#else
+    Q_UNUSED(scope);
+    Q_UNUSED(resource);
+    Q_UNUSED(fileName);
+    return false;
+#endif
+}
+
+// "0::/system.slice/wmcored.service" -> "/system.slice/wmcored.service"; empty without cgroup v2
+QString WMPressureMonitor::ownCgroup()
+{
+    QFile file("/proc/self/cgroup");
+
+    if (!file.open(QIODevice::ReadOnly))
+        return QString();
+
+    while (!file.atEnd())
+    {
+        QString line = QString::fromLocal8Bit(file.readLine()).trimmed();
+
+        // The root cgroup's pressure is the host's
+        if (line.startsWith("0::") && line.length() > 4)
+            return line.mid(3);
+    }
+
+    return QString();
+}
+
+void WMPressureMonitor::log(QString message, WMLogger::LogLevel level)
+{
+    WMLogger::instance->log(message, level, "wpres");
+}
+
+void WMPressureMonitor::onTriggerActivated(int fd)
+{
+    WMLagMonitor::HandlerScope handlerScope("WMPressureMonitor::onTriggerActivated");
+
+#ifdef __linux__
+    for (int i = 0; i < triggers.count(); i++)
+    {
+        const Trigger &trigger = triggers.at(i);
+
+        if (trigger.fd != fd)
+            continue;
+
+        // The trigger fd reads like the file itself, the "some" line tells how bad it is
+        char buffer[256];
+        ssize_t length = ::pread(fd, buffer, sizeof(buffer) - 1, 0);
+        QString pressure;
+
+        if (length > 0)
+        {
+            buffer[length] = 0;
+            pressure = QString::fromLatin1(buffer).section('\n', 0, 0).trimmed();
+        }
+
+        log (QString("Pressure stall on %1 %2: %3").arg(trigger.scope).arg(trigger.resource).arg(pressure),
+             WMLogger::Warning);
+
+        emit stalled(trigger.scope, trigger.resource, pressure);
+        return;
+    }
+#else
+    Q_UNUSED(fd);
+#endif
+}
@@ -0,0 +1,66 @@
+#ifndef WMPRESSUREMONITOR_H
+#define WMPRESSUREMONITOR_H
+
+#include <QObject>
+
+#include <QString>
+#include <QStringList>
+#include <QList>
+#include <QFile>
+#include <QFileInfo>
+#include <QSocketNotifier>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#endif
+
+#include "wmlogger.h"
+#include "wmlagmonitor.h"
+
+// Registers kernel PSI triggers ("some <stall> <window>") on the host's
+// /proc/pressure files and, with cgroup v2, on our own cgroup's, where the
+// stations live too. The kernel wakes us with POLLPRI at most once per
+// window, so there is nothing to poll while the host is healthy.
+class WMPressureMonitor : public QObject
+{
+    Q_OBJECT
+public:
+    explicit WMPressureMonitor(int stall, int window, QStringList resources, bool cgroup = true,
+                               QObject *parent = 0);
+    ~WMPressureMonitor();
+
+    int start();
+    void stop();
+
+private:
+
+    struct Trigger
+    {
+        QString scope;       // "host" or the cgroup path
+        QString resource;    // cpu, io, memory
+        int fd;
+        QSocketNotifier *notifier;
+    };
+
+    int stall;               // ms
+    int window;              // ms
+    QStringList resources;
+    bool cgroup;
+    QList<Trigger> triggers;
+
+    bool addTrigger(QString scope, QString resource, QString fileName);
+    QString ownCgroup();
+
+    void log(QString message, WMLogger::LogLevel level = WMLogger::Debug);
+
+signals:
+    void stalled(QString scope, QString resource, QString pressure);
+
+private slots:
+    void onTriggerActivated(int fd);
+};
+
+#endif // WMPRESSUREMONITOR_H
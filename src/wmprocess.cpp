@@ -1,17 +1,34 @@
 #include "wmprocess.h"
 
+bool WMProcess::pidFilesEnabled = true;
+WMProcess::SpawnBackend WMProcess::spawnBackend = WMProcess::QProcessBackend;
+
 WMProcess::WMProcess(QString appPath, QString runtimeDir,
                      QString processTag, ProcessType processType,
                      QStringList args, QString workingDir, QObject *parent) :
 
                      QObject(parent), appPath(appPath), runtimeDir(runtimeDir),
-                     processTag(processTag), processType(processType), args(args)
+                     processTag(processTag), processType(processType), args(args), workingDir(workingDir)
 {
     pidFilePath = QString("%1/pid/%2_%3.pid").arg(runtimeDir).arg(typeToString(processType)).arg(processTag);
 
     isRunning = false;
     iNeedToRespawn = false;
     isStopRequested = false;
+    isPaused = false;
+    processStartTime = 0;
+    processStartTicks = 0;
+
+    stopGracePeriod = 0;
+    killTimerId = 0;
+
+    process = NULL;
+
+#ifdef __linux__
+    processPollInterval = 500; // ms; maybe set it by setter?
+    journalMisses = 0;
+    watchTimerId = 0;
+#endif
 
     processId = readPid();
 
@@ -22,6 +39,17 @@ WMProcess::WMProcess(QString appPath, QString runtimeDir,
         return;
     }
 
+    if (processId > 0 && isProcessRunning(processId) && !verifyIdentity(processId))
+    {
+        log (QString("PID %1 of %2/%3 now belongs to another process, not attaching to it")
+             .arg(processId).arg(typeToString(processType)).arg(processTag), WMLogger::Warning);
+
+        clearPid();
+        processId = 0;
+        processStartTime = 0;
+        processStartTicks = 0;
+    }
+
     if (processId != 0 && isProcessRunning(processId))
     {
         log (QString("Process of %1/%2 is already running and has PID %3; just attaching to it")
@@ -29,13 +57,12 @@ WMProcess::WMProcess(QString appPath, QString runtimeDir,
 
         isAttached = true;
 
-#ifdef __linux__
-        processPollInterval = 500; // ms; maybe set it by setter?
-
-        processWatchTimer = new QTimer();
-        connect(processWatchTimer, SIGNAL(timeout()), this, SLOT(onProcessTimerCheck()));
-        processWatchTimer->setInterval(processPollInterval);
-#endif
+        // Recorded before start ticks were, or migrated from a pidfile
+        if (processStartTicks == 0)
+        {
+            readStartTicks();
+            writePid(processId);
+        }
     }
         else
     {
@@ -43,11 +70,27 @@ WMProcess::WMProcess(QString appPath, QString runtimeDir,
              .arg(typeToString(processType)).arg(processTag));
         isAttached = false;
 
+        // Children write to their own log files instead of pipes held by us,
+        // so they survive wmcored re-executing itself and never block on a full pipe
+        QString outputDir = QString("%1/log").arg(runtimeDir);
+        outputPath = QString("%1/%2_%3.log").arg(outputDir).arg(typeToString(processType)).arg(processTag);
+        QDir().mkpath(outputDir);
+
+        if (spawnBackend == PosixSpawnBackend)
+        {
+            log (QString("Created a new instance of a process handler, process image %1").arg(appPath), WMLogger::Info);
+            return;
+        }
+
         process = new QProcess(this);
         process->setProgram(appPath);
         process->setArguments(args);
         process->setWorkingDirectory(workingDir);
 
+        process->setStandardInputFile(QProcess::nullDevice());
+        process->setStandardOutputFile(outputPath, QIODevice::Append);
+        process->setStandardErrorFile(outputPath, QIODevice::Append);
+
         connect(process, SIGNAL(started()), this, SLOT(onProcessStart()));
         connect(process, SIGNAL(finished(int)), this, SLOT(onProcessFinish(int)));
         connect(process, SIGNAL(errorOccurred(QProcess::ProcessError)), this,
@@ -57,6 +100,18 @@ WMProcess::WMProcess(QString appPath, QString runtimeDir,
     log (QString("Created a new instance of a process handler, process image %1").arg(appPath), WMLogger::Info);
 }
 
+WMProcess::~WMProcess()
+{
+    WMTimerWheel::instance->cancel(killTimerId);
+    stopWatch();
+
+    if (WMReaper::instance != NULL)
+        WMReaper::instance->unwatch(processId, this);
+
+    if (WMExitJournal::instance != NULL)
+        WMExitJournal::instance->unwatch(processId, this);
+}
+
 void WMProcess::stop(bool forced)
 {
     if (!isRunning)
@@ -65,11 +120,15 @@ void WMProcess::stop(bool forced)
         return;
     }
 
+    if (!isStopRequested)
+        WMTracer::instance->begin("stop", "stop", WMTracer::spanId(processTag, typeAsString()),
+                                  processTag, typeAsString());
+
     isStopRequested = true;
 
-    if (isAttached)
+    if (isAttached || process == NULL)
     {
-        log ("We're working with an attached process, we use syscalls to stop it");
+        log ("We're working with an attached or spawned process, we use syscalls to stop it");
 
 #ifdef __linux__
         int signal = (forced) ? SIGKILL : SIGTERM;
@@ -100,6 +159,87 @@ void WMProcess::stop(bool forced)
             process->terminate();
         }
     }
+
+    // A paused process only sees the signal once it runs again
+    if (isPaused)
+        resume();
+
+    if (!forced && stopGracePeriod > 0 && killTimerId == 0)
+        killTimerId = WMTimerWheel::instance->schedule(stopGracePeriod, this, "onKillTimer");
+}
+
+void WMProcess::setStopGracePeriod(int msec)
+{
+    stopGracePeriod = msec;
+}
+
+void WMProcess::onChildExited(int exitCode)
+{
+    if (!isRunning)
+        return;
+
+    stopWatch();
+    onProcessFinish(exitCode);
+}
+
+bool WMProcess::pause()
+{
+    if (!isRunning || isPaused)
+        return false;
+
+#ifdef __linux__
+    if (kill(processId, SIGSTOP) != 0)
+    {
+        log (QString("Could not pause process %1").arg(processId), WMLogger::Warning);
+        return false;
+    }
+
+    log (QString("Process %1 is paused").arg(processId));
+    isPaused = true;
+    return true;
+#else
+    log ("Pausing processes is not supported on this OS", WMLogger::Warning);
+    return false;
+#endif
+}
+
+bool WMProcess::resume()
+{
+    if (!isRunning || !isPaused)
+        return false;
+
+#ifdef __linux__
+    if (kill(processId, SIGCONT) != 0)
+    {
+        log (QString("Could not resume process %1").arg(processId), WMLogger::Warning);
+        return false;
+    }
+
+    log (QString("Process %1 is resumed").arg(processId));
+    isPaused = false;
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool WMProcess::paused()
+{
+    return isPaused;
+}
+
+// Moves the process under another tag, along with its stored state
+void WMProcess::rename(QString newTag)
+{
+    log (QString("Process %1 of %2 is now known as %3").arg(processId).arg(processTag).arg(newTag));
+
+    clearPid();
+
+    processTag = newTag;
+    pidFilePath = QString("%1/pid/%2_%3.pid").arg(runtimeDir).arg(typeToString(processType)).arg(processTag);
+
+    if (isRunning)
+        writePid(processId);
 }
 
 void WMProcess::setNeedsRespawn(bool need)
@@ -122,11 +262,21 @@ int WMProcess::pid()
     return processId;
 }
 
+qint64 WMProcess::startTime()
+{
+    return processStartTime;
+}
+
 QString WMProcess::tag()
 {
     return processTag;
 }
 
+QStringList WMProcess::arguments()
+{
+    return args;
+}
+
 QString WMProcess::typeAsString()
 {
     return typeToString(processType);
@@ -184,6 +334,77 @@ bool WMProcess::isProcessRunning(int pid)
 #endif
 }
 
+// Converts a raw wait status into the exit code we report,
+// a child killed by a signal gets the shell-like 128 + signal
+int WMProcess::exitCodeFromStatus(int status)
+{
+#ifdef __linux__
+    if (WIFEXITED(status))
+        return WEXITSTATUS(status);
+
+    if (WIFSIGNALED(status))
+        return 128 + WTERMSIG(status);
+#endif
+
+    return status;
+}
+
+// Resident set size in kB, -1 if unknown
+qint64 WMProcess::residentMemory(int pid)
+{
+    QFile file(QString("/proc/%1/status").arg(pid));
+
+    if (!file.open(QIODevice::ReadOnly))
+        return -1;
+
+    QList<QByteArray> lines = file.readAll().split('\n');
+    file.close();
+
+    for (int i = 0; i < lines.count(); i++)
+    {
+        if (lines.at(i).startsWith("VmRSS:"))
+            return lines.at(i).mid(6).trimmed().split(' ').value(0).toLongLong();
+    }
+
+    return -1;
+}
+
+// User + system CPU time in ms, -1 if unknown
+qint64 WMProcess::cpuTime(int pid)
+{
+#ifdef __linux__
+    QFile file(QString("/proc/%1/stat").arg(pid));
+
+    if (!file.open(QIODevice::ReadOnly))
+        return -1;
+
+    QByteArray data = file.readAll();
+    file.close();
+
+    // comm may contain spaces, so count fields from the closing parenthesis
+    QList<QByteArray> fields = data.mid(data.lastIndexOf(')') + 2).split(' ');
+
+    if (fields.count() < 13)
+        return -1;
+
+    qint64 ticks = fields.at(11).toLongLong() + fields.at(12).toLongLong();
+    return ticks * 1000 / sysconf(_SC_CLK_TCK);
+#else
+    Q_UNUSED(pid);
+    return -1;
+#endif
+}
+
+void WMProcess::setPidFilesEnabled(bool enabled)
+{
+    pidFilesEnabled = enabled;
+}
+
+void WMProcess::setSpawnBackend(SpawnBackend backend)
+{
+    spawnBackend = backend;
+}
+
 #ifdef _WIN32
 void WMProcess::winOnProcessExit(PVOID lpParameter, BOOLEAN TimerOrWaitFired)
 {
@@ -208,6 +429,20 @@ void WMProcess::winOnProcessExit(PVOID lpParameter, BOOLEAN TimerOrWaitFired)
 
 int WMProcess::readPid()
 {
+    if (WMStateStore::instance != NULL)
+    {
+        WMInstanceState state = WMStateStore::instance->state(processTag, typeAsString());
+
+        // Without a stored PID, fall through to the pidfile to migrate old installs;
+        // pidfiles=false only stops us from writing them
+        if (state.pid != 0)
+        {
+            processStartTime = state.startTime;
+            processStartTicks = state.startTicks;
+            return state.pid;
+        }
+    }
+
     QFile file(pidFilePath);
 
     if (!file.exists())
@@ -219,7 +454,7 @@ int WMProcess::readPid()
     if (!file.open(QIODevice::ReadOnly))
     {
         log (QString("Could not open the file %1; error %2").arg(file.fileName()).arg(file.errorString()), WMLogger::Warning);
-        return -1;
+        return pidFilesEnabled ? -1 : 0;
     }
 
     QString data = file.readAll();
@@ -233,12 +468,28 @@ int WMProcess::readPid()
         log (QString("Pidfile %1 contains wrong data: %2").arg(file.fileName()).arg(data), WMLogger::Warning);
         return 0; // -1?
     }
-        else
-        return pidToReturn;
+
+    // Migrated: the state store holds it from now on, the pidfile would only go stale
+    if (WMStateStore::instance != NULL && !pidFilesEnabled)
+    {
+        log (QString("Migrating PID %1 from the pidfile %2 to the state store").arg(pidToReturn).arg(file.fileName()),
+             WMLogger::Info);
+
+        WMStateStore::instance->setPid(processTag, typeAsString(), pidToReturn, 0, 0);
+        file.remove();
+    }
+
+    return pidToReturn;
 }
 
 bool WMProcess::writePid(int pid)
 {
+    if (WMStateStore::instance != NULL)
+        WMStateStore::instance->setPid(processTag, typeAsString(), pid, processStartTime, processStartTicks);
+
+    if (!pidFilesEnabled)
+        return true;
+
     QFile file(pidFilePath);
 
     if (!file.open(QIODevice::WriteOnly))
@@ -255,6 +506,66 @@ bool WMProcess::writePid(int pid)
 
 }
 
+// A stored PID is only ours if the process behind it is the same program with
+// the same arguments, started at the very clock tick we recorded; stale
+// pidfiles after a reboot point at unrelated processes all the time
+bool WMProcess::verifyIdentity(int pid)
+{
+#ifdef __linux__
+    WMProcInfo info;
+    bool found = (WMProcScan::instance != NULL) ? WMProcScan::instance->lookup(pid, info)
+                                                : WMProcScan::readProcess(pid, info);
+
+    if (!found)
+        return false;
+
+    QString expectedExe = QFileInfo(appPath).canonicalFilePath();
+
+    // exe is unreadable for processes of other users, the other checks still apply
+    if (!info.exe.isEmpty() && !expectedExe.isEmpty() && info.exe != expectedExe)
+    {
+        log (QString("PID %1 runs %2, expected %3").arg(pid).arg(info.exe).arg(expectedExe));
+        return false;
+    }
+
+    if (info.cmdline.mid(1) != args)
+    {
+        log (QString("PID %1 has arguments \"%2\", expected \"%3\"")
+             .arg(pid).arg(info.cmdline.mid(1).join(" ")).arg(args.join(" ")));
+        return false;
+    }
+
+    // Ticks since boot, unlike wall clock times, move with neither lag nor clock steps
+    if (processStartTicks > 0 && info.startTicks != processStartTicks)
+    {
+        log (QString("PID %1 started at tick %2, expected %3").arg(pid).arg(info.startTicks).arg(processStartTicks));
+        return false;
+    }
+
+    return true;
+#else
+    Q_UNUSED(pid);
+    return true;
+#endif
+}
+
+void WMProcess::readStartTicks()
+{
+#ifdef __linux__
+    WMProcInfo info;
+    processStartTicks = WMProcScan::readProcess(processId, info) ? info.startTicks : 0;
+#endif
+}
+
+void WMProcess::clearPid()
+{
+    if (WMStateStore::instance != NULL)
+        WMStateStore::instance->setPid(processTag, typeAsString(), 0, 0, 0);
+
+    if (pidFilesEnabled)
+        QFile::remove(pidFilePath);
+}
+
 void WMProcess::start()
 {
     if (isRunning)
@@ -269,7 +580,15 @@ void WMProcess::start()
 
 #ifdef __linux__
         log("Since Linux does not provide us the way to monitor the non-child process existence, we'll poll it with a timer");
-        processWatchTimer->start();
+        startWatch();
+
+        // It may still be our child after a re-exec, then the reaper gets to it first
+        if (WMReaper::instance != NULL)
+            WMReaper::instance->watch(processId, this);
+
+        // Or an orphan adopted by the --supervise shim, which journals its exit
+        if (WMExitJournal::instance != NULL)
+            WMExitJournal::instance->watch(processId, this);
 #elif _WIN32
         log("Attaching to the process using Windows API");
         processHandle = OpenProcess(PROCESS_ALL_ACCESS | PROCESS_TERMINATE | PROCESS_QUERY_LIMITED_INFORMATION, FALSE, processId);
@@ -283,10 +602,79 @@ void WMProcess::start()
         else
     {
         log ("Creating a new process...");
+
+        if (process == NULL)
+        {
+            spawn();
+            return;
+        }
+
+        WMTracer::Span span("QProcess::start", "spawn", processTag, typeAsString());
         process->start();
     }
 }
 
+void WMProcess::spawn()
+{
+#ifdef __linux__
+    QString error;
+    int pid;
+
+    {
+        WMTracer::Span span("posix_spawn", "spawn", processTag, typeAsString());
+        pid = WMSpawner::spawn(appPath, args, workingDir, outputPath, &error);
+    }
+
+    if (pid < 0)
+    {
+        log (QString("Cannot spawn process: %1").arg(error), WMLogger::Warning);
+        WMTracer::instance->end("spawn", "spawn", WMTracer::spanId(processTag, typeAsString()),
+                                processTag, typeAsString(), "failed");
+        onProcessFinish(RC_CANNOTSTART);
+        return;
+    }
+
+    processId = pid;
+    processStartTime = QDateTime::currentMSecsSinceEpoch();
+    readStartTicks();
+
+    if (!writePid(processId))
+    {
+        log(QString("Could not write pidfile!"), WMLogger::Error);
+        return;
+    }
+
+    log (QString("Process spawning succeeded, PID is %1").arg(processId));
+
+    // Our own child, so either the reaper or the watch timer gets its real exit code
+    if (WMReaper::instance != NULL)
+        WMReaper::instance->watch(processId, this);
+    else
+        startWatch();
+
+    onProcessStart();
+#else
+    log ("posix_spawn backend is not supported on this OS", WMLogger::Warning);
+    onProcessFinish(RC_CANNOTSTART);
+#endif
+}
+
+void WMProcess::startWatch()
+{
+#ifdef __linux__
+    if (watchTimerId == 0)
+        watchTimerId = WMTimerWheel::instance->schedule(processPollInterval, this, "onProcessTimerCheck");
+#endif
+}
+
+void WMProcess::stopWatch()
+{
+#ifdef __linux__
+    WMTimerWheel::instance->cancel(watchTimerId);
+    watchTimerId = 0;
+#endif
+}
+
 void WMProcess::log(QString message, WMLogger::LogLevel level)
 {
     WMLogger::instance->log(message, level, "wproc");
@@ -294,9 +682,11 @@ void WMProcess::log(QString message, WMLogger::LogLevel level)
 
 void WMProcess::onProcessStart()
 {
-    if (!isAttached)
+    if (!isAttached && process != NULL)
     {
         processId = process->processId();
+        processStartTime = QDateTime::currentMSecsSinceEpoch();
+        readStartTicks();
 
         if (!writePid(processId))
         {
@@ -308,6 +698,10 @@ void WMProcess::onProcessStart()
     }
 
     isRunning = true;
+
+    WMTracer::instance->end("spawn", "spawn", WMTracer::spanId(processTag, typeAsString()),
+                            processTag, typeAsString(), QString::number(processId));
+
     emit processStarted();
 }
 
@@ -320,9 +714,25 @@ void WMProcess::onProcessFinish(int exitCode)
     }
 
     isRunning = false;
+    WMTimerWheel::instance->cancel(killTimerId);
+    killTimerId = 0;
+    stopWatch();
+    clearPid();
+
+    if (WMReaper::instance != NULL)
+        WMReaper::instance->unwatch(processId, this);
+
+    if (WMExitJournal::instance != NULL)
+        WMExitJournal::instance->unwatch(processId, this);
 
     if (isStopRequested)
+    {
         exitCode = RC_KILLEDBYCONTROL;
+        WMTracer::instance->end("stop", "stop", WMTracer::spanId(processTag, typeAsString()),
+                                processTag, typeAsString());
+    }
+        else
+        WMTracer::instance->instant("exit", "process", processTag, typeAsString(), QString::number(exitCode));
 
     switch (exitCode)
     {
@@ -353,24 +763,77 @@ void WMProcess::onProcessFault(QProcess::ProcessError error)
     log (QString("Cannot start process, error code %1").arg(error));
 
     if (error == QProcess::FailedToStart)
+    {
+        WMTracer::instance->end("spawn", "spawn", WMTracer::spanId(processTag, typeAsString()),
+                                processTag, typeAsString(), "failed");
         emit onProcessFinish(RC_CANNOTSTART);
+    }
+}
+
+void WMProcess::onKillTimer()
+{
+    killTimerId = 0;
+
+    if (!isRunning)
+        return;
+
+    log (QString("Process %1 is still alive %2 ms after being asked to stop, killing it")
+         .arg(processId).arg(stopGracePeriod), WMLogger::Warning);
+
+    stop(true);
 }
 
 #ifdef __linux__
 void WMProcess::onProcessTimerCheck()
 {
+    WMLagMonitor::HandlerScope handlerScope("WMProcess::onProcessTimerCheck");
+
+    // The wheel fires once; the next check is booked up front and
+    // cancelled again by onProcessFinish() if this one finds it dead
+    watchTimerId = 0;
+
     if (isRunning)
     {
+        startWatch();
+
+        // An attached process may still be our own child, e.g. after wmcored
+        // has re-executed itself; then we can reap it and get its real exit code
+        int status;
+        pid_t result = waitpid(processId, &status, WNOHANG);
+
+        if (result == processId)
+        {
+            log (QString("Child %1 reaped by the timer, wait status %2").arg(processId).arg(status));
+            onProcessFinish(exitCodeFromStatus(status));
+            return;
+        }
+
+        if (result == 0)
+            return;
+
         if (!isProcessRunning(processId))
         {
+            if (WMExitJournal::instance != NULL)
+            {
+                int exitCode = WMExitJournal::instance->take(processId);
+
+                if (exitCode >= 0)
+                {
+                    log (QString("Process death detected by the timer, the supervisor journaled exit code %1").arg(exitCode));
+                    onProcessFinish(exitCode);
+                    return;
+                }
+
+                // The shim reaps first and writes right after, give it a couple of ticks
+                if (++journalMisses < 3)
+                    return;
+            }
+
             log ("Process death detected by the timer. Since we can't get its exit code, we'll set it always to 0");
             onProcessFinish(0);
         }
     }
         else
-    {
         log ("Stopping process watch timer");
-        processWatchTimer->stop();
-    }
 }
 #endif
@@ -9,10 +9,15 @@
 #include <QFile>
 #include <QTextStream>
 #include <QTimer>
+#include <QDateTime>
+#include <QDir>
+#include <QFile>
 
 #ifdef __linux__
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <signal.h>
+#include <unistd.h>
 #elif _WIN32
 #include <windows.h>
 #include <tlhelp32.h>
@@ -21,6 +26,14 @@
 #endif
 
 #include "wmlogger.h"
+#include "wmlagmonitor.h"
+#include "wmtracer.h"
+#include "wmstatestore.h"
+#include "wmspawner.h"
+#include "wmreaper.h"
+#include "wmexitjournal.h"
+#include "wmprocscan.h"
+#include "wmtimerwheel.h"
 
 class WMProcess : public QObject
 {
@@ -33,26 +46,51 @@ public:
         Icecast
     };
 
+    enum SpawnBackend {
+        QProcessBackend,
+        PosixSpawnBackend
+    };
+
     explicit WMProcess(QString appPath, QString runtimeDir,
                        QString processTag, ProcessType processType,
                        QStringList args, QString workingDir = QString(),
                        QObject *parent = 0);
+    ~WMProcess();
 
     void start();
     void stop(bool forced = false);
 
+    // Holding a process with SIGSTOP keeps it warm without letting it run
+    bool pause();
+    bool resume();
+    bool paused();
+
+    void rename(QString newTag);
+
+    void setStopGracePeriod(int msec);
+
+    // Called by WMReaper once it has reaped our child
+    void onChildExited(int exitCode);
+
     void setNeedsRespawn(bool need);
     bool isNeedToRespawn();
 
     bool attached();
 
     int pid();
+    qint64 startTime();
     QString tag();
+    QStringList arguments();
     QString typeAsString();
     ProcessType type();
 
     static QString typeToString(ProcessType type);
     static bool isProcessRunning(int pid);
+    static int exitCodeFromStatus(int status);
+    static qint64 residentMemory(int pid);
+    static qint64 cpuTime(int pid);
+    static void setPidFilesEnabled(bool enabled);
+    static void setSpawnBackend(SpawnBackend backend);
 
     static const int RC_KILLEDBYCONTROL = 0xf291;  // this is Qt's internal return code
     static const int RC_CANNOTSTART =   0xfa113d;
@@ -63,17 +101,30 @@ private:
     bool iNeedToRespawn;
     bool isAttached;
     bool isStopRequested;
+    bool isPaused;
 
     QString appPath;
     QString runtimeDir;
     QString processTag;
     ProcessType processType;
     QStringList args;
+    QString workingDir;
+    QString outputPath;
     QString pidFilePath;
 
     QProcess *process;
     int processId;
 
+    // A graceful stop is escalated to a forced one after this many ms
+    int stopGracePeriod;
+    WMTimerWheel::TimerId killTimerId;
+    qint64 processStartTime;
+    qint64 processStartTicks;    // as the kernel has it, compared exactly by verifyIdentity()
+
+    // Pidfiles are only a compatibility output when the state store is in use
+    static bool pidFilesEnabled;
+    static SpawnBackend spawnBackend;
+
 // Windows-specific vars to receive callbacks when process we attached to is dead
 #ifdef _WIN32
     HANDLE processHandle;
@@ -84,19 +135,27 @@ private:
 
 // Linux-specific process management
 #ifdef __linux__
-    QTimer *processWatchTimer;
+    WMTimerWheel::TimerId watchTimerId;
     int processPollInterval;
+    int journalMisses;
 #endif
 
     int readPid();
     bool writePid(int pid);
+    bool verifyIdentity(int pid);
+    void readStartTicks();
+    void clearPid();
 
+    void spawn();
+    void startWatch();
+    void stopWatch();
     void log (QString message, WMLogger::LogLevel level = WMLogger::Debug);
 
 private slots:
     void onProcessStart();
     void onProcessFinish(int exitCode);
     void onProcessFault(QProcess::ProcessError error);
+    void onKillTimer();
 
 #ifdef __linux__
     void onProcessTimerCheck();
@@ -0,0 +1,139 @@
+#include "wmprocscan.h"
+
+WMProcScan *WMProcScan::instance = 0;
+
+WMProcScan::WMProcScan()
+{
+
+}
+
+int WMProcScan::scan()
+{
+    QElapsedTimer timer;
+    timer.start();
+
+    processes.clear();
+
+    qint64 boot = bootTime();
+    QStringList entries = QDir("/proc").entryList(QDir::Dirs | QDir::NoDotAndDotDot);
+
+    for (int i = 0; i < entries.count(); i++)
+    {
+        bool isPid = false;
+        int pid = entries.at(i).toInt(&isPid);
+
+        if (!isPid)
+            continue;
+
+        WMProcInfo info;
+        if (readStat(pid, info, boot))
+            processes.insert(pid, info);
+    }
+
+    log (QString("Scanned %1 processes in /proc in %2 ms").arg(processes.count()).arg(timer.elapsed()));
+    return processes.count();
+}
+
+bool WMProcScan::lookup(int pid, WMProcInfo &info)
+{
+    if (!processes.contains(pid))
+        return false;
+
+    WMProcInfo &entry = processes[pid];
+
+    if (!entry.detailsLoaded)
+        readDetails(entry);
+
+    info = entry;
+    return true;
+}
+
+bool WMProcScan::readProcess(int pid, WMProcInfo &info)
+{
+    if (!readStat(pid, info, bootTime()))
+        return false;
+
+    readDetails(info);
+    return true;
+}
+
+qint64 WMProcScan::bootTime()
+{
+    QFile file("/proc/stat");
+
+    if (!file.open(QIODevice::ReadOnly))
+        return 0;
+
+    QList<QByteArray> lines = file.readAll().split('\n');
+    file.close();
+
+    for (int i = 0; i < lines.count(); i++)
+    {
+        if (lines.at(i).startsWith("btime "))
+            return lines.at(i).mid(6).trimmed().toLongLong() * 1000;
+    }
+
+    return 0;
+}
+
+bool WMProcScan::readStat(int pid, WMProcInfo &info, qint64 bootTime)
+{
+#ifdef __linux__
+    QFile file(QString("/proc/%1/stat").arg(pid));
+
+    if (!file.open(QIODevice::ReadOnly))
+        return false;
+
+    QByteArray data = file.readAll();
+    file.close();
+
+    // comm may contain spaces, so count fields from the closing parenthesis;
+    // field 3 (state) is the first one after it, field 22 is starttime
+    QList<QByteArray> fields = data.mid(data.lastIndexOf(')') + 2).split(' ');
+
+    if (fields.count() < 20)
+        return false;
+
+    info.pid = pid;
+    info.startTicks = fields.at(19).toLongLong();
+    info.startTime = bootTime + info.startTicks * 1000 / sysconf(_SC_CLK_TCK);
+    info.detailsLoaded = false;
+    return true;
+#else
+    Q_UNUSED(pid);
+    Q_UNUSED(info);
+    Q_UNUSED(bootTime);
+    return false;
+#endif
+}
+
+void WMProcScan::readDetails(WMProcInfo &info)
+{
+    info.exe = QFileInfo(QString("/proc/%1/exe").arg(info.pid)).symLinkTarget();
+
+    // A binary replaced by a package upgrade still runs from the old inode
+    if (info.exe.endsWith(" (deleted)"))
+        info.exe.chop(10);
+
+    QFile file(QString("/proc/%1/cmdline").arg(info.pid));
+
+    if (file.open(QIODevice::ReadOnly))
+    {
+        QList<QByteArray> args = file.readAll().split('\0');
+        file.close();
+
+        if (!args.isEmpty() && args.last().isEmpty())
+            args.removeLast();
+
+        info.cmdline.clear();
+        for (int i = 0; i < args.count(); i++)
+            info.cmdline.append(QString::fromLocal8Bit(args.at(i)));
+    }
+
+    info.detailsLoaded = true;
+}
+
+void WMProcScan::log(QString message, WMLogger::LogLevel level)
+{
+    WMLogger::instance->log(message, level, "wscan");
+}
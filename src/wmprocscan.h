@@ -0,0 +1,55 @@
+#ifndef WMPROCSCAN_H
+#define WMPROCSCAN_H
+
+#include <QString>
+#include <QStringList>
+#include <QByteArray>
+#include <QList>
+#include <QHash>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QElapsedTimer>
+
+#ifdef __linux__
+#include <unistd.h>
+#endif
+
+#include "wmlogger.h"
+
+struct WMProcInfo
+{
+    int pid;
+    qint64 startTicks;   // /proc/<pid>/stat field 22, clock ticks since boot
+    qint64 startTime;    // the same as ms since epoch
+    QString exe;         // empty if we may not read it
+    QStringList cmdline;
+    bool detailsLoaded;
+};
+
+// One pass over /proc at startup, so reattaching thousands of instances
+// doesn't probe every PID separately. Start times are read for every
+// process; exe and cmdline only for the PIDs that are actually looked up.
+class WMProcScan
+{
+public:
+    WMProcScan();
+
+    int scan();
+    bool lookup(int pid, WMProcInfo &info);
+
+    static bool readProcess(int pid, WMProcInfo &info);
+
+    static WMProcScan *instance;
+
+private:
+    QHash<int, WMProcInfo> processes;
+
+    static qint64 bootTime();
+    static bool readStat(int pid, WMProcInfo &info, qint64 bootTime);
+    static void readDetails(WMProcInfo &info);
+
+    static void log(QString message, WMLogger::LogLevel level = WMLogger::Debug);
+};
+
+#endif // WMPROCSCAN_H
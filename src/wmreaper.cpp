@@ -0,0 +1,127 @@
+#include "wmreaper.h"
+#include "wmprocess.h"
+
+WMReaper *WMReaper::instance = 0;
+
+WMReaper::WMReaper(QObject *parent) : QObject(parent), signalFd(-1), notifier(0)
+{
+
+}
+
+WMReaper::~WMReaper()
+{
+#ifdef __linux__
+    if (signalFd >= 0)
+        ::close(signalFd);
+#endif
+}
+
+bool WMReaper::start()
+{
+#ifdef __linux__
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+
+    // Threads created from now on inherit the mask, so SIGCHLD only ever shows up on the fd
+    if (pthread_sigmask(SIG_BLOCK, &mask, 0) != 0)
+    {
+        log ("Could not block SIGCHLD", WMLogger::Error);
+        return false;
+    }
+
+    signalFd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+
+    if (signalFd < 0)
+    {
+        log (QString("Could not create the SIGCHLD signalfd: %1").arg(strerror(errno)), WMLogger::Error);
+        pthread_sigmask(SIG_UNBLOCK, &mask, 0);
+        return false;
+    }
+
+    notifier = new QSocketNotifier(signalFd, QSocketNotifier::Read, this);
+    connect(notifier, SIGNAL(activated(int)), this, SLOT(onSignalFdActivated()));
+
+    log ("Children are reaped through signalfd", WMLogger::Info);
+
+    // Anything that died before we were listening
+    reap();
+    return true;
+#else
+    log ("The signalfd reaper is not supported on this OS", WMLogger::Warning);
+    return false;
+#endif
+}
+
+void WMReaper::watch(int pid, WMProcess *proc)
+{
+    children.insert(pid, proc);
+}
+
+void WMReaper::unwatch(int pid, WMProcess *proc)
+{
+    if (children.value(pid) == proc)
+        children.remove(pid);
+}
+
+void WMReaper::claim(int pid)
+{
+    claimed.insert(pid);
+}
+
+int WMReaper::watchedCount()
+{
+    return children.count();
+}
+
+void WMReaper::reap()
+{
+#ifdef __linux__
+    for (;;)
+    {
+        siginfo_t info;
+        info.si_pid = 0;
+
+        if (waitid(P_ALL, 0, &info, WEXITED | WNOHANG) != 0 || info.si_pid == 0)
+            break;
+
+        int exitCode = (info.si_code == CLD_EXITED) ? info.si_status : 128 + info.si_status;
+        WMProcess *proc = children.take(info.si_pid);
+
+        if (proc == NULL && claimed.remove(info.si_pid))
+        {
+            emit childExited(info.si_pid, exitCode);
+            continue;
+        }
+
+        if (proc == NULL)
+        {
+            log (QString("Reaped unknown child %1 with exit code %2").arg(info.si_pid).arg(exitCode), WMLogger::Warning);
+            continue;
+        }
+
+        log (QString("Reaped child %1 with exit code %2").arg(info.si_pid).arg(exitCode));
+        proc->onChildExited(exitCode);
+    }
+#endif
+}
+
+void WMReaper::log(QString message, WMLogger::LogLevel level)
+{
+    WMLogger::instance->log(message, level, "wreap");
+}
+
+void WMReaper::onSignalFdActivated()
+{
+    WMLagMonitor::HandlerScope handlerScope("WMReaper::onSignalFdActivated");
+
+#ifdef __linux__
+    // Several SIGCHLDs may collapse into one, so the fd is only a wake-up;
+    // waitid finds out who actually exited
+    struct signalfd_siginfo info;
+    while (::read(signalFd, &info, sizeof(info)) == sizeof(info))
+        ;
+
+    reap();
+#endif
+}
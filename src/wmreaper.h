@@ -0,0 +1,66 @@
+#ifndef WMREAPER_H
+#define WMREAPER_H
+
+#include <QObject>
+
+#include <QHash>
+#include <QSet>
+#include <QSocketNotifier>
+
+#ifdef __linux__
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/signalfd.h>
+#include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#endif
+
+#include "wmlogger.h"
+#include "wmlagmonitor.h"
+
+class WMProcess;
+
+// Reaps every child through one signalfd(SIGCHLD) and waitid(P_ALL) loop,
+// so a supervised child costs no pipes, notifiers or timers of its own.
+// P_ALL would steal children from QProcess, so this only runs together
+// with the posix_spawn backend. SIGCHLD must be blocked before any other
+// thread exists, hence start() is called early on.
+class WMReaper : public QObject
+{
+    Q_OBJECT
+public:
+    explicit WMReaper(QObject *parent = 0);
+    ~WMReaper();
+
+    bool start();
+
+    void watch(int pid, WMProcess *proc);
+    void unwatch(int pid, WMProcess *proc);
+
+    // Short-lived helpers that aren't instances, reported through childExited()
+    void claim(int pid);
+
+    int watchedCount();
+
+    static WMReaper *instance;
+
+private:
+    int signalFd;
+    QSocketNotifier *notifier;
+    QHash<int, WMProcess *> children;
+    QSet<int> claimed;
+
+    void reap();
+    void log(QString message, WMLogger::LogLevel level = WMLogger::Debug);
+
+signals:
+    void childExited(int pid, int exitCode);
+
+private slots:
+    void onSignalFdActivated();
+};
+
+#endif // WMREAPER_H
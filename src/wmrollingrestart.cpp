@@ -0,0 +1,182 @@
+#include "wmrollingrestart.h"
+#include "wmcore.h"
+
+WMRollingRestart::WMRollingRestart(WMCore *core, WMProcess::ProcessType type, QStringList tags,
+                                   int maxInFlight, double maxFailureRatio,
+                                   int healthTimeout, int settleTime, QObject *parent) :
+    QObject(parent), core(core), type(type), pending(tags), total(tags.count()),
+    maxInFlight(qMax(maxInFlight, 1)), maxFailureRatio(maxFailureRatio),
+    healthTimeout(healthTimeout), settleTime(settleTime),
+    succeeded(0), failed(0), running(false), aborting(false)
+{
+    checkTimer = new QTimer(this);
+    checkTimer->setInterval(checkInterval);
+    connect(checkTimer, SIGNAL(timeout()), this, SLOT(onCheckTimer()));
+}
+
+void WMRollingRestart::start()
+{
+    running = true;
+    clock.start();
+    checkTimer->start();
+
+    log (QString("Rolling restart of %1 %2 instances, %3 at a time")
+         .arg(total).arg(WMProcess::typeToString(type)).arg(maxInFlight), WMLogger::Info);
+
+    emit progress(QString("ROLLING STARTED %1 %2").arg(total).arg(maxInFlight));
+
+    issueNext();
+}
+
+void WMRollingRestart::abort()
+{
+    if (!running || aborting)
+        return;
+
+    log (QString("Rolling restart aborted, %1 instances left untouched").arg(pending.count()), WMLogger::Warning);
+
+    aborting = true;
+    pending.clear();
+
+    // Restarts already issued can't be taken back, let them settle
+    if (inFlight.isEmpty())
+        finish();
+}
+
+bool WMRollingRestart::isRunning()
+{
+    return running;
+}
+
+QString WMRollingRestart::status()
+{
+    return QString("%1 %2 %3 %4 %5 %6")
+            .arg(aborting ? "aborting" : (running ? "running" : "finished"))
+            .arg(total).arg(succeeded).arg(failed).arg(inFlight.count()).arg(pending.count());
+}
+
+void WMRollingRestart::issueNext()
+{
+    while (!aborting && inFlight.count() < maxInFlight && !pending.isEmpty())
+    {
+        QString tag = pending.takeFirst();
+
+        Step step;
+        step.issuedAt = clock.elapsed();
+        step.upAt = 0;
+        inFlight.insert(tag, step);
+
+        emit progress(QString("ROLLING RESTARTING %1").arg(tag));
+
+        if (!core->performProcessAction(tag, type, WMControlServer::Restart))
+            finishStep(tag, false, "noinstance");
+    }
+
+    if (inFlight.isEmpty() && (pending.isEmpty() || aborting))
+        finish();
+}
+
+void WMRollingRestart::finishStep(QString tag, bool ok, QString reason)
+{
+    if (!inFlight.contains(tag))
+        return;
+
+    qint64 took = clock.elapsed() - inFlight.value(tag).issuedAt;
+    inFlight.remove(tag);
+
+    if (ok)
+    {
+        succeeded++;
+        emit progress(QString("ROLLING UP %1 %2").arg(tag).arg(took));
+    }
+        else
+    {
+        failed++;
+        log (QString("Rolling restart of %1 failed: %2").arg(tag).arg(reason), WMLogger::Warning);
+        emit progress(QString("ROLLING FAILED %1 %2").arg(tag).arg(reason));
+    }
+
+    // Judge the ratio only once a full window has finished, so a single
+    // early failure doesn't end a run of hundreds
+    int finishedSteps = succeeded + failed;
+
+    if (!aborting && failed > 0 && finishedSteps >= maxInFlight &&
+        (double)failed / finishedSteps > maxFailureRatio)
+    {
+        emit progress(QString("ROLLING ABORTING %1 %2").arg(failed).arg(finishedSteps));
+        abort();
+    }
+
+    issueNext();
+}
+
+void WMRollingRestart::finish()
+{
+    if (!running)
+        return;
+
+    running = false;
+    checkTimer->stop();
+
+    int skipped = total - succeeded - failed;
+
+    log (QString("Rolling restart finished: %1 up, %2 failed, %3 skipped").arg(succeeded).arg(failed).arg(skipped),
+         WMLogger::Info);
+
+    if (aborting)
+        emit progress(QString("ROLLING ABORTED %1 %2 %3").arg(succeeded).arg(failed).arg(skipped));
+    else
+        emit progress(QString("ROLLING DONE %1 %2").arg(succeeded).arg(failed));
+
+    emit finished();
+}
+
+void WMRollingRestart::log(QString message, WMLogger::LogLevel level)
+{
+    WMLogger::instance->log(message, level, "wroll");
+}
+
+void WMRollingRestart::onInstanceStarted(QString tag, WMProcess::ProcessType type)
+{
+    if (type != this->type || !inFlight.contains(tag))
+        return;
+
+    inFlight[tag].upAt = clock.elapsed();
+
+    if (settleTime <= 0)
+        finishStep(tag, true);
+}
+
+void WMRollingRestart::onInstanceDied(QString tag, WMProcess::ProcessType type, int exitCode)
+{
+    if (type != this->type || !inFlight.contains(tag))
+        return;
+
+    // Before the new instance is up, the old one going away is the restart itself
+    if (inFlight.value(tag).upAt == 0 && (exitCode == 0 || exitCode == WMProcess::RC_KILLEDBYCONTROL))
+        return;
+
+    finishStep(tag, false, exitCode == WMProcess::RC_CANNOTSTART ? "cannotstart" : QString("exit:%1").arg(exitCode));
+}
+
+void WMRollingRestart::onCheckTimer()
+{
+    qint64 now = clock.elapsed();
+    QStringList up;
+    QStringList timedOut;
+
+    QMap<QString, Step>::const_iterator it;
+    for (it = inFlight.constBegin(); it != inFlight.constEnd(); ++it)
+    {
+        if (it.value().upAt > 0 && now - it.value().upAt >= settleTime)
+            up.append(it.key());
+        else if (it.value().upAt == 0 && now - it.value().issuedAt >= healthTimeout)
+            timedOut.append(it.key());
+    }
+
+    for (int i = 0; i < up.count(); i++)
+        finishStep(up.at(i), true);
+
+    for (int i = 0; i < timedOut.count(); i++)
+        finishStep(timedOut.at(i), false, "timeout");
+}
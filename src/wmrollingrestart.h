@@ -0,0 +1,81 @@
+#ifndef WMROLLINGRESTART_H
+#define WMROLLINGRESTART_H
+
+#include <QObject>
+
+#include <QString>
+#include <QStringList>
+#include <QMap>
+#include <QTimer>
+#include <QElapsedTimer>
+
+#include "wmlogger.h"
+#include "wmprocess.h"
+
+class WMCore;
+
+// Restarts a set of instances a few at a time. An instance counts as done
+// once it is back up and has stayed up for the settle time; the run stops
+// issuing restarts when too many of the finished ones have failed.
+class WMRollingRestart : public QObject
+{
+    Q_OBJECT
+public:
+    explicit WMRollingRestart(WMCore *core, WMProcess::ProcessType type, QStringList tags,
+                              int maxInFlight, double maxFailureRatio,
+                              int healthTimeout, int settleTime, QObject *parent = 0);
+
+    void start();
+    void abort();
+
+    bool isRunning();
+    QString status();
+
+private:
+
+    struct Step
+    {
+        qint64 issuedAt;
+        qint64 upAt;       // 0 until the new instance has started
+    };
+
+    WMCore *core;
+    WMProcess::ProcessType type;
+    QStringList pending;
+    QMap<QString, Step> inFlight;
+
+    int total;
+    int maxInFlight;
+    double maxFailureRatio;
+    int healthTimeout;
+    int settleTime;
+
+    int succeeded;
+    int failed;
+    bool running;
+    bool aborting;
+
+    QElapsedTimer clock;
+    QTimer *checkTimer;
+
+    static const int checkInterval = 250; // ms
+
+    void issueNext();
+    void finishStep(QString tag, bool ok, QString reason = QString());
+    void finish();
+
+    void log(QString message, WMLogger::LogLevel level = WMLogger::Debug);
+
+signals:
+    void progress(QString);
+    void finished();
+
+public slots:
+    void onInstanceStarted(QString tag, WMProcess::ProcessType type);
+    void onInstanceDied(QString tag, WMProcess::ProcessType type, int exitCode);
+
+private slots:
+    void onCheckTimer();
+};
+
+#endif // WMROLLINGRESTART_H
@@ -0,0 +1,262 @@
+#include "wmscriptcheck.h"
+#include "wmspawner.h"
+#include "wmreaper.h"
+
+WMScriptCheck::WMScriptCheck(QString appPath, QString runtimeDir, int concurrency, int timeout, QObject *parent) :
+    QObject(parent), appPath(appPath), runtimeDir(runtimeDir), concurrency(qMax(concurrency, 1)), timeout(timeout),
+    pollTimerId(0)
+{
+    cacheFileName = QString("%1/core/scriptcheck.json").arg(runtimeDir);
+
+    // A new liquidsoap may reject what the old one accepted
+    QFileInfo binary(appPath);
+    binaryId = QString("%1:%2:%3").arg(binary.canonicalFilePath()).arg(binary.size())
+                                  .arg(binary.lastModified().toMSecsSinceEpoch()).toUtf8();
+
+    if (WMReaper::instance != NULL)
+        connect(WMReaper::instance, SIGNAL(childExited(int,int)), this, SLOT(onChildExited(int,int)));
+
+    loadCache();
+}
+
+WMScriptCheck::~WMScriptCheck()
+{
+    WMTimerWheel::instance->cancel(pollTimerId);
+
+#ifdef __linux__
+    QHash<int, Job>::const_iterator it;
+    for (it = running.constBegin(); it != running.constEnd(); ++it)
+    {
+        WMTimerWheel::instance->cancel(it.value().timeoutId);
+        ::kill(it.key(), SIGKILL);
+        QFile::remove(it.value().outputPath);
+    }
+#endif
+}
+
+WMScriptCheck::Verdict WMScriptCheck::verdict(QString script)
+{
+    QJsonObject entry = cache.value(script).toObject();
+
+    if (entry.isEmpty())
+        return Unknown;
+
+    if (entry.value("hash").toString().toLatin1() != hashOf(script))
+        return Unknown;
+
+    return entry.value("ok").toBool() ? Passed : Failed;
+}
+
+void WMScriptCheck::check(QString tag, QString script)
+{
+    if (isPending(tag))
+        return;
+
+    log (QString("Script %1 has changed, checking it before the spawn").arg(script), WMLogger::Info);
+
+    queue.append(tag);
+    queuedScripts.insert(tag, script);
+    startJobs();
+}
+
+bool WMScriptCheck::isPending(QString tag)
+{
+    if (queuedScripts.contains(tag))
+        return true;
+
+    QHash<int, Job>::const_iterator it;
+    for (it = running.constBegin(); it != running.constEnd(); ++it)
+    {
+        if (it.value().tag == tag)
+            return true;
+    }
+
+    return false;
+}
+
+QByteArray WMScriptCheck::hashOf(QString script)
+{
+    QFile file(script);
+
+    if (!file.open(QIODevice::ReadOnly))
+        return QByteArray();
+
+    QCryptographicHash hash(QCryptographicHash::Sha256);
+    hash.addData(binaryId);
+    hash.addData(file.readAll());
+    return hash.result().toHex();
+}
+
+void WMScriptCheck::loadCache()
+{
+    QFile file(cacheFileName);
+
+    if (!file.open(QIODevice::ReadOnly))
+        return;
+
+    cache = QJsonDocument::fromJson(file.readAll()).object();
+    log (QString("Loaded %1 cached script verdicts").arg(cache.count()));
+}
+
+void WMScriptCheck::saveCache()
+{
+    QDir().mkpath(QFileInfo(cacheFileName).absolutePath());
+
+    QFile file(cacheFileName + ".tmp");
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+    {
+        log (QString("Could not write %1: %2").arg(file.fileName()).arg(file.errorString()), WMLogger::Warning);
+        return;
+    }
+
+    file.write(QJsonDocument(cache).toJson(QJsonDocument::Compact));
+    file.close();
+
+    QFile::remove(cacheFileName);
+    file.rename(cacheFileName);
+}
+
+void WMScriptCheck::startJobs()
+{
+    while (running.count() < concurrency && queue.count() > 0)
+    {
+        QString tag = queue.takeFirst();
+
+        Job job;
+        job.tag = tag;
+        job.script = queuedScripts.take(tag);
+        job.hash = hashOf(job.script);
+        job.outputPath = QString("%1/core/check-%2.log").arg(runtimeDir).arg(tag);
+
+        QFile::remove(job.outputPath);
+
+        QString error;
+        int pid = WMSpawner::spawn(appPath, QStringList() << "--check" << job.script,
+                                   QFileInfo(job.script).absolutePath(), job.outputPath, &error);
+
+        // Can't tell either way; spawning is better than keeping a station off the air
+        if (pid <= 0)
+        {
+            log (QString("Could not run the check for %1: %2, spawning it unchecked").arg(tag).arg(error),
+                 WMLogger::Warning);
+            emit checked(tag, true);
+            continue;
+        }
+
+        job.started.start();
+        job.timeoutId = WMTimerWheel::instance->schedule(timeout, this, "onJobTimeout");
+        running.insert(pid, job);
+
+        if (WMReaper::instance != NULL)
+            WMReaper::instance->claim(pid);
+    }
+
+    // The reaper reports exits by itself, see onChildExited()
+    if (WMReaper::instance == NULL && running.count() > 0 && pollTimerId == 0)
+        pollTimerId = WMTimerWheel::instance->schedule(pollInterval, this, "onPollTimer");
+}
+
+void WMScriptCheck::finishJob(int pid, int exitCode)
+{
+    Job job = running.take(pid);
+    bool passed = (exitCode == 0);
+
+    WMTimerWheel::instance->cancel(job.timeoutId);
+
+    QFile output(job.outputPath);
+    QString message;
+    if (output.open(QIODevice::ReadOnly))
+        message = QString::fromUtf8(output.read(4096)).trimmed();
+
+    output.remove();
+
+    log (QString("Script check for %1 %2 in %3 ms").arg(job.tag).arg(passed ? "passed" : "failed")
+         .arg(job.started.elapsed()), passed ? WMLogger::Debug : WMLogger::Error);
+
+    if (!passed && !message.isEmpty())
+        log (QString("liquidsoap says: %1").arg(message), WMLogger::Error);
+
+    if (!job.hash.isEmpty())
+    {
+        QJsonObject entry;
+        entry.insert("hash", QString::fromLatin1(job.hash));
+        entry.insert("ok", passed);
+        cache.insert(job.script, entry);
+        saveCache();
+    }
+
+    emit checked(job.tag, passed);
+    startJobs();
+}
+
+void WMScriptCheck::log(QString message, WMLogger::LogLevel level)
+{
+    WMLogger::instance->log(message, level, "wchck");
+}
+
+void WMScriptCheck::onPollTimer()
+{
+    WMLagMonitor::HandlerScope handlerScope("WMScriptCheck::onPollTimer");
+
+    pollTimerId = 0;
+
+#ifdef __linux__
+    QList<int> pids = running.keys();
+
+    for (int i = 0; i < pids.count(); i++)
+    {
+        int status;
+
+        if (waitpid(pids.at(i), &status, WNOHANG) == pids.at(i))
+            finishJob(pids.at(i), WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status));
+    }
+#endif
+
+    startJobs();
+}
+
+// The wheel doesn't say whose timeout fired. All jobs get the same one
+// and finished jobs cancel theirs, so it is always the oldest job's.
+void WMScriptCheck::onJobTimeout()
+{
+    WMLagMonitor::HandlerScope handlerScope("WMScriptCheck::onJobTimeout");
+
+    int pid = 0;
+    qint64 oldest = -1;
+
+    QHash<int, Job>::const_iterator it;
+    for (it = running.constBegin(); it != running.constEnd(); ++it)
+    {
+        if (it.value().started.elapsed() > oldest)
+        {
+            oldest = it.value().started.elapsed();
+            pid = it.key();
+        }
+    }
+
+    if (pid == 0)
+        return;
+
+    // Not cached: a slow check says nothing about the script
+    Job job = running.take(pid);
+    log (QString("Script check for %1 timed out after %2 ms, spawning it unchecked").arg(job.tag).arg(oldest),
+         WMLogger::Warning);
+
+#ifdef __linux__
+    int status;
+    ::kill(pid, SIGKILL);
+    if (WMReaper::instance == NULL)
+        waitpid(pid, &status, 0);
+#endif
+
+    QFile::remove(job.outputPath);
+    emit checked(job.tag, true);
+
+    startJobs();
+}
+
+void WMScriptCheck::onChildExited(int pid, int exitCode)
+{
+    if (running.contains(pid))
+        finishJob(pid, exitCode);
+}
@@ -0,0 +1,96 @@
+#ifndef WMSCRIPTCHECK_H
+#define WMSCRIPTCHECK_H
+
+#include <QObject>
+
+#include <QString>
+#include <QStringList>
+#include <QHash>
+#include <QFile>
+#include <QFileInfo>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QCryptographicHash>
+#include <QJsonDocument>
+#include <QJsonObject>
+
+#ifdef __linux__
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <signal.h>
+#endif
+
+#include "wmlogger.h"
+#include "wmlagmonitor.h"
+#include "wmtimerwheel.h"
+
+// Runs `liquidsoap --check` on a station script before it is spawned, at most
+// `concurrency` checks at a time. Verdicts are cached in runtime_dir/core/
+// scriptcheck.json by a hash of the script and the liquidsoap binary, so an
+// unchanged script is never checked twice. Children are started through
+// WMSpawner and collected by WMReaper when it runs, by waitpid() polled on
+// the timer wheel otherwise; every job has its own timeout on the wheel.
+class WMScriptCheck : public QObject
+{
+    Q_OBJECT
+public:
+
+    enum Verdict {
+        Unknown,
+        Passed,
+        Failed
+    };
+
+    explicit WMScriptCheck(QString appPath, QString runtimeDir, int concurrency = 2, int timeout = 30000,
+                           QObject *parent = 0);
+    ~WMScriptCheck();
+
+    Verdict verdict(QString script);
+    void check(QString tag, QString script);
+    bool isPending(QString tag);
+
+private:
+
+    struct Job
+    {
+        QString tag;
+        QString script;
+        QByteArray hash;
+        QString outputPath;
+        QElapsedTimer started;
+        WMTimerWheel::TimerId timeoutId;
+    };
+
+    QString appPath;
+    QString runtimeDir;
+    QString cacheFileName;
+    QByteArray binaryId;
+    int concurrency;
+    int timeout;
+
+    QJsonObject cache;             // script path -> {"hash", "ok"}
+    QStringList queue;             // tags
+    QHash<QString, QString> queuedScripts;
+    QHash<int, Job> running;       // by PID
+    WMTimerWheel::TimerId pollTimerId;
+
+    static const int pollInterval = 100;   // ms, without WMReaper only
+
+    QByteArray hashOf(QString script);
+    void loadCache();
+    void saveCache();
+    void startJobs();
+    void finishJob(int pid, int exitCode);
+
+    void log(QString message, WMLogger::LogLevel level = WMLogger::Debug);
+
+signals:
+    void checked(QString tag, bool passed);
+
+private slots:
+    void onPollTimer();
+    void onJobTimeout();
+    void onChildExited(int pid, int exitCode);
+};
+
+#endif // WMSCRIPTCHECK_H
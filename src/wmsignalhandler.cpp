@@ -0,0 +1,85 @@
+#include "wmsignalhandler.h"
+
+int WMSignalHandler::sockets[2] = { -1, -1 };
+
+WMSignalHandler::WMSignalHandler(QObject *parent) : QObject(parent), notifier(0)
+{
+#ifdef __linux__
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0, sockets) != 0)
+    {
+        log ("Could not create the signal socket pair, signals won't be handled!", WMLogger::Error);
+        return;
+    }
+
+    notifier = new QSocketNotifier(sockets[1], QSocketNotifier::Read, this);
+    connect(notifier, SIGNAL(activated(int)), this, SLOT(onSocketActivated()));
+#else
+    log ("Unix signals are not supported on this OS", WMLogger::Warning);
+#endif
+}
+
+WMSignalHandler::~WMSignalHandler()
+{
+#ifdef __linux__
+    if (sockets[0] >= 0)
+    {
+        ::close(sockets[0]);
+        ::close(sockets[1]);
+        sockets[0] = sockets[1] = -1;
+    }
+#endif
+}
+
+bool WMSignalHandler::watch(int signal)
+{
+#ifdef __linux__
+    if (notifier == 0)
+        return false;
+
+    struct sigaction action;
+    action.sa_handler = WMSignalHandler::handleSignal;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+
+    if (sigaction(signal, &action, 0) != 0)
+    {
+        log (QString("Could not install a handler for signal %1").arg(signal), WMLogger::Warning);
+        return false;
+    }
+
+    log (QString("Watching signal %1").arg(signal));
+    return true;
+#else
+    Q_UNUSED(signal);
+    return false;
+#endif
+}
+
+void WMSignalHandler::handleSignal(int signal)
+{
+#ifdef __linux__
+    unsigned char code = (unsigned char)signal;
+    ssize_t written = ::write(sockets[0], &code, sizeof(code));
+    Q_UNUSED(written);
+#else
+    Q_UNUSED(signal);
+#endif
+}
+
+void WMSignalHandler::log(QString message, WMLogger::LogLevel level)
+{
+    WMLogger::instance->log(message, level, "wsign");
+}
+
+void WMSignalHandler::onSocketActivated()
+{
+#ifdef __linux__
+    unsigned char code;
+
+    while (::read(sockets[1], &code, sizeof(code)) == sizeof(code))
+    {
+        log (QString("Received signal %1").arg(code), WMLogger::Info);
+        emit signalReceived(code);
+    }
+#endif
+}
@@ -0,0 +1,43 @@
+#ifndef WMSIGNALHANDLER_H
+#define WMSIGNALHANDLER_H
+
+#include <QObject>
+
+#include <QSocketNotifier>
+
+#ifdef __linux__
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <signal.h>
+#include <unistd.h>
+#endif
+
+#include "wmlogger.h"
+
+// Turns asynchronous Unix signals into a Qt signal delivered on the event loop.
+// The handler itself only writes the signal number into a socket pair.
+class WMSignalHandler : public QObject
+{
+    Q_OBJECT
+public:
+    explicit WMSignalHandler(QObject *parent = 0);
+    ~WMSignalHandler();
+
+    bool watch(int signal);
+
+private:
+    QSocketNotifier *notifier;
+
+    static int sockets[2];
+    static void handleSignal(int signal);
+
+    void log(QString message, WMLogger::LogLevel level = WMLogger::Debug);
+
+signals:
+    void signalReceived(int);
+
+private slots:
+    void onSocketActivated();
+};
+
+#endif // WMSIGNALHANDLER_H
@@ -0,0 +1,90 @@
+#include "wmspawner.h"
+
+extern char **environ;
+
+int WMSpawner::spawn(QString program, QStringList args, QString workingDir, QString outputPath, QString *error)
+{
+#ifdef __linux__
+    QElapsedTimer timer;
+    timer.start();
+
+    QList<QByteArray> argData;
+    argData.append(program.toLocal8Bit());
+    for (int i = 0; i < args.count(); i++)
+        argData.append(args.at(i).toLocal8Bit());
+
+    QVector<char *> argv;
+    for (int i = 0; i < argData.count(); i++)
+        argv.append(argData[i].data());
+    argv.append(0);
+
+    QByteArray outputData = outputPath.toLocal8Bit();
+    QByteArray workingDirData = workingDir.toLocal8Bit();
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, 0, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_addopen(&actions, 1, outputData.constData(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    posix_spawn_file_actions_adddup2(&actions, 1, 2);
+
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 29))
+    if (!workingDir.isEmpty())
+        posix_spawn_file_actions_addchdir_np(&actions, workingDirData.constData());
+#else
+    if (!workingDir.isEmpty())
+        log (QString("This libc can't change the working directory of a spawned child, ignoring %1").arg(workingDir),
+             WMLogger::Warning);
+#endif
+
+    // The child must not inherit our blocked signals or our handlers' dispositions
+    posix_spawnattr_t attributes;
+    posix_spawnattr_init(&attributes);
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    posix_spawnattr_setsigmask(&attributes, &mask);
+
+    sigset_t defaults;
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGPIPE);
+    sigaddset(&defaults, SIGCHLD);
+    sigaddset(&defaults, SIGTERM);
+    sigaddset(&defaults, SIGINT);
+    sigaddset(&defaults, SIGUSR2);
+    posix_spawnattr_setsigdefault(&attributes, &defaults);
+
+    posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+    pid_t pid;
+    int result = posix_spawn(&pid, argv.at(0), &actions, &attributes, argv.data(), environ);
+
+    posix_spawnattr_destroy(&attributes);
+    posix_spawn_file_actions_destroy(&actions);
+
+    if (result != 0)
+    {
+        if (error != 0)
+            *error = QString(strerror(result));
+
+        return -1;
+    }
+
+    log (QString("Spawned %1 as PID %2 in %3 us").arg(program).arg(pid).arg(timer.nsecsElapsed() / 1000));
+    return pid;
+#else
+    Q_UNUSED(program);
+    Q_UNUSED(args);
+    Q_UNUSED(workingDir);
+    Q_UNUSED(outputPath);
+
+    if (error != 0)
+        *error = "posix_spawn is not supported on this OS";
+
+    return -1;
+#endif
+}
+
+void WMSpawner::log(QString message, WMLogger::LogLevel level)
+{
+    WMLogger::instance->log(message, level, "wspwn");
+}
@@ -0,0 +1,35 @@
+#ifndef WMSPAWNER_H
+#define WMSPAWNER_H
+
+#include <QString>
+#include <QStringList>
+#include <QByteArray>
+#include <QList>
+#include <QVector>
+#include <QElapsedTimer>
+
+#ifdef __linux__
+#include <spawn.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <errno.h>
+#include <string.h>
+#endif
+
+#include "wmlogger.h"
+
+// Starts children with posix_spawn() instead of QProcess. glibc implements it
+// with clone(CLONE_VM | CLONE_VFORK), so the cost does not grow with our RSS,
+// and the child gets no pipes back to us: stdin is /dev/null, stdout and
+// stderr go to a log file.
+class WMSpawner
+{
+public:
+    static int spawn(QString program, QStringList args, QString workingDir, QString outputPath,
+                     QString *error = 0);
+
+private:
+    static void log(QString message, WMLogger::LogLevel level = WMLogger::Debug);
+};
+
+#endif // WMSPAWNER_H
@@ -0,0 +1,201 @@
+#include "wmspawnscheduler.h"
+
+WMSpawnScheduler::WMSpawnScheduler(const WMSchedulerLimits &limits, QObject *parent) :
+    QObject(parent), limits(limits), bucket(limits.spawnRate, limits.spawnBurst),
+    load(0), cpuSome(-1), memorySome(-1), throttled(false), admittedCount(0), overdueCount(0)
+{
+    cpuCount = qMax(QThread::idealThreadCount(), 1);
+    clock.start();
+
+    tickTimer = new QTimer(this);
+    tickTimer->setInterval(tickInterval);
+    connect(tickTimer, SIGNAL(timeout()), this, SLOT(onTick()));
+
+    log (QString("Spawning at %1/s, throttling above load %2 per CPU, %3% CPU or %4% memory pressure")
+         .arg(limits.spawnRate).arg(limits.loadThreshold).arg(limits.cpuPressure).arg(limits.memoryPressure),
+         WMLogger::Info);
+}
+
+void WMSpawnScheduler::enqueue(QString tag, WMProcess::ProcessType type, Priority priority)
+{
+    for (int i = 0; i < queue.count(); i++)
+    {
+        if (queue.at(i).tag == tag && queue.at(i).type == type)
+            return;
+    }
+
+    Request request;
+    request.tag = tag;
+    request.type = type;
+    request.priority = priority;
+    request.waiting.start();
+
+    // Behind everything of the same class or better, FIFO within a class
+    int position = queue.count();
+    while (position > 0 && queue.at(position - 1).priority > priority)
+        position--;
+
+    queue.insert(position, request);
+
+    if (!tickTimer->isActive())
+    {
+        // Spawn right away if nothing is pending, as if the timer had been running
+        tickTimer->start();
+        onTick();
+    }
+}
+
+bool WMSpawnScheduler::dequeue(QString tag, WMProcess::ProcessType type)
+{
+    for (int i = 0; i < queue.count(); i++)
+    {
+        if (queue.at(i).tag == tag && queue.at(i).type == type)
+        {
+            queue.removeAt(i);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void WMSpawnScheduler::clear()
+{
+    queue.clear();
+    tickTimer->stop();
+}
+
+bool WMSpawnScheduler::isThrottled()
+{
+    return throttled;
+}
+
+QStringList WMSpawnScheduler::status()
+{
+    if (!tickTimer->isActive())
+        sample();
+
+    QStringList lines;
+    lines.append(QString("%1 load %2 cpu %3 memory %4")
+                 .arg(throttled ? "throttled" : "healthy")
+                 .arg(load, 0, 'f', 2).arg(cpuSome, 0, 'f', 2).arg(memorySome, 0, 'f', 2));
+    lines.append(QString("COUNTERS admitted %1 overdue %2").arg(admittedCount).arg(overdueCount));
+    return lines;
+}
+
+// priority type tag waited_ms
+QStringList WMSpawnScheduler::queued()
+{
+    QStringList list;
+
+    for (int i = 0; i < queue.count(); i++)
+    {
+        const Request &request = queue.at(i);
+        list.append(QString("%1 %2 %3 %4").arg(priorityToString(request.priority))
+                    .arg(WMProcess::typeToString(request.type)).arg(request.tag).arg(request.waiting.elapsed()));
+    }
+
+    return list;
+}
+
+QString WMSpawnScheduler::priorityToString(Priority priority)
+{
+    return (priority == Critical) ? "critical" : "normal";
+}
+
+void WMSpawnScheduler::sample()
+{
+    QFile loadFile("/proc/loadavg");
+    if (loadFile.open(QIODevice::ReadOnly))
+        load = QString::fromLatin1(loadFile.readLine()).section(' ', 0, 0).toDouble() / cpuCount;
+
+    cpuSome = readPressure("/proc/pressure/cpu");
+    memorySome = readPressure("/proc/pressure/memory");
+
+    bool wasThrottled = throttled;
+
+    throttled = (limits.loadThreshold > 0 && load > limits.loadThreshold) ||
+                (limits.cpuPressure > 0 && cpuSome > limits.cpuPressure) ||
+                (limits.memoryPressure > 0 && memorySome > limits.memoryPressure);
+
+    if (throttled != wasThrottled)
+        log (QString("Host is %1: load %2 per CPU, CPU pressure %3%, memory pressure %4%")
+             .arg(throttled ? "under pressure, throttling spawns" : "healthy again")
+             .arg(load, 0, 'f', 2).arg(cpuSome, 0, 'f', 2).arg(memorySome, 0, 'f', 2), WMLogger::Info);
+}
+
+// "some avg10=1.23 avg60=..." -> 1.23; -1 if the kernel has no PSI
+double WMSpawnScheduler::readPressure(QString fileName)
+{
+    QFile file(fileName);
+
+    if (!file.open(QIODevice::ReadOnly))
+        return -1;
+
+    QString line = QString::fromLatin1(file.readLine());
+
+    if (!line.startsWith("some "))
+        return -1;
+
+    return line.section(' ', 1, 1).section('=', 1, 1).toDouble();
+}
+
+void WMSpawnScheduler::log(QString message, WMLogger::LogLevel level)
+{
+    WMLogger::instance->log(message, level, "wschd");
+}
+
+void WMSpawnScheduler::onTick()
+{
+    WMLagMonitor::HandlerScope handlerScope("WMSpawnScheduler::onTick");
+
+    if (queue.count() == 0)
+    {
+        tickTimer->stop();
+        return;
+    }
+
+    sample();
+
+    qint64 now = clock.elapsed();
+    bool spawnedUnderPressure = false;
+
+    for (int i = 0; i < queue.count(); )
+    {
+        const Request &request = queue.at(i);
+
+        if (throttled)
+        {
+            // One spawn per tick at most, and normal ones only once they've waited long enough
+            if (spawnedUnderPressure)
+                break;
+
+            if (request.priority != Critical && request.waiting.elapsed() < limits.maxDefer)
+            {
+                i++;
+                continue;
+            }
+        }
+            else if (!bucket.take(now))
+            break;
+
+        Request admittedRequest = queue.takeAt(i);
+        admittedCount++;
+
+        if (throttled)
+        {
+            spawnedUnderPressure = true;
+
+            if (admittedRequest.priority != Critical)
+                overdueCount++;
+        }
+
+        log (QString("Admitting %1/%2 after %3 ms").arg(WMProcess::typeToString(admittedRequest.type))
+             .arg(admittedRequest.tag).arg(admittedRequest.waiting.elapsed()));
+
+        emit admitted(admittedRequest.tag, admittedRequest.type);
+    }
+
+    if (queue.count() == 0)
+        tickTimer->stop();
+}
@@ -0,0 +1,92 @@
+#ifndef WMSPAWNSCHEDULER_H
+#define WMSPAWNSCHEDULER_H
+
+#include <QObject>
+
+#include <QString>
+#include <QStringList>
+#include <QList>
+#include <QFile>
+#include <QTimer>
+#include <QThread>
+#include <QElapsedTimer>
+
+#include "wmlogger.h"
+#include "wmlagmonitor.h"
+#include "wmprocess.h"
+#include "wmtokenbucket.h"
+
+struct WMSchedulerLimits
+{
+    double spawnRate;        // spawns per second while the host is healthy
+    double spawnBurst;
+    double loadThreshold;    // 1 min load average per CPU
+    double cpuPressure;      // PSI "some avg10", percent; 0 disables
+    double memoryPressure;
+    int maxDefer;            // ms a normal spawn may wait for the pressure to go away
+};
+
+// Admission control for mass (re)starts. Spawns are queued by priority class
+// and let through at spawnRate while the host is healthy. Under load or PSI
+// pressure only critical ones go, one per tick; normal ones wait until the
+// pressure is gone or they have waited maxDefer.
+class WMSpawnScheduler : public QObject
+{
+    Q_OBJECT
+public:
+
+    enum Priority {
+        Critical,
+        Normal
+    };
+
+    explicit WMSpawnScheduler(const WMSchedulerLimits &limits, QObject *parent = 0);
+
+    void enqueue(QString tag, WMProcess::ProcessType type, Priority priority);
+    bool dequeue(QString tag, WMProcess::ProcessType type);
+    void clear();
+
+    bool isThrottled();
+    QStringList status();
+    QStringList queued();
+
+    static QString priorityToString(Priority priority);
+
+private:
+
+    struct Request
+    {
+        QString tag;
+        WMProcess::ProcessType type;
+        Priority priority;
+        QElapsedTimer waiting;
+    };
+
+    WMSchedulerLimits limits;
+    WMTokenBucket bucket;
+    QList<Request> queue;
+    QTimer *tickTimer;
+    QElapsedTimer clock;
+    int cpuCount;
+
+    double load;
+    double cpuSome;
+    double memorySome;
+    bool throttled;
+    quint64 admittedCount;
+    quint64 overdueCount;
+
+    void sample();
+    double readPressure(QString fileName);
+    void log(QString message, WMLogger::LogLevel level = WMLogger::Debug);
+
+    static const int tickInterval = 100; // ms
+
+signals:
+    void admitted(QString tag, WMProcess::ProcessType type);
+
+private slots:
+    void onTick();
+};
+
+#endif // WMSPAWNSCHEDULER_H
@@ -0,0 +1,71 @@
+#include "wmstatejournal.h"
+
+WMStateJournal::WMStateJournal(int capacity) :
+    capacity(qMax(capacity, 1)), last(0)
+{
+    epochId = QString::number(QDateTime::currentMSecsSinceEpoch(), 36);
+    ring.resize(this->capacity);
+}
+
+quint64 WMStateJournal::append(QString event)
+{
+    last++;
+    ring[last % capacity] = event;
+    return last;
+}
+
+bool WMStateJournal::since(quint64 seq, QStringList &events) const
+{
+    quint64 kept = qMin(last, (quint64)capacity);
+
+    if (seq > last || last - seq > kept)
+        return false;
+
+    for (quint64 n = seq + 1; n <= last; n++)
+        events.append(ring.at(n % capacity));
+
+    return true;
+}
+
+quint64 WMStateJournal::lastSeq() const
+{
+    return last;
+}
+
+QString WMStateJournal::epoch() const
+{
+    return epochId;
+}
+
+QJsonObject WMStateJournal::save() const
+{
+    QJsonArray events;
+    quint64 kept = qMin(last, (quint64)capacity);
+
+    for (quint64 n = last - kept + 1; n <= last; n++)
+        events.append(ring.at(n % capacity));
+
+    QJsonObject state;
+    state.insert("epoch", epochId);
+    state.insert("last", QString::number(last));
+    state.insert("events", events);
+    return state;
+}
+
+void WMStateJournal::restore(const QJsonObject &state)
+{
+    QString epoch = state.value("epoch").toString();
+    QJsonArray events = state.value("events").toArray();
+    bool ok = false;
+    quint64 inherited = state.value("last").toString().toULongLong(&ok);
+
+    if (epoch.isEmpty() || !ok || (quint64)events.count() > inherited)
+        return;
+
+    epochId = epoch;
+    last = inherited - events.count();
+
+    // A smaller journal than the previous image had keeps the newest part
+    for (int i = 0; i < events.count(); i++)
+        append(events.at(i).toString());
+}
@@ -0,0 +1,35 @@
+#ifndef WMSTATEJOURNAL_H
+#define WMSTATEJOURNAL_H
+
+#include <QString>
+#include <QStringList>
+#include <QVector>
+#include <QDateTime>
+#include <QJsonObject>
+#include <QJsonArray>
+
+// The last `capacity` state events, numbered from 1 so a reconnecting client
+// can ask for everything after the last one it saw. The epoch names one
+// numbering; it changes whenever wmcored starts without inheriting the journal.
+class WMStateJournal
+{
+public:
+    explicit WMStateJournal(int capacity = 4096);
+
+    quint64 append(QString event);
+    bool since(quint64 seq, QStringList &events) const;   // false if seq is outside the window
+    quint64 lastSeq() const;
+    QString epoch() const;
+
+    // Carried over an in-place upgrade, see WMCore::upgrade()
+    QJsonObject save() const;
+    void restore(const QJsonObject &state);
+
+private:
+    int capacity;
+    QString epochId;
+    quint64 last;
+    QVector<QString> ring;     // event #n lives at n % capacity
+};
+
+#endif // WMSTATEJOURNAL_H
@@ -0,0 +1,243 @@
+#include "wmstatestore.h"
+
+WMStateStore *WMStateStore::instance = 0;
+
+WMStateStore::WMStateStore(QString runtimeDir, int flushInterval, QObject *parent) :
+    QObject(parent), runtimeDir(runtimeDir), connectionName("wmstate")
+{
+    flushTimer = new QTimer(this);
+    flushTimer->setSingleShot(true);
+    flushTimer->setInterval(flushInterval);
+    connect(flushTimer, SIGNAL(timeout()), this, SLOT(onFlushTimer()));
+}
+
+WMStateStore::~WMStateStore()
+{
+    close();
+}
+
+bool WMStateStore::open()
+{
+    QString dir = QString("%1/core").arg(runtimeDir);
+
+    if (!QDir().mkpath(dir))
+    {
+        log (QString("Could not create state directory %1").arg(dir), WMLogger::Error);
+        return false;
+    }
+
+    db = QSqlDatabase::addDatabase("QSQLITE", connectionName);
+    db.setDatabaseName(QString("%1/state.db").arg(dir));
+
+    if (!db.open())
+    {
+        log (QString("Could not open state database: %1").arg(db.lastError().text()), WMLogger::Error);
+        return false;
+    }
+
+    QSqlQuery query(db);
+
+    // WAL lets readers and the writer work without blocking each other,
+    // NORMAL sync is durable enough for state we can rebuild from /proc
+    query.exec("PRAGMA journal_mode=WAL");
+    query.exec("PRAGMA synchronous=NORMAL");
+
+    if (!query.exec("CREATE TABLE IF NOT EXISTS instances ("
+                    "type TEXT NOT NULL, "
+                    "tag TEXT NOT NULL, "
+                    "pid INTEGER NOT NULL DEFAULT 0, "
+                    "start_time INTEGER NOT NULL DEFAULT 0, "
+                    "start_ticks INTEGER NOT NULL DEFAULT 0, "
+                    "desired_state INTEGER NOT NULL DEFAULT 0, "
+                    "restart_count INTEGER NOT NULL DEFAULT 0, "
+                    "crash_count INTEGER NOT NULL DEFAULT 0, "
+                    "updated_at INTEGER NOT NULL DEFAULT 0, "
+                    "PRIMARY KEY (type, tag))"))
+    {
+        log (QString("Could not create state table: %1").arg(query.lastError().text()), WMLogger::Error);
+        return false;
+    }
+
+    // Databases from before start_ticks; fails harmlessly once the column is there
+    query.exec("ALTER TABLE instances ADD COLUMN start_ticks INTEGER NOT NULL DEFAULT 0");
+
+    log (QString("State database opened at %1").arg(db.databaseName()), WMLogger::Info);
+    return true;
+}
+
+void WMStateStore::close()
+{
+    if (!db.isOpen())
+        return;
+
+    flush();
+
+    db.close();
+    db = QSqlDatabase();
+    QSqlDatabase::removeDatabase(connectionName);
+}
+
+bool WMStateStore::load()
+{
+    QSqlQuery query(db);
+
+    if (!query.exec("SELECT type, tag, pid, start_time, start_ticks, desired_state, restart_count, crash_count FROM instances"))
+    {
+        log (QString("Could not load instance state: %1").arg(query.lastError().text()), WMLogger::Warning);
+        return false;
+    }
+
+    states.clear();
+
+    while (query.next())
+    {
+        WMInstanceState state;
+        state.type = query.value(0).toString();
+        state.tag = query.value(1).toString();
+        state.pid = query.value(2).toInt();
+        state.startTime = query.value(3).toLongLong();
+        state.startTicks = query.value(4).toLongLong();
+        state.desiredState = query.value(5).toInt();
+        state.restartCount = query.value(6).toInt();
+        state.crashCount = query.value(7).toInt();
+
+        states.insert(keyFor(state.tag, state.type), state);
+    }
+
+    log (QString("Loaded runtime state of %1 instances").arg(states.count()));
+    return true;
+}
+
+WMInstanceState WMStateStore::state(QString tag, QString type)
+{
+    return stateRef(tag, type);
+}
+
+void WMStateStore::setPid(QString tag, QString type, int pid, qint64 startTime, qint64 startTicks)
+{
+    WMInstanceState &state = stateRef(tag, type);
+
+    state.pid = pid;
+    state.startTime = startTime;
+    state.startTicks = startTicks;
+
+    markDirty(keyFor(tag, type));
+}
+
+void WMStateStore::setDesiredState(QString tag, QString type, WMStateStore::DesiredState desired)
+{
+    WMInstanceState &state = stateRef(tag, type);
+
+    if (state.desiredState == desired)
+        return;
+
+    state.desiredState = desired;
+    markDirty(keyFor(tag, type));
+}
+
+void WMStateStore::countRestart(QString tag, QString type)
+{
+    stateRef(tag, type).restartCount++;
+    markDirty(keyFor(tag, type));
+}
+
+void WMStateStore::countCrash(QString tag, QString type)
+{
+    stateRef(tag, type).crashCount++;
+    markDirty(keyFor(tag, type));
+}
+
+void WMStateStore::flush()
+{
+    flushTimer->stop();
+
+    if (dirty.isEmpty() || !db.isOpen())
+        return;
+
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+
+    db.transaction();
+
+    QSqlQuery query(db);
+    query.prepare("INSERT OR REPLACE INTO instances "
+                  "(type, tag, pid, start_time, start_ticks, desired_state, restart_count, crash_count, updated_at) "
+                  "VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?)");
+
+    QSet<QString>::const_iterator it;
+    for (it = dirty.constBegin(); it != dirty.constEnd(); ++it)
+    {
+        const WMInstanceState &state = states[*it];
+
+        query.addBindValue(state.type);
+        query.addBindValue(state.tag);
+        query.addBindValue(state.pid);
+        query.addBindValue(state.startTime);
+        query.addBindValue(state.startTicks);
+        query.addBindValue(state.desiredState);
+        query.addBindValue(state.restartCount);
+        query.addBindValue(state.crashCount);
+        query.addBindValue(now);
+
+        if (!query.exec())
+            log (QString("Could not store state of %1: %2").arg(*it).arg(query.lastError().text()), WMLogger::Warning);
+    }
+
+    if (!db.commit())
+    {
+        log (QString("Could not commit instance state: %1").arg(db.lastError().text()), WMLogger::Warning);
+
+        // The dirty set stays; try again on the next interval rather than on the next change
+        db.rollback();
+        flushTimer->start();
+        return;
+    }
+
+    log (QString("Committed state of %1 instances").arg(dirty.count()));
+    dirty.clear();
+}
+
+QString WMStateStore::keyFor(QString tag, QString type)
+{
+    return type + "/" + tag;
+}
+
+WMInstanceState &WMStateStore::stateRef(QString tag, QString type)
+{
+    QString key = keyFor(tag, type);
+
+    if (!states.contains(key))
+    {
+        WMInstanceState state;
+        state.type = type;
+        state.tag = tag;
+        state.pid = 0;
+        state.startTime = 0;
+        state.startTicks = 0;
+        state.desiredState = Unknown;
+        state.restartCount = 0;
+        state.crashCount = 0;
+
+        states.insert(key, state);
+    }
+
+    return states[key];
+}
+
+void WMStateStore::markDirty(QString key)
+{
+    dirty.insert(key);
+
+    if (!flushTimer->isActive())
+        flushTimer->start();
+}
+
+void WMStateStore::log(QString message, WMLogger::LogLevel level)
+{
+    WMLogger::instance->log(message, level, "wstat");
+}
+
+void WMStateStore::onFlushTimer()
+{
+    WMLagMonitor::HandlerScope handlerScope("WMStateStore::onFlushTimer");
+    flush();
+}
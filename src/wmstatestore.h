@@ -0,0 +1,85 @@
+#ifndef WMSTATESTORE_H
+#define WMSTATESTORE_H
+
+#include <QObject>
+
+#include <QString>
+#include <QStringList>
+#include <QHash>
+#include <QSet>
+#include <QDir>
+#include <QTimer>
+#include <QDateTime>
+#include <QVariant>
+#include <QSqlDatabase>
+#include <QSqlQuery>
+#include <QSqlError>
+
+#include "wmlogger.h"
+#include "wmlagmonitor.h"
+
+struct WMInstanceState
+{
+    QString type;
+    QString tag;
+    int pid;
+    qint64 startTime;     // ms since epoch
+    qint64 startTicks;    // /proc/<pid>/stat field 22, what identifies the process
+    int desiredState;
+    int restartCount;
+    int crashCount;
+};
+
+// Runtime state of every instance, kept in a WAL-mode SQLite database
+// in runtime_dir/core. Reads are served from memory, writes are
+// collected and committed in one transaction per flush interval.
+class WMStateStore : public QObject
+{
+    Q_OBJECT
+public:
+
+    enum DesiredState {
+        Unknown,
+        Running,
+        Stopped
+    };
+
+    explicit WMStateStore(QString runtimeDir, int flushInterval = 100, QObject *parent = 0);
+    ~WMStateStore();
+
+    bool open();
+    void close();
+    bool load();
+
+    WMInstanceState state(QString tag, QString type);
+
+    void setPid(QString tag, QString type, int pid, qint64 startTime, qint64 startTicks);
+    void setDesiredState(QString tag, QString type, DesiredState state);
+    void countRestart(QString tag, QString type);
+    void countCrash(QString tag, QString type);
+
+    void flush();
+
+    static WMStateStore *instance;
+
+private:
+
+    QString runtimeDir;
+    QString connectionName;
+    QSqlDatabase db;
+
+    QHash<QString, WMInstanceState> states;
+    QSet<QString> dirty;
+    QTimer *flushTimer;
+
+    static QString keyFor(QString tag, QString type);
+    WMInstanceState &stateRef(QString tag, QString type);
+    void markDirty(QString key);
+
+    void log(QString message, WMLogger::LogLevel level = WMLogger::Debug);
+
+private slots:
+    void onFlushTimer();
+};
+
+#endif // WMSTATESTORE_H
@@ -0,0 +1,319 @@
+#include "wmstreamprobe.h"
+
+WMStreamProbe::WMStreamProbe(int interval, double minRatio, int failures, bool continuous,
+                             int burst, int window, QObject *parent) :
+    QObject(parent), interval(interval), minRatio(minRatio), failures(qMax(failures, 1)),
+    continuous(continuous), burst(qMax(burst, 0)), window(qMax(window, 100))
+{
+    // A round has to be over before the next one connects again
+    if (!continuous)
+        this->interval = qMax(interval, this->burst + this->window + 1000);
+
+    sampleTimer = new QTimer(this);
+    sampleTimer->setInterval(this->interval);
+    connect(sampleTimer, SIGNAL(timeout()), this, SLOT(onSampleTimer()));
+}
+
+WMStreamProbe::~WMStreamProbe()
+{
+    qDeleteAll(mounts);
+}
+
+void WMStreamProbe::addMount(QString tag, QUrl url, int bitrate, QString name)
+{
+    Mount *mount = new Mount;
+    mount->tag = tag;
+    mount->url = url;
+    mount->bitrate = bitrate;
+    mount->name = name;
+    mount->streaming = false;
+    mount->warm = false;
+    mount->sampling = false;
+    mount->bytes = 0;
+    mount->rate = 0;
+    mount->fallback = false;
+    mount->misses = 0;
+    mount->unhealthy = false;
+
+    mount->sock = new QTcpSocket(this);
+    sockets.insert(mount->sock, mount);
+
+    connect(mount->sock, SIGNAL(connected()), this, SLOT(onConnected()));
+    connect(mount->sock, SIGNAL(readyRead()), this, SLOT(onReadyRead()));
+
+    mounts.append(mount);
+}
+
+// Forget the mount's record, e.g. after its station has been restarted
+void WMStreamProbe::reset(QString tag)
+{
+    for (int i = 0; i < mounts.count(); i++)
+    {
+        Mount *mount = mounts.at(i);
+
+        if (mount->tag != tag)
+            continue;
+
+        mount->misses = 0;
+        mount->unhealthy = false;
+        mount->fallback = false;
+
+        if (continuous)
+            connectMount(mount);
+        else
+        {
+            // The next round samples the new stream
+            mount->sampling = false;
+            mount->sock->abort();
+        }
+    }
+}
+
+void WMStreamProbe::start()
+{
+    if (continuous)
+        log (QString("Probing %1 mounts continuously, sampling every %2 ms").arg(mounts.count()).arg(interval),
+             WMLogger::Info);
+    else
+        log (QString("Probing %1 mounts every %2 ms for %3 ms after a %4 ms burst").arg(mounts.count())
+             .arg(interval).arg(window).arg(burst), WMLogger::Info);
+
+    for (int i = 0; i < mounts.count(); i++)
+    {
+        connectMount(mounts.at(i));
+        mounts.at(i)->sampling = !continuous;
+    }
+
+    lastSample.start();
+    sampleTimer->start();
+}
+
+// tag rate/bitrate misses state
+QStringList WMStreamProbe::status()
+{
+    QStringList list;
+
+    for (int i = 0; i < mounts.count(); i++)
+    {
+        Mount *mount = mounts.at(i);
+        QString state = mount->unhealthy ? (mount->fallback ? "fallback" : "stalled") : (mount->warm ? "ok" : "warming");
+
+        list.append(QString("%1 %2/%3 %4 %5").arg(mount->tag).arg(mount->rate, 0, 'f', 1).arg(mount->bitrate)
+                    .arg(mount->misses).arg(state));
+    }
+
+    return list;
+}
+
+void WMStreamProbe::connectMount(Mount *mount)
+{
+    mount->header.clear();
+    mount->streaming = false;
+    mount->warm = false;
+    mount->fallback = false;
+    mount->bytes = 0;
+
+    mount->sock->abort();
+    mount->sock->connectToHost(mount->url.host(), mount->url.port(80));
+}
+
+// Periodic mode: the round of `mount` is over, however far it got
+void WMStreamProbe::finishSample(Mount *mount)
+{
+    qint64 measured = mount->streaming ? mount->clock.elapsed() - burst : 0;
+
+    // bytes per ms * 8 = kbit/s
+    mount->rate = measured > 0 ? mount->bytes * 8.0 / measured : 0;
+    mount->sampling = false;
+    mount->warm = true;
+    mount->sock->abort();
+
+    judge(mount);
+}
+
+void WMStreamProbe::judge(Mount *mount)
+{
+    if (!mount->fallback && mount->rate >= mount->bitrate * minRatio)
+    {
+        if (mount->unhealthy)
+        {
+            log (QString("Mount of %1 delivers %2 kbit/s again").arg(mount->tag).arg(mount->rate, 0, 'f', 1),
+                 WMLogger::Info);
+            emit recovered(mount->tag, mount->rate);
+        }
+
+        mount->misses = 0;
+        mount->unhealthy = false;
+        return;
+    }
+
+    mount->misses++;
+
+    if (mount->misses >= failures && !mount->unhealthy)
+    {
+        mount->unhealthy = true;
+
+        if (mount->fallback)
+            log (QString("Mount of %1 has been on its fallback for %2 samples").arg(mount->tag).arg(mount->misses),
+                 WMLogger::Warning);
+        else
+            log (QString("Mount of %1 delivers %2 of %3 kbit/s for %4 samples").arg(mount->tag)
+                 .arg(mount->rate, 0, 'f', 1).arg(mount->bitrate).arg(mount->misses), WMLogger::Warning);
+
+        emit stalled(mount->tag, mount->rate, mount->bitrate);
+    }
+}
+
+void WMStreamProbe::log(QString message, WMLogger::LogLevel level)
+{
+    WMLogger::instance->log(message, level, "wprob");
+}
+
+void WMStreamProbe::onSampleTimer()
+{
+    WMLagMonitor::HandlerScope handlerScope("WMStreamProbe::onSampleTimer");
+
+    if (!continuous)
+    {
+        for (int i = 0; i < mounts.count(); i++)
+        {
+            Mount *mount = mounts.at(i);
+
+            // Never got through its window: refused, stalled or silent
+            if (mount->sampling)
+                finishSample(mount);
+
+            connectMount(mount);
+            mount->sampling = true;
+        }
+
+        return;
+    }
+
+    qint64 elapsed = qMax(lastSample.restart(), (qint64)1);
+
+    for (int i = 0; i < mounts.count(); i++)
+    {
+        Mount *mount = mounts.at(i);
+        bool connected = mount->sock->state() == QAbstractSocket::ConnectedState && mount->streaming;
+
+        // bytes per ms * 8 = kbit/s
+        mount->rate = connected ? mount->bytes * 8.0 / elapsed : 0;
+        mount->bytes = 0;
+
+        if (connected && !mount->warm)
+        {
+            mount->warm = true;
+            continue;
+        }
+
+        judge(mount);
+
+        if (!connected && mount->sock->state() != QAbstractSocket::ConnectingState &&
+            mount->sock->state() != QAbstractSocket::HostLookupState)
+            connectMount(mount);
+    }
+}
+
+void WMStreamProbe::onConnected()
+{
+    QTcpSocket *sock = (QTcpSocket *)QObject::sender();
+    Mount *mount = sockets.value(sock);
+
+    QString path = mount->url.path(QUrl::FullyEncoded);
+    if (path.isEmpty())
+        path = "/";
+
+    sock->write(QString("GET %1 HTTP/1.0\r\nHost: %2\r\nUser-Agent: WMCore/%3\r\nIcy-MetaData: 0\r\n\r\n")
+                .arg(path).arg(mount->url.host()).arg(WMCORE_VERSION).toLatin1());
+}
+
+void WMStreamProbe::onReadyRead()
+{
+    QTcpSocket *sock = (QTcpSocket *)QObject::sender();
+    Mount *mount = sockets.value(sock);
+
+    if (mount->streaming)
+    {
+        if (continuous)
+        {
+            // Only the amount matters, nothing gets copied out
+            mount->bytes += sock->skip(sock->bytesAvailable());
+            return;
+        }
+
+        qint64 elapsed = mount->clock.elapsed();
+        qint64 skipped = sock->skip(sock->bytesAvailable());
+
+        if (elapsed >= burst)
+            mount->bytes += skipped;
+
+        if (elapsed >= burst + window)
+            finishSample(mount);
+
+        return;
+    }
+
+    mount->header.append(sock->readAll());
+    int end = mount->header.indexOf("\r\n\r\n");
+
+    if (end < 0)
+    {
+        if (mount->header.size() > 16384)
+            sock->abort();
+
+        return;
+    }
+
+    QList<QByteArray> lines = mount->header.left(end).split('\n');
+    QList<QByteArray> status = lines.first().trimmed().split(' ');
+
+    if (status.count() < 2 || status.at(1) != "200")
+    {
+        log (QString("Mount %1 of %2 answered \"%3\"").arg(mount->url.toString()).arg(mount->tag)
+             .arg(QString::fromLatin1(lines.first().trimmed())));
+        sock->abort();
+        return;
+    }
+
+    if (!mount->name.isEmpty())
+    {
+        QString name;
+
+        for (int i = 1; i < lines.count(); i++)
+        {
+            QByteArray line = lines.at(i).trimmed();
+
+            if (line.toLower().startsWith("icy-name:"))
+                name = QString::fromUtf8(line.mid(9).trimmed());
+        }
+
+        // Icecast serves the fallback's stream under the requested mount
+        mount->fallback = name != mount->name;
+
+        if (mount->fallback)
+        {
+            log (QString("Mount %1 of %2 streams \"%3\" instead of \"%4\"").arg(mount->url.toString())
+                 .arg(mount->tag).arg(name).arg(mount->name));
+
+            if (!continuous)
+            {
+                mount->rate = 0;
+                mount->sampling = false;
+                mount->warm = true;
+                sock->abort();
+                judge(mount);
+                return;
+            }
+        }
+    }
+
+    mount->streaming = true;
+    mount->clock.start();
+
+    // Periodic mode drops this along with the rest of the burst
+    if (continuous)
+        mount->bytes += mount->header.size() - end - 4;
+
+    mount->header.clear();
+}
@@ -0,0 +1,99 @@
+#ifndef WMSTREAMPROBE_H
+#define WMSTREAMPROBE_H
+
+#include <QObject>
+
+#include <QString>
+#include <QStringList>
+#include <QList>
+#include <QHash>
+#include <QUrl>
+#include <QTcpSocket>
+#include <QTimer>
+#include <QElapsedTimer>
+
+#include "wmlogger.h"
+#include "wmlagmonitor.h"
+
+// Compares the bytes every configured mount actually delivers over plain
+// HTTP with the mount's bitrate. A liquidsoap that is alive but no longer
+// feeding its mount shows up here only. The data is skipped unread.
+//
+// By default each mount is sampled once per interval: connect, throw away
+// Icecast's burst-on-connect, count for a short window, disconnect, so a
+// probe costs a listener slot and bandwidth for a few seconds only. That
+// gives up reusing connections: each mount keeps its socket, but it
+// reconnects every round. With `continuous` the connections stay open and
+// are reused for every sample instead, at the cost of one full-rate
+// listener per mount.
+//
+// tools/mount-standin.py serves a fake mount that can be stalled or moved
+// to a fallback name on signal, for checking both paths locally.
+//
+// When a source drops, Icecast moves its listeners to the mount's
+// fallback, which then delivers at full rate. Sampled mounts catch that
+// through the icy-name the fallback answers with, if the expected name is
+// configured; a continuous connection never sees new headers and misses it.
+class WMStreamProbe : public QObject
+{
+    Q_OBJECT
+public:
+    explicit WMStreamProbe(int interval, double minRatio, int failures, bool continuous,
+                           int burst, int window, QObject *parent = 0);
+    ~WMStreamProbe();
+
+    void addMount(QString tag, QUrl url, int bitrate, QString name = QString());
+    void reset(QString tag);
+    void start();
+
+    QStringList status();
+
+private:
+
+    struct Mount
+    {
+        QString tag;
+        QUrl url;
+        int bitrate;           // expected, kbit/s
+        QString name;          // expected icy-name, empty to not check
+        QTcpSocket *sock;
+        QByteArray header;
+        bool streaming;        // past the response header
+        bool warm;             // continuous: first sample after a connect is Icecast's burst
+        bool sampling;         // periodic: connected for the current round
+        QElapsedTimer clock;   // periodic: since the response header
+        qint64 bytes;
+        double rate;           // last sample, kbit/s
+        bool fallback;         // last sample came from another stream
+        int misses;
+        bool unhealthy;
+    };
+
+    int interval;
+    double minRatio;
+    int failures;
+    bool continuous;
+    int burst;
+    int window;
+
+    QList<Mount *> mounts;
+    QHash<QTcpSocket *, Mount *> sockets;
+    QTimer *sampleTimer;
+    QElapsedTimer lastSample;
+
+    void connectMount(Mount *mount);
+    void finishSample(Mount *mount);
+    void judge(Mount *mount);
+    void log(QString message, WMLogger::LogLevel level = WMLogger::Debug);
+
+signals:
+    void stalled(QString tag, double rate, int bitrate);
+    void recovered(QString tag, double rate);
+
+private slots:
+    void onSampleTimer();
+    void onConnected();
+    void onReadyRead();
+};
+
+#endif // WMSTREAMPROBE_H
@@ -0,0 +1,292 @@
+#include "wmsupervisor.h"
+
+#include <stdarg.h>
+
+extern char **environ;
+
+bool WMSupervisor::requested(int argc, char *argv[])
+{
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--supervise") == 0)
+            return true;
+    }
+
+    return false;
+}
+
+int WMSupervisor::run(int argc, char *argv[])
+{
+#ifdef __linux__
+    QString configFile;
+
+    for (int i = 1; i < argc - 1; i++)
+    {
+        if (strcmp(argv[i], "-c") == 0 || strcmp(argv[i], "--config") == 0)
+            configFile = QString::fromLocal8Bit(argv[i + 1]);
+    }
+
+    QSettings settings(configFile, QSettings::IniFormat);
+    QString runtimeDir = settings.value("paths/runtime_dir", "/var/run/wavemanager").toString();
+    QDir().mkpath(runtimeDir + "/core");
+    QByteArray journalPath = QString("%1/core/exits.journal").arg(runtimeDir).toLocal8Bit();
+
+    // Whatever is in there is about PIDs of an earlier boot or shim
+    truncateJournal(journalPath);
+
+    if (prctl(PR_SET_CHILD_SUBREAPER, 1) != 0)
+    {
+        log ("could not become a child subreaper: %s", strerror(errno));
+        return 1;
+    }
+
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGCHLD);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGHUP);
+    sigaddset(&signals, SIGUSR2);
+    sigprocmask(SIG_BLOCK, &signals, 0);
+
+    qputenv("WMCORE_SUPERVISOR_PID", QByteArray::number(getpid()));
+
+    // Resolved by path once, so a restart after an upgrade runs the new binary
+    char exe[4096];
+    ssize_t exeLength = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+    QByteArray program = (exeLength > 0) ? QByteArray(exe, exeLength) : QByteArray(argv[0]);
+
+    int core = spawnCore(program, argc, argv);
+    if (core < 0)
+        return 1;
+
+    qint64 coreStarted = monotonicTime();
+    int quickDeaths = 0;
+    qint64 restartAt = 0;   // monotonic s of the next restart while core < 0
+    bool stopping = false;
+
+    for (;;)
+    {
+        siginfo_t info;
+        int signo;
+
+        if (core < 0)
+        {
+            // Waiting on signals instead of sleeping keeps TERM and orphans handled meanwhile
+            struct timespec timeout;
+            timeout.tv_sec = qMax(restartAt - monotonicTime(), (qint64)0);
+            timeout.tv_nsec = 0;
+
+            signo = sigtimedwait(&signals, &info, &timeout);
+
+            if (signo < 0 && errno == EAGAIN)
+            {
+                // Nobody reads the journal in between and the next wmcored skips what is there anyway
+                truncateJournal(journalPath);
+
+                core = spawnCore(program, argc, argv);
+                coreStarted = monotonicTime();
+
+                if (core < 0)
+                {
+                    int delay = nextDelay(quickDeaths, true);
+
+                    if (delay < 0)
+                        return 1;
+
+                    restartAt = monotonicTime() + delay;
+                }
+
+                continue;
+            }
+        }
+            else
+        {
+            signo = sigwaitinfo(&signals, &info);
+        }
+
+        if (signo < 0)
+            continue;
+
+        if (info.si_signo != SIGCHLD)
+        {
+            // The shim is what the init system sees, pass control signals on
+            if (info.si_signo == SIGTERM || info.si_signo == SIGINT)
+                stopping = true;
+
+            if (core > 0)
+                kill(core, info.si_signo);
+            else if (stopping)
+            {
+                log ("stopping while wmcored is down");
+                return 0;
+            }
+
+            continue;
+        }
+
+        for (;;)
+        {
+            siginfo_t child;
+            child.si_pid = 0;
+
+            if (waitid(P_ALL, 0, &child, WEXITED | WNOHANG) != 0 || child.si_pid == 0)
+                break;
+
+            int exitCode = (child.si_code == CLD_EXITED) ? child.si_status : 128 + child.si_status;
+
+            if (child.si_pid != core)
+            {
+                journal(journalPath, child.si_pid, exitCode);
+                continue;
+            }
+
+            if (stopping)
+            {
+                log ("wmcored exited with code %d, stopping", exitCode);
+                return exitCode;
+            }
+
+            bool quick = monotonicTime() - coreStarted < stableUptime;
+            log ("wmcored died with code %d after %d s", exitCode, (int)(monotonicTime() - coreStarted));
+
+            core = -1;
+            int delay = nextDelay(quickDeaths, quick);
+
+            if (delay < 0)
+                return 1;
+
+            restartAt = monotonicTime() + delay;
+        }
+    }
+#else
+    Q_UNUSED(argc);
+    Q_UNUSED(argv);
+
+    log ("--supervise is only supported on Linux");
+    return 1;
+#endif
+}
+
+int WMSupervisor::spawnCore(QByteArray program, int argc, char *argv[])
+{
+#ifdef __linux__
+    QVector<char *> args;
+    for (int i = 0; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--supervise") != 0)
+            args.append(argv[i]);
+    }
+    args.append(0);
+
+    posix_spawnattr_t attributes;
+    posix_spawnattr_init(&attributes);
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    posix_spawnattr_setsigmask(&attributes, &mask);
+    posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETSIGMASK);
+
+    pid_t pid;
+    int result = posix_spawn(&pid, program.constData(), 0, &attributes, args.data(), environ);
+    posix_spawnattr_destroy(&attributes);
+
+    if (result != 0)
+    {
+        log ("could not start wmcored: %s", strerror(result));
+        return -1;
+    }
+
+    log ("started wmcored as PID %d", (int)pid);
+    return pid;
+#else
+    Q_UNUSED(program);
+    Q_UNUSED(argc);
+    Q_UNUSED(argv);
+    return -1;
+#endif
+}
+
+// A wmcored that dies soon after its start, e.g. on a bad config, gets
+// restarted with a doubling delay, and only so many times in a row;
+// -1 means give up and leave it to the init system
+int WMSupervisor::nextDelay(int &quickDeaths, bool quick)
+{
+    quickDeaths = quick ? quickDeaths + 1 : 0;
+
+    if (quickDeaths > restartAttempts)
+    {
+        log ("wmcored died %d times in a row within %d s of its start, giving up", quickDeaths, (int)stableUptime);
+        return -1;
+    }
+
+    int delay = restartDelay;
+    for (int i = 1; i < quickDeaths && delay < maxRestartDelay; i++)
+        delay *= 2;
+
+    delay = qMin(delay, (int)maxRestartDelay);
+    log ("restarting wmcored in %d s", delay);
+    return delay;
+}
+
+qint64 WMSupervisor::monotonicTime()
+{
+#ifdef __linux__
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec;
+#else
+    return 0;
+#endif
+}
+
+void WMSupervisor::journal(QByteArray path, int pid, int exitCode)
+{
+#ifdef __linux__
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    char line[64];
+    int length = snprintf(line, sizeof(line), "%d %d %lld\n", pid, exitCode,
+                          (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000);
+
+    // One O_APPEND write per line keeps lines whole for the reader
+    int fd = open(path.constData(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+
+    if (fd < 0 || write(fd, line, length) != length)
+        log ("could not journal the exit of orphan %d: %s", pid, strerror(errno));
+
+    if (fd >= 0)
+        close(fd);
+#else
+    Q_UNUSED(path);
+    Q_UNUSED(pid);
+    Q_UNUSED(exitCode);
+#endif
+}
+
+void WMSupervisor::truncateJournal(QByteArray path)
+{
+#ifdef __linux__
+    int fd = open(path.constData(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+    if (fd < 0)
+        log ("could not truncate the exit journal: %s", strerror(errno));
+    else
+        close(fd);
+#else
+    Q_UNUSED(path);
+#endif
+}
+
+void WMSupervisor::log(const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+
+    fprintf(stderr, "wmcored supervisor: ");
+    vfprintf(stderr, format, args);
+    fprintf(stderr, "\n");
+
+    va_end(args);
+}
@@ -0,0 +1,50 @@
+#ifndef WMSUPERVISOR_H
+#define WMSUPERVISOR_H
+
+#include <QString>
+#include <QByteArray>
+#include <QSettings>
+#include <QDir>
+#include <QVector>
+
+#ifdef __linux__
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <spawn.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#endif
+
+// The --supervise shim: a tiny parent that marks itself a child subreaper,
+// runs the real wmcored as its child and restarts it if it dies. Stations
+// orphaned by a dead wmcored are reparented to the shim, which reaps them
+// and appends "<pid> <exit code> <ms since epoch>" to the exit journal,
+// where the next wmcored picks up their real exit codes (see WMExitJournal).
+// No event loop and no WMLogger here, the shim has to outlive them.
+class WMSupervisor
+{
+public:
+    static bool requested(int argc, char *argv[]);
+    static int run(int argc, char *argv[]);
+
+private:
+    static int spawnCore(QByteArray program, int argc, char *argv[]);
+    static int nextDelay(int &quickDeaths, bool quick);
+    static qint64 monotonicTime();
+    static void journal(QByteArray path, int pid, int exitCode);
+    static void truncateJournal(QByteArray path);
+    static void log(const char *format, ...);
+
+    static const int restartDelay = 1;      // s, doubled after every quick death
+    static const int maxRestartDelay = 30;  // s
+    static const int stableUptime = 30;     // s, a death before that counts as quick
+    static const int restartAttempts = 6;   // quick deaths in a row, then exit so the init system takes over
+};
+
+#endif // WMSUPERVISOR_H
@@ -0,0 +1,222 @@
+#include "wmtimerwheel.h"
+
+WMTimerWheel *WMTimerWheel::instance = 0;
+
+WMTimerWheel::WMTimerWheel(int resolution, QObject *parent) :
+    QObject(parent), resolution(qMax(resolution, 1)), currentTick(0), count(0)
+{
+    buckets.fill(-1, rootSize + levelCount * levelSize);
+    clock.start();
+
+    tickTimer = new QTimer(this);
+    tickTimer->setInterval(this->resolution);
+    tickTimer->setTimerType(Qt::PreciseTimer);
+    connect(tickTimer, SIGNAL(timeout()), this, SLOT(onTick()));
+}
+
+WMTimerWheel::TimerId WMTimerWheel::schedule(int msec, QObject *receiver, const char *slot)
+{
+    // An idle wheel doesn't tick, catch up before placing anything
+    if (count == 0)
+    {
+        currentTick = clock.elapsed() / resolution;
+        tickTimer->start();
+    }
+
+    int index;
+
+    if (!freeEntries.isEmpty())
+        index = freeEntries.takeLast();
+    else
+    {
+        Entry entry;
+        entry.generation = 1;
+        entries.append(entry);
+        index = entries.count() - 1;
+    }
+
+    Entry &entry = entries[index];
+    entry.expires = currentTick + qMax((msec + resolution - 1) / resolution, 1);
+    entry.receiver = receiver;
+    entry.slot = slot;
+
+    place(index);
+    count++;
+
+    return ((TimerId)entry.generation << 32) | (quint32)index;
+}
+
+bool WMTimerWheel::cancel(TimerId id)
+{
+    int index = (int)(id & 0xffffffff);
+    quint32 generation = (quint32)(id >> 32);
+
+    if (id == 0 || index >= entries.count() || entries.at(index).generation != generation ||
+        entries.at(index).bucket == -1)
+        return false;
+
+    // -2: already taken off the wheel as due this tick, see advance()
+    if (entries.at(index).bucket >= 0)
+        unlink(index);
+    else
+        entries[index].bucket = -1;
+
+    release(index);
+    return true;
+}
+
+int WMTimerWheel::pending()
+{
+    return count;
+}
+
+void WMTimerWheel::place(int index)
+{
+    Entry &entry = entries[index];
+    qint64 delta = entry.expires - currentTick;
+    int bucket;
+
+    if (delta < rootSize)
+        bucket = entry.expires & (rootSize - 1);
+    else
+    {
+        int level = 0;
+        qint64 span = (qint64)rootSize << levelBits;
+
+        while (level < levelCount - 1 && delta >= span)
+        {
+            level++;
+            span <<= levelBits;
+        }
+
+        // Beyond the last level: park it in the farthest slot, it gets placed again on cascade
+        qint64 expires = qMin(entry.expires, currentTick + span - 1);
+        int shift = rootBits + level * levelBits;
+
+        bucket = rootSize + level * levelSize + (int)((expires >> shift) & (levelSize - 1));
+    }
+
+    entry.bucket = bucket;
+    entry.prev = -1;
+    entry.next = buckets.at(bucket);
+
+    if (entry.next >= 0)
+        entries[entry.next].prev = index;
+
+    buckets[bucket] = index;
+}
+
+void WMTimerWheel::unlink(int index)
+{
+    Entry &entry = entries[index];
+
+    if (entry.prev >= 0)
+        entries[entry.prev].next = entry.next;
+    else
+        buckets[entry.bucket] = entry.next;
+
+    if (entry.next >= 0)
+        entries[entry.next].prev = entry.prev;
+
+    entry.bucket = -1;
+}
+
+void WMTimerWheel::release(int index)
+{
+    Entry &entry = entries[index];
+
+    entry.generation++;
+    entry.receiver = 0;
+    entry.slot = 0;
+
+    freeEntries.append(index);
+    count--;
+}
+
+// Moves one slot of an upper level down, now that its entries are close enough
+void WMTimerWheel::cascade(int level)
+{
+    int shift = rootBits + level * levelBits;
+    int bucket = rootSize + level * levelSize + (int)((currentTick >> shift) & (levelSize - 1));
+    int index = buckets.at(bucket);
+
+    buckets[bucket] = -1;
+
+    while (index >= 0)
+    {
+        int next = entries.at(index).next;
+        place(index);
+        index = next;
+    }
+}
+
+void WMTimerWheel::advance()
+{
+    currentTick++;
+
+    for (int level = 0; level < levelCount; level++)
+    {
+        int shift = rootBits + level * levelBits;
+
+        if ((currentTick & (((qint64)1 << shift) - 1)) != 0)
+            break;
+
+        cascade(level);
+    }
+
+    int bucket = currentTick & (rootSize - 1);
+    int index = buckets.at(bucket);
+
+    // Detach the whole slot first: callbacks may schedule into it or cancel
+    buckets[bucket] = -1;
+
+    QVector<int> due;
+    while (index >= 0)
+    {
+        entries[index].bucket = -2;
+        due.append(index);
+        index = entries.at(index).next;
+    }
+
+    for (int i = 0; i < due.count(); i++)
+    {
+        int current = due.at(i);
+
+        // Cancelled by an earlier callback of this very tick
+        if (entries.at(current).bucket != -2)
+            continue;
+
+        if (entries.at(current).expires > currentTick)
+        {
+            place(current);
+            continue;
+        }
+
+        QPointer<QObject> receiver = entries.at(current).receiver;
+        const char *slot = entries.at(current).slot;
+
+        entries[current].bucket = -1;
+        release(current);
+
+        if (receiver != NULL)
+            QMetaObject::invokeMethod(receiver, slot, Qt::DirectConnection);
+    }
+}
+
+void WMTimerWheel::log(QString message, WMLogger::LogLevel level)
+{
+    WMLogger::instance->log(message, level, "wtime");
+}
+
+void WMTimerWheel::onTick()
+{
+    WMLagMonitor::HandlerScope handlerScope("WMTimerWheel::onTick");
+
+    qint64 target = clock.elapsed() / resolution;
+
+    while (currentTick < target && count > 0)
+        advance();
+
+    if (count == 0)
+        tickTimer->stop();
+}
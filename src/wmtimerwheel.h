@@ -0,0 +1,79 @@
+#ifndef WMTIMERWHEEL_H
+#define WMTIMERWHEEL_H
+
+#include <QObject>
+
+#include <QVector>
+#include <QPointer>
+#include <QTimer>
+#include <QElapsedTimer>
+#include <QMetaObject>
+
+#include "wmlogger.h"
+#include "wmlagmonitor.h"
+
+// One hierarchical timing wheel for all per-instance and per-client
+// timeouts: 256 slots of one tick, then three levels of 64 slots that
+// cascade down as time passes (about 7.7 days at 10 ms ticks). Schedule
+// and cancel are O(1); a single QTimer drives it and only runs while
+// something is pending.
+class WMTimerWheel : public QObject
+{
+    Q_OBJECT
+public:
+    typedef quint64 TimerId;   // 0 is never a valid id
+
+    explicit WMTimerWheel(int resolution = 10, QObject *parent = 0);
+
+    // slot is a slot name without signature, e.g. "onKillTimer", and
+    // must outlive the timer (a string literal)
+    TimerId schedule(int msec, QObject *receiver, const char *slot);
+    bool cancel(TimerId id);
+
+    int pending();
+
+    static WMTimerWheel *instance;
+
+private:
+
+    struct Entry
+    {
+        quint32 generation;
+        qint64 expires;        // tick
+        QPointer<QObject> receiver;
+        const char *slot;
+        int bucket;            // -1 while the entry is free
+        int prev;
+        int next;
+    };
+
+    static const int rootBits = 8;
+    static const int levelBits = 6;
+    static const int levelCount = 3;
+    static const int rootSize = 1 << rootBits;
+    static const int levelSize = 1 << levelBits;
+
+    int resolution;
+    qint64 currentTick;
+    int count;
+
+    QVector<Entry> entries;
+    QVector<int> freeEntries;
+    QVector<int> buckets;      // list heads: the root level, then each upper level
+
+    QElapsedTimer clock;
+    QTimer *tickTimer;
+
+    void place(int index);
+    void unlink(int index);
+    void release(int index);
+    void cascade(int level);
+    void advance();
+
+    void log(QString message, WMLogger::LogLevel level = WMLogger::Debug);
+
+private slots:
+    void onTick();
+};
+
+#endif // WMTIMERWHEEL_H
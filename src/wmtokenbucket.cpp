@@ -0,0 +1,38 @@
+#include "wmtokenbucket.h"
+
+WMTokenBucket::WMTokenBucket(double rate, double burst) :
+    rate(rate), burst(qMax(burst, 1.0)), tokens(qMax(burst, 1.0)), lastRefill(-1)
+{
+
+}
+
+bool WMTokenBucket::take(qint64 now)
+{
+    if (rate <= 0)
+        return true;
+
+    refill(now);
+
+    if (tokens < 1.0)
+        return false;
+
+    tokens -= 1.0;
+    return true;
+}
+
+bool WMTokenBucket::isFull(qint64 now)
+{
+    if (rate <= 0)
+        return true;
+
+    refill(now);
+    return tokens >= burst;
+}
+
+void WMTokenBucket::refill(qint64 now)
+{
+    if (lastRefill >= 0 && now > lastRefill)
+        tokens = qMin(burst, tokens + (now - lastRefill) * rate / 1000.0);
+
+    lastRefill = now;
+}
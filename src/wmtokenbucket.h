@@ -0,0 +1,25 @@
+#ifndef WMTOKENBUCKET_H
+#define WMTOKENBUCKET_H
+
+#include <QtGlobal>
+
+// Classic token bucket: refills at `rate` tokens per second up to `burst`.
+// A zero rate means no limit at all.
+class WMTokenBucket
+{
+public:
+    WMTokenBucket(double rate = 0, double burst = 0);
+
+    bool take(qint64 now);     // now in ms, monotonic
+    bool isFull(qint64 now);
+
+private:
+    double rate;
+    double burst;
+    double tokens;
+    qint64 lastRefill;
+
+    void refill(qint64 now);
+};
+
+#endif // WMTOKENBUCKET_H
@@ -0,0 +1,344 @@
+#include "wmtracer.h"
+
+WMTracer *WMTracer::instance = 0;
+
+WMTracer::Span::Span(const char *name, const char *category, QString tag, QString type) :
+    name(name), category(category), tag(tag), type(type)
+{
+    if (WMTracer::instance != 0 && WMTracer::instance->isEnabled())
+        startedAt = WMTracer::instance->now();
+    else
+        startedAt = -1;
+}
+
+WMTracer::Span::~Span()
+{
+    if (startedAt < 0 || WMTracer::instance == 0 || !WMTracer::instance->isEnabled())
+        return;
+
+    WMTracer::instance->complete(name, category, startedAt, tag, type, detail);
+}
+
+void WMTracer::Span::setTarget(QString tag, QString type)
+{
+    this->tag = tag;
+    this->type = type;
+}
+
+void WMTracer::Span::setDetail(QString detail)
+{
+    this->detail = detail;
+}
+
+WMTracer::WMTracer(QString traceDir, QObject *parent) :
+    QObject(parent), traceDir(traceDir), enabled(false), events(0), writer(0)
+{
+    clock.start();
+
+    flushTimer = new QTimer(this);
+    flushTimer->setInterval(flushInterval);
+    connect(flushTimer, SIGNAL(timeout()), this, SLOT(onFlushTimer()));
+}
+
+WMTracer::~WMTracer()
+{
+    stop();
+}
+
+bool WMTracer::start(QString fileName)
+{
+    if (enabled)
+    {
+        log (QString("Tracing is already running into %1").arg(traceFileName), WMLogger::Warning);
+        return false;
+    }
+
+    if (fileName.isEmpty())
+        fileName = QString("wmcored-%1.json").arg(QDateTime::currentDateTime().toString("yyyyMMdd-hhmmss"));
+
+    // Only plain file names are accepted, traces always go to the trace directory
+    if (fileName.contains('/') || fileName.startsWith('.'))
+    {
+        log (QString("Refusing to write a trace to %1").arg(fileName), WMLogger::Warning);
+        return false;
+    }
+
+    if (!QDir().mkpath(traceDir))
+    {
+        log (QString("Could not create trace directory %1").arg(traceDir), WMLogger::Warning);
+        return false;
+    }
+
+    QString path = QString("%1/%2").arg(traceDir).arg(fileName);
+
+    writer = new WMTraceWriter(path);
+
+    if (!writer->open())
+    {
+        log (QString("Could not open trace file %1 for write!").arg(path), WMLogger::Warning);
+        delete writer;
+        writer = 0;
+        return false;
+    }
+
+    writer->start(QThread::LowPriority);
+
+    traceFileName = path;
+    events = 0;
+    enabled = true;
+    flushTimer->start();
+
+    log (QString("Tracing started, writing to %1").arg(path), WMLogger::Info);
+    return true;
+}
+
+void WMTracer::stop()
+{
+    if (!enabled)
+        return;
+
+    flush();
+
+    enabled = false;
+    flushTimer->stop();
+
+    writer->finish();
+    writer->wait();
+    delete writer;
+    writer = 0;
+
+    log (QString("Tracing stopped, %1 events written to %2").arg(events).arg(traceFileName), WMLogger::Info);
+}
+
+bool WMTracer::isEnabled()
+{
+    return enabled;
+}
+
+QString WMTracer::fileName()
+{
+    return traceFileName;
+}
+
+quint64 WMTracer::eventCount()
+{
+    return events;
+}
+
+qint64 WMTracer::now()
+{
+    return clock.nsecsElapsed() / 1000;
+}
+
+void WMTracer::complete(const char *name, const char *category, qint64 startedAt,
+                        QString tag, QString type, QString detail)
+{
+    if (!enabled)
+        return;
+
+    WMTraceEvent event;
+    event.name = name;
+    event.category = category;
+    event.phase = 'X';
+    event.timestamp = startedAt;
+    event.duration = now() - startedAt;
+    event.id = 0;
+    event.tag = tag;
+    event.type = type;
+    event.detail = detail;
+
+    append(event);
+}
+
+void WMTracer::instant(const char *name, const char *category, QString tag, QString type, QString detail)
+{
+    if (!enabled)
+        return;
+
+    WMTraceEvent event;
+    event.name = name;
+    event.category = category;
+    event.phase = 'i';
+    event.timestamp = now();
+    event.duration = 0;
+    event.id = 0;
+    event.tag = tag;
+    event.type = type;
+    event.detail = detail;
+
+    append(event);
+}
+
+void WMTracer::begin(const char *name, const char *category, quint64 id, QString tag, QString type)
+{
+    if (!enabled)
+        return;
+
+    WMTraceEvent event;
+    event.name = name;
+    event.category = category;
+    event.phase = 'b';
+    event.timestamp = now();
+    event.duration = 0;
+    event.id = id;
+    event.tag = tag;
+    event.type = type;
+
+    append(event);
+}
+
+void WMTracer::end(const char *name, const char *category, quint64 id, QString tag, QString type, QString detail)
+{
+    if (!enabled)
+        return;
+
+    WMTraceEvent event;
+    event.name = name;
+    event.category = category;
+    event.phase = 'e';
+    event.timestamp = now();
+    event.duration = 0;
+    event.id = id;
+    event.tag = tag;
+    event.type = type;
+    event.detail = detail;
+
+    append(event);
+}
+
+quint64 WMTracer::spanId(QString tag, QString type)
+{
+    return qHash(type + "/" + tag);
+}
+
+void WMTracer::append(const WMTraceEvent &event)
+{
+    buffer.append(event);
+    events++;
+
+    if (buffer.count() >= flushThreshold)
+        flush();
+}
+
+void WMTracer::flush()
+{
+    if (buffer.isEmpty() || writer == 0)
+        return;
+
+    writer->enqueue(buffer);
+}
+
+void WMTracer::log(QString message, WMLogger::LogLevel level)
+{
+    WMLogger::instance->log(message, level, "wtrce");
+}
+
+void WMTracer::onFlushTimer()
+{
+    flush();
+}
+
+WMTraceWriter::WMTraceWriter(QString fileName, QObject *parent) :
+    QThread(parent), file(fileName), first(true), finishing(false)
+{
+    pid = QCoreApplication::applicationPid();
+}
+
+bool WMTraceWriter::open()
+{
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+        return false;
+
+    file.write("[\n");
+    return true;
+}
+
+void WMTraceWriter::enqueue(QVector<WMTraceEvent> &events)
+{
+    mutex.lock();
+
+    if (pending.isEmpty())
+        pending.swap(events);
+    else
+        pending += events;
+
+    events.clear();
+
+    condition.wakeOne();
+    mutex.unlock();
+}
+
+void WMTraceWriter::finish()
+{
+    mutex.lock();
+    finishing = true;
+    condition.wakeOne();
+    mutex.unlock();
+}
+
+void WMTraceWriter::run()
+{
+    bool done = false;
+
+    while (!done)
+    {
+        QVector<WMTraceEvent> batch;
+
+        mutex.lock();
+        while (pending.isEmpty() && !finishing)
+            condition.wait(&mutex);
+
+        batch.swap(pending);
+        done = finishing;
+        mutex.unlock();
+
+        write(batch);
+    }
+
+    file.write("\n]\n");
+    file.close();
+}
+
+void WMTraceWriter::write(const QVector<WMTraceEvent> &events)
+{
+    for (int i = 0; i < events.count(); i++)
+    {
+        const WMTraceEvent &event = events.at(i);
+
+        QJsonObject object;
+        object.insert("name", QString(event.name));
+        object.insert("cat", QString(event.category));
+        object.insert("ph", QString(QChar(event.phase)));
+        object.insert("ts", (double)event.timestamp);
+        object.insert("pid", (double)pid);
+        object.insert("tid", 1);
+
+        if (event.phase == 'X')
+            object.insert("dur", (double)event.duration);
+
+        if (event.phase == 'b' || event.phase == 'e')
+            object.insert("id", QString("0x%1").arg(event.id, 0, 16));
+
+        if (event.phase == 'i')
+            object.insert("s", QString("t"));
+
+        QJsonObject args;
+        if (!event.tag.isEmpty())
+            args.insert("tag", event.tag);
+        if (!event.type.isEmpty())
+            args.insert("type", event.type);
+        if (!event.detail.isEmpty())
+            args.insert("detail", event.detail);
+
+        if (!args.isEmpty())
+            object.insert("args", args);
+
+        if (!first)
+            file.write(",\n");
+
+        file.write(QJsonDocument(object).toJson(QJsonDocument::Compact));
+        first = false;
+    }
+
+    file.flush();
+}
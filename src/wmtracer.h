@@ -0,0 +1,144 @@
+#ifndef WMTRACER_H
+#define WMTRACER_H
+
+#include <QObject>
+
+#include <QString>
+#include <QStringList>
+#include <QVector>
+#include <QFile>
+#include <QDir>
+#include <QTimer>
+#include <QThread>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QElapsedTimer>
+#include <QDateTime>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QCoreApplication>
+
+#include "wmlogger.h"
+
+class WMTraceWriter;
+
+// One Chrome trace-event, kept raw until the writer thread serializes it
+struct WMTraceEvent
+{
+    const char *name;
+    const char *category;
+    char phase;
+    qint64 timestamp;  // us
+    qint64 duration;   // us, complete events only
+    quint64 id;        // async events only
+    QString tag;
+    QString type;
+    QString detail;
+};
+
+// Writes Chrome/Perfetto trace-event JSON. Events are buffered in memory
+// on the event loop and handed over to a writer thread in batches.
+class WMTracer : public QObject
+{
+    Q_OBJECT
+public:
+
+    // Emits a complete ('X') event covering the lifetime of the scope
+    class Span
+    {
+    public:
+        explicit Span(const char *name, const char *category,
+                      QString tag = QString(), QString type = QString());
+        ~Span();
+
+        void setTarget(QString tag, QString type);
+        void setDetail(QString detail);
+
+    private:
+        const char *name;
+        const char *category;
+        QString tag;
+        QString type;
+        QString detail;
+        qint64 startedAt;
+    };
+
+    explicit WMTracer(QString traceDir, QObject *parent = 0);
+    ~WMTracer();
+
+    bool start(QString fileName = QString());
+    void stop();
+
+    bool isEnabled();
+    QString fileName();
+    quint64 eventCount();
+
+    qint64 now();
+
+    void complete(const char *name, const char *category, qint64 startedAt,
+                  QString tag = QString(), QString type = QString(), QString detail = QString());
+    void instant(const char *name, const char *category,
+                 QString tag = QString(), QString type = QString(), QString detail = QString());
+
+    // Async spans crossing several callbacks, paired by category and id
+    void begin(const char *name, const char *category, quint64 id,
+               QString tag = QString(), QString type = QString());
+    void end(const char *name, const char *category, quint64 id,
+             QString tag = QString(), QString type = QString(), QString detail = QString());
+
+    static quint64 spanId(QString tag, QString type);
+
+    static WMTracer *instance;
+
+private:
+
+    QString traceDir;
+    QString traceFileName;
+
+    bool enabled;
+    quint64 events;
+
+    QElapsedTimer clock;
+    QTimer *flushTimer;
+    WMTraceWriter *writer;
+    QVector<WMTraceEvent> buffer;
+
+    static const int flushInterval = 250;  // ms
+    static const int flushThreshold = 1024;
+
+    void append(const WMTraceEvent &event);
+    void flush();
+
+    void log(QString message, WMLogger::LogLevel level = WMLogger::Debug);
+
+private slots:
+    void onFlushTimer();
+};
+
+class WMTraceWriter : public QThread
+{
+    Q_OBJECT
+public:
+    explicit WMTraceWriter(QString fileName, QObject *parent = 0);
+
+    bool open();
+    void enqueue(QVector<WMTraceEvent> &events);
+    void finish();
+
+protected:
+    void run();
+
+private:
+    QFile file;
+    qint64 pid;
+    bool first;
+    bool finishing;
+
+    QMutex mutex;
+    QWaitCondition condition;
+    QVector<WMTraceEvent> pending;
+
+    void write(const QVector<WMTraceEvent> &events);
+};
+
+#endif // WMTRACER_H
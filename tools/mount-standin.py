@@ -0,0 +1,89 @@
+#!/usr/bin/env python3
+# Local stand-in for an Icecast mount, to check WMStreamProbe without one.
+#
+# Serves every GET as an endless stream at --kbps, after an Icecast-like
+# --burst on connect. While it runs:
+#   SIGUSR1  toggles a stall: connections stay open, no more data is sent
+#   SIGUSR2  toggles the fallback: new connections get --fallback-name as
+#            their icy-name, like listeners Icecast moved to a fallback mount
+#
+# Example, with [probe_mounts] main = http://127.0.0.1:8010/main 128 Main:
+#   tools/mount-standin.py --port 8010 --kbps 128 --name Main &
+#   kill -USR1 %1    # the probe reports main as stalled after `failures` samples
+#   kill -USR1 %1    # ... and as recovered
+#   kill -USR2 %1    # the probe reports main as on its fallback
+
+import argparse
+import signal
+import socketserver
+import sys
+import threading
+import time
+
+state = {"stalled": False, "fallback": False}
+
+
+def log(message):
+    sys.stderr.write("mount-standin: %s\n" % message)
+
+
+def toggle(key):
+    def handler(signum, frame):
+        state[key] = not state[key]
+        log("%s %s" % (key, "on" if state[key] else "off"))
+    return handler
+
+
+class Mount(socketserver.StreamRequestHandler):
+    def handle(self):
+        request = self.rfile.readline().decode("latin-1").strip()
+
+        while self.rfile.readline() not in (b"\r\n", b"\n", b""):
+            pass
+
+        name = args.fallback_name if state["fallback"] else args.name
+        log("%s from %s, serving \"%s\"" % (request, self.client_address[0], name))
+
+        header = ("HTTP/1.0 200 OK\r\n"
+                  "Content-Type: audio/mpeg\r\n"
+                  "icy-name: %s\r\n"
+                  "icy-br: %d\r\n"
+                  "\r\n" % (name, args.kbps))
+
+        chunk = b"\0" * (args.kbps * 1000 // 8 // 10)  # 100 ms worth
+
+        try:
+            self.wfile.write(header.encode("utf-8"))
+            self.wfile.write(b"\0" * (args.burst * 1024))
+
+            while True:
+                time.sleep(0.1)
+
+                if not state["stalled"]:
+                    self.wfile.write(chunk)
+        except (BrokenPipeError, ConnectionResetError):
+            log("%s went away" % self.client_address[0])
+
+
+class Server(socketserver.ThreadingTCPServer):
+    allow_reuse_address = True
+    daemon_threads = True
+
+
+parser = argparse.ArgumentParser(description="Serve a fake Icecast mount at a fixed rate")
+parser.add_argument("--port", type=int, default=8010)
+parser.add_argument("--kbps", type=int, default=128, help="delivery rate in kbit/s")
+parser.add_argument("--burst", type=int, default=64, help="KiB sent at once on connect")
+parser.add_argument("--name", default="Main", help="icy-name of the mount")
+parser.add_argument("--fallback-name", default="Fallback", help="icy-name once SIGUSR2 moved us to the fallback")
+args = parser.parse_args()
+
+signal.signal(signal.SIGUSR1, toggle("stalled"))
+signal.signal(signal.SIGUSR2, toggle("fallback"))
+
+server = Server(("127.0.0.1", args.port), Mount)
+log("serving on 127.0.0.1:%d at %d kbit/s" % (args.port, args.kbps))
+threading.Thread(target=server.serve_forever, daemon=True).start()
+
+while True:
+    signal.pause()